@@ -54,17 +54,20 @@ void monitor_init(HMODULE module_handle)
     // Re-initialize capstone with our custom allocator which is now
     // accessible after native_init().
     hook_init2();
+    hook_disable_apis(cfg.disable_hooks);
 
     misc_init(cfg.shutdown_mutex);
     diffing_init(cfg.hashes_path, cfg.diffing_enable);
 
     copy_init();
-    log_init(cfg.logpipe, cfg.track);
+    log_init(cfg.logpipe, cfg.track, cfg.log_batch_size,
+        cfg.log_flush_interval);
     ignore_init();
 
     misc_init2(&monitor_hook, &monitor_unhook);
 
     sleep_init(cfg.first_process, cfg.force_sleep_skip, cfg.startup_time);
+    hook_control_init(cfg.hooks_interval);
 
     // Disable the unhook detection for now. TODO Re-enable.
     // unhook_init_detection(cfg.first_process);
@@ -88,29 +91,70 @@ void monitor_init(HMODULE module_handle)
     misc_set_monitor_options(cfg.track, cfg.mode, cfg.trigger);
 }
 
-void monitor_hook(const char *library, void *module_handle)
+static void _monitor_hook(hook_t *h, void *module_handle)
 {
-    // Initialize data about each hook.
-    for (hook_t *h = sig_hooks(); h->funcname != NULL; h++) {
-        // If a specific library has been specified then we skip all other
-        // libraries. This feature is used in the special hook for LdrLoadDll.
-        if(library != NULL && stricmp(h->library, library) != 0) {
-            continue;
+    // We only hook this function if the monitor mode is "hook everything"
+    // or if the monitor mode matches the mode of this hook.
+    if(g_monitor_mode != HOOK_MODE_ALL && (g_monitor_mode & h->mode) == 0) {
+        return;
+    }
+
+    // Return value 1 indicates to retry the hook. This is important for
+    // delay-loaded function forwarders as the delay-loaded DLL may
+    // already have been loaded. In that case we want to hook the function
+    // forwarder right away. (Note that the library member of the hook
+    // object is updated in the case of retrying, hence the retry resolves
+    // the module handle by itself).
+    if(hook(h, module_handle) == 1) {
+        while (hook(h, NULL) == 1);
+    }
+}
+
+static void _monitor_hook_library(uint32_t index, void *module_handle)
+{
+    hook_t *h; uint32_t count;
+    const char *library = sig_library(index, &h, &count);
+
+    // Resolve the module handle once for all hooks of this library. Unless
+    // it is one of our pseudo libraries, such as __wmi__, there is nothing
+    // to hook if the library has not been loaded.
+    if(module_handle == NULL) {
+        module_handle = GetModuleHandle(library);
+        if(module_handle == NULL && strncmp(library, "__", 2) != 0) {
+            return;
+        }
+    }
+
+    for (; count != 0; h++, count--) {
+        // Hooks that have been moved to another library are handled through
+        // hook_forwarded() instead.
+        if(stricmp(h->library, library) == 0) {
+            _monitor_hook(h, module_handle);
         }
+    }
+}
 
-        // We only hook this function if the monitor mode is "hook everything"
-        // or if the monitor mode matches the mode of this hook.
-        if(g_monitor_mode != HOOK_MODE_ALL &&
-                (g_monitor_mode & h->mode) == 0) {
-            continue;
+void monitor_hook(const char *library, void *module_handle)
+{
+    // If a specific library has been specified then we only look at the
+    // hooks of that library. This feature is used in the special hook for
+    // LdrLoadDll.
+    if(library != NULL) {
+        int32_t index = sig_library_index(library);
+        if(index >= 0) {
+            _monitor_hook_library(index, module_handle);
+        }
+    }
+    else {
+        for (uint32_t idx = 0; idx < sig_library_count(); idx++) {
+            _monitor_hook_library(idx, module_handle);
         }
+    }
 
-        // Return value 1 indicates to retry the hook. This is important for
-        // delay-loaded function forwarders as the delay-loaded DLL may
-        // already have been loaded. In that case we want to hook the function
-        // forwarder right away. (Note that the library member of the hook
-        // object is updated in the case of retrying).
-        while (hook(h, module_handle) == 1);
+    for (hook_t *h = hook_forwarded(); h != NULL; h = h->forward_next) {
+        if(library == NULL || stricmp(h->library, library) == 0) {
+            _monitor_hook(h, module_handle);
+        }
     }
 }
 
@@ -123,6 +167,7 @@ void monitor_unhook(const char *library, void *module_handle)
         if(h->module_handle == module_handle) {
             h->is_hooked = 0;
             h->addr = NULL;
+            hook_release_stub(h);
         }
 
         // This is a hooked function which doesn't belong to a particular DLL.
@@ -131,6 +176,7 @@ void monitor_unhook(const char *library, void *module_handle)
         if(h->module_handle == NULL && range_is_readable(h->addr, 16) == 0) {
             h->is_hooked = 0;
             h->addr = NULL;
+            hook_release_stub(h);
         }
     }
 }
@@ -141,8 +187,15 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 
     if(dwReason == DLL_PROCESS_ATTACH && is_ignored_process() == 0) {
         monitor_init(hModule);
+
+        // Nothing is logged until DllMain of the monitor returns.
+        hook_frame_t frame;
+        hook_enter(&frame);
+
         monitor_hook(NULL, NULL);
         pipe("LOADED:%d,%d", get_current_process_id(), g_monitor_track);
+
+        hook_leave(&frame);
     }
 
     return TRUE;
@@ -32,7 +32,7 @@ typedef enum _register_t {
     R_RAX, R_RCX, R_RDX, R_RBX, R_RSP, R_RBP, R_RSI, R_RDI,
     R_R8,  R_R9,  R_R10, R_R11, R_R12, R_R13, R_R14, R_R15,
 
-    R_R0 = R_RAX,
+    R_R0 = R_RAX, R_SP = R_RSP,
 } register_t;
 
 #else
@@ -45,11 +45,16 @@ typedef enum _register_t {
 typedef enum _register_t {
     R_EAX, R_ECX, R_EDX, R_EBX, R_ESP, R_EBP, R_ESI, R_EDI,
 
-    R_R0 = R_EAX,
+    R_R0 = R_EAX, R_SP = R_ESP,
 } register_t;
 
 #endif
 
+// Condition codes for asm_jump_32bit_rel().
+#define ASM_CC_Z  0x4
+#define ASM_CC_NZ 0x5
+#define ASM_CC_BE 0x6
+
 #define ASM_ADD_REGIMM_SIZE 7
 #define ASM_CALL_SIZE (ASM_MOVE_REGIMM_SIZE+2)
 #define ASM_RETURN_SIZE 3
@@ -82,6 +87,17 @@ int asm_push_context(uint8_t *stub);
 int asm_pop_context(uint8_t *stub);
 int asm_push_stack_offset(uint8_t *stub, uint32_t offset);
 
+// Loads a pointer from the TEB, e.g., from a TLS slot.
+int asm_move_regtls(uint8_t *stub, register_t reg, uint32_t offset);
+
+// Compare and test instructions. The base register of a memory operand
+// may not be the stack pointer.
+int asm_cmp_regreg(uint8_t *stub, register_t reg1, register_t reg2);
+int asm_cmp_memreg(uint8_t *stub, register_t base, int8_t offset,
+    register_t reg);
+int asm_test_memimm8(uint8_t *stub, register_t base, int8_t offset,
+    uint8_t value);
+
 static inline int asm_move_regimmv(uint8_t *stub,
     register_t reg, const void *value)
 {
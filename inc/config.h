@@ -45,6 +45,12 @@ typedef struct _config_t {
     // Enable diffing logging - this is disabled by default.
     int diffing_enable;
 
+    // Size in bytes of the writes to the log pipe, and the interval in
+    // milliseconds at which pending records are written regardless. Zero
+    // selects the defaults.
+    uint32_t log_batch_size;
+    uint32_t log_flush_interval;
+
     // Whether this pid should be monitored for in the analyzer.
     int track;
 
@@ -61,6 +67,12 @@ typedef struct _config_t {
 
     // Dynamic triggers that start the logging for this analysis.
     wchar_t trigger[MAX_PATH+16];
+
+    // Comma-separated list of APIs whose hooks are disabled from the start,
+    // and the interval in milliseconds at which Cuckoo is asked for updates
+    // to this list. Zero disables the updates.
+    char disable_hooks[512];
+    uint32_t hooks_interval;
 } config_t;
 
 void config_read(config_t *cfg);
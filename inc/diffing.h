@@ -39,6 +39,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // h  -> (HANDLE) -> object handle to be checked against ignored object list
 //
 
+// Hashes files that start with these eight bytes list hash64() hashes,
+// all others list hashes of the original hash functions.
+#define DIFFING_HASH64_MAGIC "HASH64v1"
+
 void diffing_init(const char *path, int enable);
 uint64_t call_hash(const char *fmt, ...);
 int is_interesting_hash(uint64_t hash);
@@ -0,0 +1,47 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MONITOR_HASH_H
+#define MONITOR_HASH_H
+
+#include <stdint.h>
+#include <wchar.h>
+
+// 64-bit hash in the style of wyhash. Input is read a word at a time.
+uint64_t hash64(const void *buf, uint32_t length, uint64_t seed);
+
+// A negative length indicates a zero-terminated string.
+uint64_t hash64_string(const char *buf, int32_t length);
+uint64_t hash64_stringW(const wchar_t *buf, int32_t length);
+
+// Case-insensitive for the ASCII range, for hashing filepaths.
+uint64_t hash64_pathW(const wchar_t *buf, int32_t length);
+
+uint64_t hash64_uint64(uint64_t value);
+
+// Bijective mix of all bits of a 64-bit value (the MurmurHash3 finalizer).
+uint64_t hash_mix64(uint64_t value);
+
+// The original byte-at-a-time hashes. Existing diffing hash files have been
+// generated with these, see also the diffing-legacy-hash option.
+uint64_t hash_buffer(const void *buf, uint32_t length);
+uint64_t hash_string(const char *buf, int32_t length);
+uint64_t hash_stringW(const wchar_t *buf, int32_t length);
+uint64_t hash_uint64(uint64_t value);
+
+#endif
@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MONITOR_HASHTABLE_H
 
 #include <stdint.h>
+#include <windows.h>
 
 typedef struct _ht_entry_t {
     uint64_t hash;
@@ -27,15 +28,31 @@ typedef struct _ht_entry_t {
     uint8_t data[0];
 } ht_entry_t;
 
+// Amount of control bytes that are compared at once.
+#define HT_GROUP 16
+
+// Amount of slots that are moved from the previous table into the current
+// one by each insertion or removal while the table is being resized.
+#define HT_MIGRATE_SLOTS (2 * HT_GROUP)
+
+typedef struct _ht_table_t {
+    uint8_t *ctrl;
+    uint8_t *slots;
+    uint32_t capacity;
+
+    // Slots that are either present or deleted.
+    uint32_t used;
+} ht_table_t;
+
 typedef struct _ht_t {
-    ht_entry_t *table;
+    // While being resized, entries are looked up in both tables.
+    ht_table_t cur;
+    ht_table_t old;
+    uint32_t migrated;
+
     uint32_t data_length;
-    uint32_t size_index;
-    uint64_t size;
-    uint64_t rehash;
-    uint64_t max_entries;
-    uint64_t entries;
-    uint64_t deleted_entries;
+    uint32_t slot_size;
+    uint32_t entries;
 } ht_t;
 
 void ht_init(ht_t *ht, uint32_t data_length);
@@ -47,6 +64,55 @@ int ht_insert(ht_t *ht, uint64_t hash, void *data);
 int ht_insert2(ht_t *ht, uint64_t hash, void *data, uint32_t length);
 void ht_remove(ht_t *ht, uint64_t hash);
 
+// Hash map for monitor-wide caches that are read by many threads at once.
+// Lookups take no locks and never wait. Insertions claim their slot with a
+// compare-and-swap and only wait while the table is being resized. Values
+// are pointers, NULL meaning absent, that are not freed by the map. As
+// lookups may still return a value after it has been replaced or removed,
+// callers should not free it either, or only after all threads are done.
+typedef struct _cht_slot_t {
+    volatile uint64_t hash;
+    void *volatile value;
+} cht_slot_t;
+
+typedef struct _cht_table_t {
+    // Tables that have been replaced by a bigger one, which are kept
+    // around as lookups may still be walking them.
+    struct _cht_table_t *retired;
+
+    uint32_t capacity;
+
+    // Slots that have been claimed, including those of removed entries.
+    volatile LONG used;
+
+    cht_slot_t slots[0];
+} cht_table_t;
+
+// Writers announce themselves in one of CHT_STRIPES counters, each on its
+// own cache line, so that they don't contend with each other.
+#define CHT_STRIPES 8
+
+typedef struct _cht_stripe_t {
+    volatile LONG writers;
+    uint8_t padding[64 - sizeof(LONG)];
+} cht_stripe_t;
+
+typedef struct _cht_t {
+    cht_table_t *volatile table;
+
+    // Set while a resize waits for or excludes writers.
+    volatile LONG frozen;
+    CRITICAL_SECTION resize_lock;
+
+    cht_stripe_t stripes[CHT_STRIPES];
+} cht_t;
+
+int cht_init(cht_t *cht, uint32_t capacity);
+void cht_free(cht_t *cht);
+void *cht_lookup(const cht_t *cht, uint64_t hash);
+int cht_insert(cht_t *cht, uint64_t hash, void *value);
+void *cht_remove(cht_t *cht, uint64_t hash);
+
 uint64_t hash_str(const void *s);
 uint64_t hash_mem(const void *s, uint32_t length);
 
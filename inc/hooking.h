@@ -84,6 +84,11 @@ typedef struct _hook_t {
     // Is this a "special" hook?
     int special;
 
+    // Does the hook handler do nothing but logging, i.e., it has no Pre,
+    // Middle, Post, or Replace blocks? Only these hooks pass disabled calls
+    // straight to the original function.
+    int log_only;
+
     // Various flags on limiting the amount of non-critical errors shown
     // related to API hooks.
     int report;
@@ -125,8 +130,16 @@ typedef struct _hook_t {
     // Is this function already hooked?
     uint32_t is_hooked;
 
-    // Stub for calling the original function.
+    // Stub for calling the original function. For hooks with an entry
+    // gate the gate precedes the original function stub in this memory.
     uint8_t *func_stub;
+
+    // Signature index of this hook.
+    uint32_t index;
+
+    // Next hook that has been moved to a delay-loaded library, see also
+    // hook_forwarded().
+    struct _hook_t *forward_next;
 } hook_t;
 
 // Hook initialization part one and two. One should be called before having
@@ -136,11 +149,66 @@ int hook_init2();
 
 int lde(const void *addr);
 
+// Registration of an active hook handler. Lives on the stack of the handler
+// and is linked from a TEB slot, i.e., it is strictly per-thread.
+typedef struct _hook_frame_t {
+    struct _hook_frame_t *prev;
+
+    // Points to the frame itself while it is registered. Also checked by
+    // the entry gate of each hook, see hook().
+    uintptr_t cookie;
+
+    // Set while the handler calls the original LdrLoadDll function, so that
+    // API calls from DllMain of the library being loaded are still logged.
+    uint32_t loaddll;
+} hook_frame_t;
+
+// Returns 1 if the hook handler owning this frame has been called from
+// within the monitor, i.e., the call should not be logged. Otherwise the
+// frame is registered as active for the current thread and 0 is returned.
+// Outer frames below the stack pointer at the call of the hook handler have
+// been left behind by an exception and are ignored. That stack pointer is
+// taken by the hook handler itself, hence hook_enter() is a macro.
+int hook_enter_sp(hook_frame_t *frame, uintptr_t sp);
+
+#define hook_enter(frame) \
+    hook_enter_sp(frame, (uintptr_t) __builtin_dwarf_cfa())
+
+// Unregisters the frame if it was registered by hook_enter(). Hook handlers
+// call it through the cleanup attribute of their frame, i.e., on return.
+void hook_leave(hook_frame_t *frame);
+
+// Stacktrace-based variant of hook_enter(), only used as fallback.
 int hook_in_monitor();
 
+// One bit per signature index, set for hooks that have been disabled at
+// runtime. Disabled hooks are not logged. For hooks that do nothing but
+// logging the entry gate passes calls straight on to the original function.
+extern uint8_t *g_hook_disabled;
+
+static inline int hook_is_disabled(uint32_t index)
+{
+    return g_hook_disabled != NULL &&
+        (g_hook_disabled[index / 8] & (1 << (index % 8))) != 0;
+}
+
+void hook_disable(uint32_t index, int disabled);
+
+// Enables or disables hooks from a comma-separated list of API names. Names
+// prefixed with a plus sign are enabled, all others are disabled. Unknown
+// names are ignored.
+void hook_disable_apis(const char *apis);
+
+// Requests an updated list of hooks to enable or disable from Cuckoo every
+// interval milliseconds. Disabled if zero.
+int hook_control_init(uint32_t interval);
+
 int hook(hook_t *h, void *module_handle);
 int hook_insn(hook_t *h, uint32_t signature);
 uint8_t *hook_get_mem();
+
+// Hands the function stub back, e.g., after the module has been unloaded.
+void hook_release_stub(hook_t *h);
 int hook_missing_hooks(HMODULE module_handle);
 
 #define DISASM_BUFSIZ 128
@@ -150,6 +218,18 @@ int disasm(const void *addr, char *str);
 hook_t *sig_hooks();
 uint32_t sig_hook_count();
 
+// The hooks are grouped per library at build time. Returns the library name
+// and the range of hooks of the index'th library.
+uint32_t sig_library_count();
+const char *sig_library(uint32_t index, hook_t **hooks, uint32_t *count);
+
+// Returns the index of the library, or -1 if no hooks target it.
+int32_t sig_library_index(const char *library);
+
+// Hooks whose library has been replaced by the delay-loaded library that
+// the function forwards to. These are no longer found by their library.
+hook_t *hook_forwarded();
+
 void hook_initcb_LdrLoadDll(hook_t *h);
 
 uint8_t *hook_addrcb_RtlDispatchException(hook_t *h,
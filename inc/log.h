@@ -24,14 +24,45 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bson.h"
 #include "native.h"
 
-void log_init(const char *pipe_name, int track);
+// A batch size or flush interval of zero selects the default.
+void log_init(const char *pipe_name, int track, uint32_t batch_size,
+    uint32_t flush_interval);
 
 void log_api(uint32_t index, int is_success, uintptr_t return_value,
     uint64_t hash, last_error_t *lasterr, ...);
 
+// Building blocks of log_api(), also used directly by the per-signature
+// serializers generated by utils/process.py. log_api_start() returns -1 if
+// the event is not to be logged, in which case the bson object is untouched.
+int log_api_start(bson *b, uint32_t index, int is_success,
+    uintptr_t return_value, uint64_t hash, last_error_t *lasterr);
+void log_api_finish(bson *b);
+
+void log_int32(bson *b, const char *idx, int value);
+void log_int64(bson *b, const char *idx, int64_t value);
 void log_intptr(bson *b, const char *idx, intptr_t value);
 void log_string(bson *b, const char *idx, const char *str, int length);
 void log_wstring(bson *b, const char *idx, const wchar_t *str, int length);
+void log_argv(bson *b, const char *idx, int argc, const char **argv);
+void log_wargv(bson *b, const char *idx, int argc, const wchar_t **argv);
+
+// One function for each remaining format specifier of log_api().
+void log_arg_string(bson *b, const char *idx, const char *str);
+void log_arg_wstring(bson *b, const char *idx, const wchar_t *str);
+void log_arg_buffer(bson *b, const char *idx, uintptr_t length,
+    const uint8_t *buf, int override);
+void log_arg_bufferp(bson *b, const char *idx, uintptr_t *length,
+    const uint8_t *buf, int override);
+void log_arg_int32p(bson *b, const char *idx, uint32_t *value);
+void log_arg_intptrp(bson *b, const char *idx, uintptr_t *value);
+void log_arg_int64p(bson *b, const char *idx, LARGE_INTEGER *value);
+void log_arg_ansi(bson *b, const char *idx, ANSI_STRING *str);
+void log_arg_registry(bson *b, const char *idx, uint32_t *type,
+    uint32_t *size, uint8_t *data, int unicode);
+void log_arg_bson(bson *b, const char *idx, bson *value);
+void log_arg_clsid(bson *b, const char *idx, REFCLSID rclsid);
+void log_arg_bstr(bson *b, const char *idx, BSTR bstr);
+void log_arg_variant(bson *b, const char *idx, const VARIANT *v);
 
 void log_anomaly(const char *subcategory,
     const char *funcname, const char *msg);
@@ -39,7 +70,16 @@ void log_anomaly(const char *subcategory,
 void log_exception(CONTEXT *ctx, EXCEPTION_RECORD *rec,
     uintptr_t *return_addresses, uint32_t count, uint32_t flags);
 
+// Writes out all pending records right away.
+void log_flush();
+
+// Writes all further records right away, for when the process exits.
+void log_exit();
+
+void log_ring_release();
+
 void log_action(const char *action);
+void log_memory();
 void WINAPI log_guardrw(uintptr_t addr);
 
 void log_new_process();
@@ -64,12 +104,9 @@ typedef struct _flag_repr_t {
     const char *repr;
 } flag_repr_t;
 
-const char *sig_flag_name(uint32_t sigidx, uint32_t flagidx);
-uint32_t sig_flag_value(uint32_t sigidx, uint32_t flagidx);
 const char *sig_apiname(uint32_t sigidx);
-const char *sig_category(uint32_t sigidx);
 const char *sig_paramtypes(uint32_t sigidx);
-const char *sig_param_name(uint32_t sigidx, uint32_t argidx);
+const uint8_t *sig_explain(uint32_t sigidx, uint32_t *length);
 uint32_t sig_count();
 const flag_repr_t *flag_value(uint32_t flagidx);
 const flag_repr_t *flag_bitmask(uint32_t flagidx);
@@ -80,6 +117,7 @@ uint32_t sig_index_exception();
 uint32_t sig_index_missing();
 uint32_t sig_index_action();
 uint32_t sig_index_guardrw();
+uint32_t sig_index_memory();
 uint32_t sig_index_firsthookidx();
 
 #endif
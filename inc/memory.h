@@ -36,19 +36,93 @@ typedef struct _slab_t {
     uint32_t offset;
     uint32_t length;
     uint32_t memprot;
+
+    // Objects that have been handed back through slab_free().
+    volatile LONG lock;
+    struct _slab_object_t *freelist;
+
+    // Amount of objects currently handed out.
+    volatile uint32_t used;
+
+    // TLS slot of the per-thread cache, if enabled.
+    uint32_t cache_index;
 } slab_t;
 
 // Memory alignment compatible with XMM/YMM instructions on x86_64.
 #define MEM_ALIGNMENT 0x10
 
+// Allocations up to MEM_POOL_MAXSIZE bytes (including the length header)
+// are served from power of two size classes. Chunks of the pool are
+// committed from regions of MEM_POOL_REGIONSIZE reserved bytes.
+#define MEM_POOL_MINSHIFT 5
+#define MEM_POOL_MAXSHIFT 15
+#define MEM_POOL_MINSIZE (1 << MEM_POOL_MINSHIFT)
+#define MEM_POOL_MAXSIZE (1 << MEM_POOL_MAXSHIFT)
+#define MEM_POOL_CLASSES (MEM_POOL_MAXSHIFT - MEM_POOL_MINSHIFT + 1)
+#define MEM_POOL_CHUNKSIZE 0x10000
+#define MEM_POOL_REGIONSIZE 0x400000
+
+// Each thread caches up to MEM_CACHE_DEPTH free blocks for each of the
+// first MEM_CACHE_CLASSES size classes, i.e., blocks of up to 4KB.
+#define MEM_CACHE_CLASSES 8
+#define MEM_CACHE_DEPTH 16
+
+// Blocks that mem_realloc() grows beyond the pool reserve MEM_GROW_FACTOR
+// times their length of address space, at least MEM_GROW_RESERVE bytes and
+// at most MEM_GROW_LIMIT bytes more than their length. Pages are committed
+// on-demand so that these blocks can keep on growing in-place. Address
+// space is scarce in 32-bit processes.
+#if __x86_64__
+#define MEM_GROW_RESERVE 0x400000
+#define MEM_GROW_FACTOR 4
+#define MEM_GROW_LIMIT 0x40000000
+#else
+#define MEM_GROW_RESERVE 0x10000
+#define MEM_GROW_FACTOR 2
+#define MEM_GROW_LIMIT 0x100000
+#endif
+
+typedef struct _mem_stats_t {
+    // Amount of NtAllocateVirtualMemory / NtFreeVirtualMemory calls.
+    uint32_t syscalls;
+
+    // Bytes of address space reserved and committed for the pool.
+    uint32_t reserved;
+    uint32_t committed;
+
+    // Amount of live allocations that bypass the pool.
+    uint32_t direct;
+
+    // Bytes in use by live allocations and the highest amount seen. These
+    // and the allocation counts lag behind by a few allocations per thread.
+    uint32_t live;
+    uint32_t peak;
+
+    // Amount of allocations served by each size class of the pool.
+    uint32_t allocs[MEM_POOL_CLASSES];
+
+    // Pages committed for slabs.
+    uint32_t slab_pages;
+} mem_stats_t;
+
 uintptr_t roundup2(uintptr_t value);
 uintptr_t mem_suggested_size(uintptr_t size);
 
+// TLS slots that are accessed directly through the TEB. Returns
+// TLS_OUT_OF_INDEXES if no such slot is available.
+uint32_t teb_slot_alloc();
+void **teb_slot(uint32_t index);
+
+// Offset of the slot relative to the TEB, for use in assembly stubs.
+uint32_t teb_slot_offset(uint32_t index);
+
 void mem_init();
 void *mem_alloc(uint32_t length);
 void *mem_alloc_aligned(uint32_t length);
 void *mem_realloc(void *ptr, uint32_t length);
 void mem_free(void *ptr);
+void mem_stats(mem_stats_t *stats);
+void mem_cache_release();
 
 void array_init(array_t *array);
 int array_set(array_t *array, uintptr_t index, void *value);
@@ -65,12 +139,74 @@ static inline uintptr_t array_geti(array_t *array, uintptr_t index)
     return (uintptr_t) array_get(array, index);
 }
 
+// Sparse radix table for per-thread (or per-handle) state, indexed by a
+// 32-bit value such as a thread identifier. Lookups are lock-free and
+// nodes are inserted with a compare-and-swap. Nodes are never freed.
+typedef struct _table_t {
+    void *volatile root;
+} table_t;
+
+#define TABLE_SHIFT 8
+#define TABLE_FANOUT (1 << TABLE_SHIFT)
+#define TABLE_LEVELS (32 / TABLE_SHIFT)
+
+// Amount of nodes per slab chunk.
+#define TABLE_NODECOUNT 32
+
+void table_init(table_t *table);
+int table_set(table_t *table, uintptr_t index, void *value);
+void *table_get(table_t *table, uintptr_t index);
+int table_unset(table_t *table, uintptr_t index);
+
+// Atomically replaces the value and returns the previous one.
+void *table_exchange(table_t *table, uintptr_t index, void *value);
+
 void slab_init(slab_t *slab, uint32_t size, uint32_t count,
     uint32_t memory_protection);
 void *slab_getmem(slab_t *slab);
-void slab_return_last(slab_t *slab);
+void slab_free(slab_t *slab, void *ptr);
 uint32_t slab_size(const slab_t *slab);
 
+// Each thread caches up to SLAB_CACHE_DEPTH freed objects of a slab with
+// a per-thread cache. Only a few slabs may have one.
+#define SLAB_CACHE_DEPTH 16
+#define SLAB_CACHE_SLABS 4
+
+int slab_enable_cache(slab_t *slab);
+void slab_cache_release();
+
+// Scope of the per-thread scratch arena. Memory handed out by scratch_get()
+// and scratch_alloc() between scratch_open() and scratch_close() is
+// released all at once when the scope is closed. Scopes may be nested.
+// Scratch memory is not zero-initialized.
+typedef struct _scratch_t {
+    void *arena;
+    uint8_t *ptr;
+    uint32_t depth;
+} scratch_t;
+
+void scratch_open(scratch_t *scratch);
+void scratch_close(scratch_t *scratch);
+
+// Returns NULL if no scope is open or the arena has been exhausted.
+void *scratch_get(uint32_t length);
+
+// Falls back to mem_alloc() and friends outside of the arena.
+void *scratch_alloc(uint32_t length);
+void *scratch_realloc(void *ptr, uint32_t length);
+void scratch_free(void *ptr);
+
+int scratch_contains(const void *ptr);
+void scratch_release();
+
+// Releases the per-thread caches and scratch arenas of threads that have
+// exited without releasing them, e.g., threads that were terminated by
+// another thread.
+void mem_collect();
+
+// Lists of values for membership queries. dnq_init() sorts the list and
+// then reorders it in-place into an Eytzinger (breadth-first binary tree)
+// layout, so the iterators return the values in no particular order.
 typedef struct _dnq_t {
     void *list;
     uint32_t size;
@@ -86,4 +222,23 @@ int dnq_has32(dnq_t *dnq, uint32_t value);
 int dnq_has64(dnq_t *dnq, uint64_t value);
 int dnq_hasptr(dnq_t *dnq, uintptr_t value);
 
+// Split block Bloom filter over 64-bit hashes. Each hash sets one bit in
+// each of the BLOOM_WORDS words of a single block, and blocks are aligned
+// to BLOOM_ALIGNMENT bytes, so a lookup touches just one cache line. See
+// also the diffing section in docs/components.rst.
+typedef struct _bloom_t {
+    uint32_t *blocks;
+    uint32_t count;
+    void *base;
+} bloom_t;
+
+#define BLOOM_WORDS 8
+#define BLOOM_ALIGNMENT 64
+#define BLOOM_BITS_PER_HASH 16
+
+int bloom_init(bloom_t *bloom, uint32_t count);
+void bloom_add(bloom_t *bloom, uint64_t hash);
+int bloom_has(const bloom_t *bloom, uint64_t hash);
+void bloom_free(bloom_t *bloom);
+
 #endif
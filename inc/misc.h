@@ -42,10 +42,16 @@ void misc_set_monitor_options(uint32_t track, uint32_t mode,
 
 wchar_t *get_unicode_buffer();
 void free_unicode_buffer(wchar_t *ptr);
+uint32_t unicode_buffer_count();
 
 uint32_t pid_from_process_handle(HANDLE process_handle);
 uint32_t pid_from_thread_handle(HANDLE thread_handle);
 uint32_t tid_from_thread_handle(HANDLE thread_handle);
+
+// Returns 0 only if the thread that stored value in its TEB slot index has
+// positively exited, -1 if that can't be told, and 1 otherwise.
+int teb_slot_owner_alive(uint32_t thread_identifier, uint32_t index,
+    uintptr_t value);
 uint32_t parent_process_identifier();
 
 uint32_t path_get_full_pathA(const char *in, wchar_t *out);
@@ -98,16 +104,12 @@ void library_from_unicode_string(const UNICODE_STRING *us,
 int stacktrace(CONTEXT *ctx, uintptr_t *addrs, uint32_t length);
 
 void *memdup(const void *addr, uint32_t length);
+void *scratch_memdup(const void *addr, uint32_t length);
 wchar_t *our_wcsdup(const wchar_t *s);
 int page_is_readable(const void *addr);
 int range_is_readable(const void *addr, uintptr_t size);
 void clsid_to_string(REFCLSID rclsid, char *buf);
 
-uint64_t hash_buffer(const void *buf, uint32_t length);
-uint64_t hash_string(const char *buf, int32_t length);
-uint64_t hash_stringW(const wchar_t *buf, int32_t length);
-uint64_t hash_uint64(uint64_t value);
-
 int ultostr(int64_t value, char *str, int base);
 
 int our_vsnprintf(char *buf, int length, const char *fmt, va_list args);
@@ -216,6 +218,12 @@ uint32_t copy_strlen(const char *value);
 uint32_t copy_strlenW(const wchar_t *value);
 char *copy_utf8_string(const char *str, uint32_t length);
 char *copy_utf8_wstring(const wchar_t *str, uint32_t length);
+
+// Encode a string as UTF-8 into out, see also utf8_encode_string() and
+// utf8_encode_wstring(). Returns -1 if the string could not be read.
+int copy_utf8_encode(const char *str, uint32_t length, uint8_t *out);
+int copy_utf8_encodeW(const wchar_t *str, uint32_t length, uint8_t *out);
+
 uint32_t copy_uint32(const void *value);
 uint64_t copy_uint64(const void *value);
 uintptr_t copy_uintptr(const void *value);
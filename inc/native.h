@@ -108,6 +108,10 @@ uint32_t get_window_thread_process_id(HWND hwnd, uint32_t *pid);
 int message_box(HWND hwnd, const char *body, const char *title, int flags);
 
 HANDLE open_thread(uint32_t desired_mask, uint32_t thread_identifier);
+
+// Returns STATUS_INVALID_CID if there's no such thread (anymore).
+NTSTATUS open_thread_status(uint32_t desired_mask,
+    uint32_t thread_identifier, HANDLE *thread_handle);
 uint32_t resume_thread(HANDLE thread_handle);
 
 int set_std_handle(DWORD std_handle, HANDLE file_handle);
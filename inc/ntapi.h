@@ -223,6 +223,7 @@ typedef enum _FILE_INFORMATION_CLASS {
 } FILE_INFORMATION_CLASS, *PFILE_INFORMATION_CLASS;
 
 #define STATUS_ACCESS_DENIED ((NTSTATUS) 0xc0000022)
+#define STATUS_INVALID_CID ((NTSTATUS) 0xc000000b)
 
 typedef struct _FILE_BASIC_INFORMATION {
     LARGE_INTEGER CreationTime;
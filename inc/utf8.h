@@ -26,9 +26,24 @@ int utf8_encode(uint32_t x, uint8_t *out);
 int utf8_decode_strn(const char *in, wchar_t *out, uint32_t len);
 int utf8_length(uint32_t x);
 
+// Copy the leading ASCII characters of s to out and return their count. Up
+// to len bytes may be written to out regardless.
+int utf8_ascii_prefix(const char *s, int len, uint8_t *out);
+int utf8_ascii_prefixW(const wchar_t *s, int len, uint8_t *out);
+
 int utf8_bytecnt_ascii(const char *s, int len);
 int utf8_bytecnt_unicode(const wchar_t *s, int len);
 
+// Encode len characters into out, which must hold at least
+// UTF8_MAXLEN_ASCII(len) or UTF8_MAXLEN_UNICODE(len) bytes, respectively.
+// Returns the amount of bytes written, which equals utf8_bytecnt_ascii()
+// or utf8_bytecnt_unicode() for the same string.
+#define UTF8_MAXLEN_ASCII(len) ((len) * 2)
+#define UTF8_MAXLEN_UNICODE(len) ((len) * 3)
+
+int utf8_encode_string(const char *s, int len, uint8_t *out);
+int utf8_encode_wstring(const wchar_t *s, int len, uint8_t *out);
+
 char *utf8_string(const char *s, int len);
 char *utf8_wstring(const wchar_t *s, int len);
 
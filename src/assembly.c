@@ -372,6 +372,85 @@ int asm_push_stack_offset(uint8_t *stub, uint32_t offset)
     return stub - base;
 }
 
+int asm_move_regtls(uint8_t *stub, register_t reg, uint32_t offset)
+{
+    uint8_t *base = stub;
+
+#if __x86_64__
+    // mov reg64, qword gs:[offset]
+    *stub++ = 0x65;
+    *stub++ = 0x48 + (reg >= R_R8 ? 4 : 0);
+    *stub++ = 0x8b;
+    *stub++ = 0x04 + (reg & 7) * 8;
+    *stub++ = 0x25;
+#else
+    // mov reg32, dword fs:[offset]
+    *stub++ = 0x64;
+    *stub++ = 0x8b;
+    *stub++ = 0x05 + reg * 8;
+#endif
+
+    *(uint32_t *) stub = offset;
+    stub += 4;
+    return stub - base;
+}
+
+// Emits the REX prefix, if any, for an instruction with the given register
+// operands. Only the lower three bits of both registers should be used
+// afterwards.
+static uint8_t *_asm_rex(uint8_t *stub, register_t reg, register_t rm,
+    int wide)
+{
+#if __x86_64__
+    uint8_t rex = 0x40 + (wide != 0 ? 8 : 0) +
+        (reg >= R_R8 ? 4 : 0) + (rm >= R_R8 ? 1 : 0);
+    if(rex != 0x40) {
+        *stub++ = rex;
+    }
+#else
+    (void) reg; (void) rm; (void) wide;
+#endif
+    return stub;
+}
+
+int asm_cmp_regreg(uint8_t *stub, register_t reg1, register_t reg2)
+{
+    uint8_t *base = stub;
+
+    // cmp reg1, reg2
+    stub = _asm_rex(stub, reg2, reg1, 1);
+    *stub++ = 0x39;
+    *stub++ = 0xc0 + (reg2 & 7) * 8 + (reg1 & 7);
+    return stub - base;
+}
+
+int asm_cmp_memreg(uint8_t *stub, register_t base, int8_t offset,
+    register_t reg)
+{
+    uint8_t *start = stub;
+
+    // cmp [base+offset], reg
+    stub = _asm_rex(stub, reg, base, 1);
+    *stub++ = 0x39;
+    *stub++ = 0x40 + (reg & 7) * 8 + (base & 7);
+    *stub++ = offset;
+    return stub - start;
+}
+
+int asm_test_memimm8(uint8_t *stub, register_t base, int8_t offset,
+    uint8_t value)
+{
+    uint8_t *start = stub;
+
+    // test byte [base+offset], value
+    stub = _asm_rex(stub, R_R0, base, 0);
+    *stub++ = 0xf6;
+    *stub++ = 0x40 + (base & 7);
+    *stub++ = offset;
+    *stub++ = value;
+    return stub - start;
+}
+
 uint8_t *asm_get_rel_jump_target(uint8_t *addr)
 {
     if(*addr == 0xeb) {
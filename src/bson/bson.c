@@ -1069,6 +1069,49 @@ MONGO_EXPORT int bson_append_finish_array( bson *b ) {
     return bson_append_finish_object( b );
 }
 
+/* Fast building. */
+
+MONGO_EXPORT int bson_fast_start_array( bson *b, const char *name, size_t namelen ) {
+    if ( bson_reserve( b, 1 + namelen + 1 + 4 ) == BSON_ERROR ) return BSON_ERROR;
+    if ( b->stackPos >= b->stackSize && _bson_append_grow_stack( b ) == BSON_ERROR ) return BSON_ERROR;
+    bson_fast_key( b, BSON_ARRAY, name, namelen );
+    b->stackPtr[ b->stackPos++ ] = _bson_position(b);
+    bson_append32( b , &zero );
+    return BSON_OK;
+}
+
+MONGO_EXPORT int bson_fast_finish_array( bson *b ) {
+    char *start;
+    int i;
+    if ( !b->stackPos ) { b->err = BSON_NOT_IN_SUBOBJECT; return BSON_ERROR; }
+    if ( bson_reserve( b, 1 ) == BSON_ERROR ) return BSON_ERROR;
+    bson_append_byte( b , 0 );
+
+    start = b->data + b->stackPtr[ --b->stackPos ];
+    if ( b->cur - start >= INT32_MAX ) {
+        b->err = BSON_SIZE_OVERFLOW;
+        return BSON_ERROR;
+    }
+    i = ( int )( b->cur - start );
+    bson_little_endian32( start, &i );
+    return BSON_OK;
+}
+
+MONGO_EXPORT int bson_fast_finish( bson *b ) {
+    int i;
+    bson_fatal_msg(!b->stackPos, "Subobject not finished before bson_fast_finish().");
+    if ( bson_reserve( b, 1 ) == BSON_ERROR ) return BSON_ERROR;
+    bson_append_byte( b, 0 );
+    if ( _bson_position(b) >= INT32_MAX ) {
+        b->err = BSON_SIZE_OVERFLOW;
+        return BSON_ERROR;
+    }
+    i = ( int ) _bson_position(b);
+    bson_little_endian32( b->data, &i );
+    b->finished = 1;
+    return BSON_OK;
+}
+
 /* Error handling and allocators. */
 
 static bson_err_handler err_handler = NULL;
@@ -1090,6 +1090,134 @@ MONGO_EXPORT int bson_append_finish_object( bson *b );
  */
 MONGO_EXPORT int bson_append_finish_array( bson *b );
 
+/* ----------------------------
+   FAST BUILDING
+   ------------------------------ */
+
+/* The bson_fast_* appenders take the length of the key rather than
+   calling strlen( ) on it, and neither the key nor string values are
+   validated, so the caller has to provide valid UTF-8. Once space has been
+   set aside with bson_reserve( ), the _unchecked variants skip the capacity
+   check as well. None of them may be used on a finished bson. */
+
+/* Expands a string literal into its key and key length arguments. */
+#define BSON_KEY( s ) ( s ), sizeof( s ) - 1
+
+/* Amount of bytes taken up by an int / long element with the given key. */
+#define BSON_INT_SIZE( namelen ) ( 1 + ( namelen ) + 1 + 4 )
+#define BSON_LONG_SIZE( namelen ) ( 1 + ( namelen ) + 1 + 8 )
+
+/**
+ * Make sure that at least bytesNeeded more bytes can be appended without
+ * growing the buffer.
+ *
+ * @param b the bson to reserve space in.
+ * @param bytesNeeded the number of bytes to reserve.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_INLINE int bson_reserve( bson *b, size_t bytesNeeded ) {
+    if ( ( size_t )( b->cur - b->data ) + bytesNeeded <= ( size_t ) b->dataSize )
+        return BSON_OK;
+    return bson_ensure_space( b, bytesNeeded );
+}
+
+MONGO_INLINE void bson_fast_key( bson *b, int type, const char *name, size_t namelen ) {
+    b->cur[0] = ( char ) type;
+    memcpy( b->cur + 1, name, namelen );
+    b->cur[1 + namelen] = 0;
+    b->cur += 1 + namelen + 1;
+}
+
+MONGO_INLINE void bson_fast_int_unchecked( bson *b, const char *name, size_t namelen, int i ) {
+    bson_fast_key( b, BSON_INT, name, namelen );
+    bson_little_endian32( b->cur, &i );
+    b->cur += 4;
+}
+
+MONGO_INLINE void bson_fast_long_unchecked( bson *b, const char *name, size_t namelen, int64_t i ) {
+    bson_fast_key( b, BSON_LONG, name, namelen );
+    bson_little_endian64( b->cur, &i );
+    b->cur += 8;
+}
+
+MONGO_INLINE int bson_fast_int( bson *b, const char *name, size_t namelen, int i ) {
+    if ( bson_reserve( b, BSON_INT_SIZE( namelen ) ) == BSON_ERROR )
+        return BSON_ERROR;
+    bson_fast_int_unchecked( b, name, namelen, i );
+    return BSON_OK;
+}
+
+MONGO_INLINE int bson_fast_long( bson *b, const char *name, size_t namelen, int64_t i ) {
+    if ( bson_reserve( b, BSON_LONG_SIZE( namelen ) ) == BSON_ERROR )
+        return BSON_ERROR;
+    bson_fast_long_unchecked( b, name, namelen, i );
+    return BSON_OK;
+}
+
+MONGO_INLINE int bson_fast_null( bson *b, const char *name, size_t namelen ) {
+    if ( bson_reserve( b, 1 + namelen + 1 ) == BSON_ERROR )
+        return BSON_ERROR;
+    bson_fast_key( b, BSON_NULL, name, namelen );
+    return BSON_OK;
+}
+
+MONGO_INLINE int bson_fast_string( bson *b, const char *name, size_t namelen, const char *str, size_t len ) {
+    int sl = ( int ) len + 1;
+    if ( bson_reserve( b, 1 + namelen + 1 + 4 + len + 1 ) == BSON_ERROR )
+        return BSON_ERROR;
+    bson_fast_key( b, BSON_STRING, name, namelen );
+    bson_little_endian32( b->cur, &sl );
+    memcpy( b->cur + 4, str, len );
+    b->cur[4 + len] = 0;
+    b->cur += 4 + len + 1;
+    return BSON_OK;
+}
+
+/* Reserves space for a string of up to maxlen bytes and returns where the
+   string is to be written, or NULL. The element is only appended once
+   bson_fast_string_commit( ) is called with the actual length, and nothing
+   else may be appended in between. */
+MONGO_INLINE char *bson_fast_string_begin( bson *b, size_t namelen, size_t maxlen ) {
+    if ( bson_reserve( b, 1 + namelen + 1 + 4 + maxlen + 1 ) == BSON_ERROR )
+        return NULL;
+    return b->cur + 1 + namelen + 1 + 4;
+}
+
+MONGO_INLINE void bson_fast_string_commit( bson *b, const char *name, size_t namelen, size_t len ) {
+    int sl = ( int ) len + 1;
+    bson_fast_key( b, BSON_STRING, name, namelen );
+    bson_little_endian32( b->cur, &sl );
+    b->cur[4 + len] = 0;
+    b->cur += 4 + len + 1;
+}
+
+/* Binary data of any subtype but BSON_BIN_BINARY_OLD. */
+MONGO_INLINE int bson_fast_binary( bson *b, const char *name, size_t namelen, char type, const char *str, size_t len ) {
+    int bl = ( int ) len;
+    if ( bson_reserve( b, 1 + namelen + 1 + 4 + 1 + len ) == BSON_ERROR )
+        return BSON_ERROR;
+    bson_fast_key( b, BSON_BINDATA, name, namelen );
+    bson_little_endian32( b->cur, &bl );
+    b->cur[4] = type;
+    memcpy( b->cur + 5, str, len );
+    b->cur += 4 + 1 + len;
+    return BSON_OK;
+}
+
+MONGO_EXPORT int bson_fast_start_array( bson *b, const char *name, size_t namelen );
+MONGO_EXPORT int bson_fast_finish_array( bson *b );
+
+/**
+ * Finalize a bson object that has been built with the fast appenders. Unlike
+ * bson_finish( ) it does not look at the error state of the object.
+ *
+ * @param b the bson object to finalize.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_EXPORT int bson_fast_finish( bson *b );
+
 void bson_numstr( char *str, int i );
 
 void bson_incnumstr( char *str );
@@ -131,6 +131,14 @@ void config_read(config_t *cfg)
         else if(strcmp(key, "diffing-enable") == 0) {
             cfg->diffing_enable = value[0] == '1';
         }
+        else if(strcmp(key, "log-batch-size") == 0) {
+            // In kilobytes. Clamped before multiplying so that it can't
+            // wrap around, log_init() caps the batch at 1MB anyway.
+            cfg->log_batch_size = min(strtoul(value, NULL, 10), 1024) * 1024;
+        }
+        else if(strcmp(key, "log-flush-interval") == 0) {
+            cfg->log_flush_interval = strtoul(value, NULL, 10);
+        }
         else if(strcmp(key, "track") == 0) {
             cfg->track = value[0] == '1';
         }
@@ -143,6 +151,12 @@ void config_read(config_t *cfg)
         else if(strcmp(key, "pipe-pid") == 0) {
             cfg->pipe_pid = value[0] == '1';
         }
+        else if(strcmp(key, "disable-hooks") == 0) {
+            strncpy(cfg->disable_hooks, value, sizeof(cfg->disable_hooks));
+        }
+        else if(strcmp(key, "hooks-interval") == 0) {
+            cfg->hooks_interval = strtoul(value, NULL, 10);
+        }
         else if(strcmp(key, "trigger") == 0) {
             utf8_decode_strn(
                 value, cfg->trigger, sizeof(cfg->trigger) / sizeof(wchar_t)
@@ -156,6 +156,34 @@ char *copy_utf8_wstring(const wchar_t *str, uint32_t length)
     return NULL;
 }
 
+int copy_utf8_encode(const char *str, uint32_t length, uint8_t *out)
+{
+    tls_copy_t *tls = copy_get_tls();
+
+    tls->active = 1;
+    if(setjmp(tls->jb) == 0) {
+        int ret = utf8_encode_string(str, length, out);
+        tls->active = 0;
+        return ret;
+    }
+    tls->active = 0;
+    return -1;
+}
+
+int copy_utf8_encodeW(const wchar_t *str, uint32_t length, uint8_t *out)
+{
+    tls_copy_t *tls = copy_get_tls();
+
+    tls->active = 1;
+    if(setjmp(tls->jb) == 0) {
+        int ret = utf8_encode_wstring(str, length, out);
+        tls->active = 0;
+        return ret;
+    }
+    tls->active = 0;
+    return -1;
+}
+
 uint32_t copy_uint32(const void *value)
 {
     tls_copy_t *tls = copy_get_tls();
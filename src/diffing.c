@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <windows.h>
+#include "hash.h"
 #include "hooking.h"
 #include "ignore.h"
 #include "memory.h"
@@ -46,6 +47,26 @@ static int g_diffing_enabled;
 
 static dnq_t g_list;
 
+static uint64_t _hash_buffer(const void *buf, uint32_t length)
+{
+    return hash64(buf, length, 0);
+}
+
+// Hash functions, which are the original ones unless the hashes file
+// starts with DIFFING_HASH64_MAGIC, in which case hash64() and friends.
+static uint64_t (*g_hash_buffer)(const void *buf, uint32_t length) =
+    &hash_buffer;
+static uint64_t (*g_hash_string)(const char *buf, int32_t length) =
+    &hash_string;
+static uint64_t (*g_hash_stringW)(const wchar_t *buf, int32_t length) =
+    &hash_stringW;
+static uint64_t (*g_hash_path)(const wchar_t *buf, int32_t length) =
+    &hash_stringW;
+static uint64_t (*g_hash_uint64)(uint64_t value) = &hash_uint64;
+
+// Most hashes are not in the list, which the filter tells right away.
+static bloom_t g_filter;
+
 static uint64_t _get_module_hash(HMODULE module_handle)
 {
     wchar_t *module_path = get_unicode_buffer();
@@ -54,7 +75,7 @@ static uint64_t _get_module_hash(HMODULE module_handle)
     GetModuleFileNameW(module_handle, module_path, MAX_PATH_W);
     uint32_t length = path_get_full_pathW(module_path, full_path);
 
-    return hash_stringW(full_path, length);
+    return g_hash_path(full_path, length);
 }
 
 static uint64_t _address_hash(uintptr_t addr)
@@ -62,8 +83,8 @@ static uint64_t _address_hash(uintptr_t addr)
     // TODO Use divide and conquer here as well.
     for (uint32_t idx = 0; idx < g_module_count; idx++) {
         if(addr >= g_modules[idx].base && addr < g_modules[idx].end) {
-            uint64_t ret =
-                g_modules[idx].hash ^ hash_uint64(addr - g_modules[idx].base);
+            uint64_t ret = g_modules[idx].hash ^
+                g_hash_uint64(addr - g_modules[idx].base);
             return ENSURE_HASH_NOT_SPECIAL(ret);
         }
     }
@@ -108,7 +129,7 @@ static uint64_t _stacktrace_hash()
         hashes[hashcnt++] = hash;
     }
 
-    uint64_t ret = hash_buffer(hashes, sizeof(uint64_t) * hashcnt);
+    uint64_t ret = g_hash_buffer(hashes, sizeof(uint64_t) * hashcnt);
     return ENSURE_HASH_NOT_SPECIAL(ret);
 }
 
@@ -120,53 +141,56 @@ static uint64_t _parameter_hash(const char *fmt, va_list args)
     while (*fmt != 0) {
         switch (*fmt++) {
         case 's':
-            hashes[hashcnt++] = hash_string(va_arg(args, const char *), -1);
+            hashes[hashcnt++] =
+                g_hash_string(va_arg(args, const char *), -1);
             break;
 
         case 'S':
             value = va_arg(args, uint32_t);
             hashes[hashcnt++] =
-                hash_string(va_arg(args, const char *), value);
+                g_hash_string(va_arg(args, const char *), value);
             break;
 
         case 'u':
             hashes[hashcnt++] =
-                hash_stringW(va_arg(args, const wchar_t *), -1);
+                g_hash_stringW(va_arg(args, const wchar_t *), -1);
             break;
 
         case 'U':
             value = va_arg(args, uint32_t);
             hashes[hashcnt++] =
-                hash_stringW(va_arg(args, const wchar_t *), value);
+                g_hash_stringW(va_arg(args, const wchar_t *), value);
             break;
 
         case 'i':
             value = va_arg(args, uint32_t);
-            hashes[hashcnt++] = hash_buffer(&value, sizeof(uint32_t));
+            hashes[hashcnt++] = g_hash_buffer(&value, sizeof(uint32_t));
             break;
 
         case 'p':
             value2 = va_arg(args, uintptr_t);
-            hashes[hashcnt++] = hash_buffer(&value2, sizeof(uintptr_t));
+            hashes[hashcnt++] = g_hash_buffer(&value2, sizeof(uintptr_t));
             break;
 
         case 'I':
             valueptr = va_arg(args, uintptr_t *);
             if(valueptr != NULL) {
-                hashes[hashcnt++] = hash_buffer(valueptr, sizeof(uint32_t));
+                hashes[hashcnt++] =
+                    g_hash_buffer(valueptr, sizeof(uint32_t));
             }
             break;
 
         case 'P':
             valueptr = va_arg(args, uintptr_t *);
             if(valueptr != NULL) {
-                hashes[hashcnt++] = hash_buffer(valueptr, sizeof(uintptr_t));
+                hashes[hashcnt++] =
+                    g_hash_buffer(valueptr, sizeof(uintptr_t));
             }
             break;
 
         case 'b':
             value = va_arg(args, uint32_t);
-            hashes[hashcnt++] = hash_buffer(va_arg(args, void *), value);
+            hashes[hashcnt++] = g_hash_buffer(va_arg(args, void *), value);
             break;
 
         case 'h':
@@ -178,7 +202,7 @@ static uint64_t _parameter_hash(const char *fmt, va_list args)
         }
     }
 
-    uint64_t ret = hash_buffer(hashes, sizeof(uint64_t) * hashcnt);
+    uint64_t ret = g_hash_buffer(hashes, sizeof(uint64_t) * hashcnt);
     return ENSURE_HASH_NOT_SPECIAL(ret);
 }
 
@@ -196,9 +220,25 @@ void diffing_init(const char *path, int enable)
         if(list != NULL) {
             fread(list, filesize, 1, fp);
 
-            dnq_init(
-                &g_list, list, sizeof(uint64_t), filesize / sizeof(uint64_t)
-            );
+            uint32_t count = filesize / sizeof(uint64_t);
+
+            if(count != 0 && memcmp(list, DIFFING_HASH64_MAGIC,
+                    sizeof(uint64_t)) == 0) {
+                g_hash_buffer = &_hash_buffer;
+                g_hash_string = &hash64_string;
+                g_hash_stringW = &hash64_stringW;
+                g_hash_path = &hash64_pathW;
+                g_hash_uint64 = &hash64_uint64;
+                list++, count--;
+            }
+
+            if(bloom_init(&g_filter, count) == 0) {
+                for (uint32_t idx = 0; idx < count; idx++) {
+                    bloom_add(&g_filter, list[idx]);
+                }
+            }
+
+            dnq_init(&g_list, list, sizeof(uint64_t), count);
         }
 
         fclose(fp);
@@ -250,5 +290,9 @@ int is_interesting_hash(uint64_t hash)
         return 1;
     }
 
+    if(g_filter.blocks != NULL && bloom_has(&g_filter, hash) == 0) {
+        return 0;
+    }
+
     return dnq_has64(&g_list, hash);
 }
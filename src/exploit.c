@@ -26,7 +26,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "native.h"
 #include "pipe.h"
 
-static array_t g_last_guard_page_addr_array;
+static table_t g_last_guard_page_addr_table;
 static slab_t g_guard_page_referer_slab;
 static uintptr_t g_guard_pages_wl[32];
 static uint32_t g_guard_page_wl_count;
@@ -39,7 +39,7 @@ void exploit_init()
 {
     LDR_MODULE *mod; PEB *peb = get_peb();
 
-    array_init(&g_last_guard_page_addr_array);
+    table_init(&g_last_guard_page_addr_table);
     slab_init(
         &g_guard_page_referer_slab, sizeof(hook_t), 128,
         PAGE_EXECUTE_READWRITE
@@ -118,19 +118,15 @@ int WINAPI exploit_unset_guard_page(void *addr)
 
 void *exploit_get_last_guard_page()
 {
-    void *ret = array_get(
-        &g_last_guard_page_addr_array, get_current_thread_id()
+    return table_exchange(
+        &g_last_guard_page_addr_table, get_current_thread_id(), NULL
     );
-    array_set(
-        &g_last_guard_page_addr_array, get_current_thread_id(), NULL
-    );
-    return ret;
 }
 
 void exploit_set_last_guard_page(void *addr)
 {
-    array_set(
-        &g_last_guard_page_addr_array, get_current_thread_id(), addr
+    table_set(
+        &g_last_guard_page_addr_table, get_current_thread_id(), addr
     );
 }
 
@@ -328,6 +324,9 @@ int exploit_hotpatch_guard_page_referer(uintptr_t pc)
     uint8_t *insn = (uint8_t *) pc;
 
     hook_t *h = slab_getmem(&g_guard_page_referer_slab);
+    if(h == NULL) {
+        return -1;
+    }
 
     h->type = HOOK_TYPE_GUARD;
     h->addr = insn;
@@ -335,7 +334,7 @@ int exploit_hotpatch_guard_page_referer(uintptr_t pc)
 
     int r = hook(h, NULL);
     if(r < 0) {
-        slab_return_last(&g_guard_page_referer_slab);
+        slab_free(&g_guard_page_referer_slab, h);
         return r;
     }
     return h->stub_used;
@@ -0,0 +1,276 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <windows.h>
+#include "hash.h"
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const uint64_t g_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL,
+};
+
+// Amount of characters that hash64_pathW() folds at a time.
+#define HASH_FOLD_CHUNK 256
+
+// 64x64 to 128-bit multiplication, returning the lower half in a and the
+// upper half in b. 32-bit x86 has to do with four 32x32 multiplications.
+static void _hash_mum(uint64_t *a, uint64_t *b)
+{
+#if __x86_64__
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t _hash_mix(uint64_t a, uint64_t b)
+{
+    _hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t _hash_read8(const uint8_t *p)
+{
+    uint64_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+static uint64_t _hash_read4(const uint8_t *p)
+{
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+static uint64_t _hash_read3(const uint8_t *p, uint32_t length)
+{
+    return ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) |
+        p[length - 1];
+}
+
+uint64_t hash64(const void *buf, uint32_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) buf; uint64_t a, b;
+
+    seed ^= _hash_mix(seed ^ g_secret[0], g_secret[1]);
+
+    if(length <= 16) {
+        if(length >= 4) {
+            uint32_t off = (length >> 3) << 2;
+            a = (_hash_read4(p) << 32) | _hash_read4(p + off);
+            b = (_hash_read4(p + length - 4) << 32) |
+                _hash_read4(p + length - 4 - off);
+        }
+        else if(length != 0) {
+            a = _hash_read3(p, length);
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        uint32_t left = length;
+
+        // Three independent lanes for the bulk of longer inputs.
+        if(left > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = _hash_mix(_hash_read8(p) ^ g_secret[1],
+                    _hash_read8(p + 8) ^ seed);
+                see1 = _hash_mix(_hash_read8(p + 16) ^ g_secret[2],
+                    _hash_read8(p + 24) ^ see1);
+                see2 = _hash_mix(_hash_read8(p + 32) ^ g_secret[3],
+                    _hash_read8(p + 40) ^ see2);
+                p += 48, left -= 48;
+            } while (left > 48);
+            seed ^= see1 ^ see2;
+        }
+
+        while (left > 16) {
+            seed = _hash_mix(_hash_read8(p) ^ g_secret[1],
+                _hash_read8(p + 8) ^ seed);
+            p += 16, left -= 16;
+        }
+
+        a = _hash_read8(p + left - 16);
+        b = _hash_read8(p + left - 8);
+    }
+
+    a ^= g_secret[1];
+    b ^= seed;
+    _hash_mum(&a, &b);
+    return _hash_mix(a ^ g_secret[0] ^ length, b ^ g_secret[1]);
+}
+
+uint64_t hash64_string(const char *buf, int32_t length)
+{
+    if(buf == NULL) {
+        return 0;
+    }
+
+    if(length < 0) {
+        length = strlen(buf);
+    }
+    return hash64(buf, length, 0);
+}
+
+uint64_t hash64_stringW(const wchar_t *buf, int32_t length)
+{
+    if(buf == NULL) {
+        return 0;
+    }
+
+    if(length < 0) {
+        length = lstrlenW(buf);
+    }
+    return hash64(buf, length * sizeof(wchar_t), 0);
+}
+
+// Lowercases the ASCII characters, eight at a time with SSE2.
+static void _hash_fold(wchar_t *out, const wchar_t *buf, uint32_t length)
+{
+    uint32_t idx = 0;
+
+#if __SSE2__
+    const __m128i upper_a = _mm_set1_epi16('A' - 1);
+    const __m128i upper_z = _mm_set1_epi16('Z' + 1);
+    const __m128i delta = _mm_set1_epi16('a' - 'A');
+
+    for (; idx + 8 <= length; idx += 8) {
+        __m128i value = _mm_loadu_si128((const __m128i *) &buf[idx]);
+        __m128i mask = _mm_and_si128(_mm_cmpgt_epi16(value, upper_a),
+            _mm_cmplt_epi16(value, upper_z));
+        value = _mm_add_epi16(value, _mm_and_si128(mask, delta));
+        _mm_storeu_si128((__m128i *) &out[idx], value);
+    }
+#endif
+
+    for (; idx < length; idx++) {
+        wchar_t ch = buf[idx];
+        out[idx] = ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch;
+    }
+}
+
+uint64_t hash64_pathW(const wchar_t *buf, int32_t length)
+{
+    wchar_t folded[HASH_FOLD_CHUNK]; uint64_t ret = 0;
+
+    if(buf == NULL) {
+        return 0;
+    }
+
+    if(length < 0) {
+        length = lstrlenW(buf);
+    }
+
+    // Longer paths are hashed chunk by chunk, each chunk seeded with the
+    // hash of the previous ones.
+    do {
+        uint32_t count = length < HASH_FOLD_CHUNK ? length : HASH_FOLD_CHUNK;
+        _hash_fold(folded, buf, count);
+        ret = hash64(folded, count * sizeof(wchar_t), ret);
+        buf += count, length -= count;
+    } while (length != 0);
+    return ret;
+}
+
+uint64_t hash64_uint64(uint64_t value)
+{
+    return _hash_mix(value ^ g_secret[0], g_secret[1]);
+}
+
+uint64_t hash_mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+uint64_t hash_buffer(const void *buf, uint32_t length)
+{
+    if(buf == NULL || length == 0) {
+        return 0;
+    }
+
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t ret = *p << 7;
+    for (uint32_t idx = 0; idx < length; idx++) {
+        ret = (ret * 1000003) ^ *p++;
+    }
+    return ret ^ length;
+}
+
+uint64_t hash_string(const char *buf, int32_t length)
+{
+    if(buf == NULL || length == 0) {
+        return 0;
+    }
+
+    if(length < 0) {
+        length = strlen(buf);
+    }
+
+    uint64_t ret = *buf << 7;
+    for (int32_t idx = 0; idx < length; idx++) {
+        ret = (ret * 1000003) ^ (uint8_t) *buf++;
+    }
+    return ret ^ length;
+}
+
+uint64_t hash_stringW(const wchar_t *buf, int32_t length)
+{
+    if(buf == NULL || length == 0) {
+        return 0;
+    }
+
+    if(length < 0) {
+        length = lstrlenW(buf);
+    }
+
+    uint64_t ret = *buf << 7;
+    for (int32_t idx = 0; idx < length; idx++) {
+        ret = (ret * 1000003) ^ (uint16_t) *buf++;
+    }
+    return ret ^ length;
+}
+
+uint64_t hash_uint64(uint64_t value)
+{
+    return hash_buffer(&value, sizeof(value));
+}
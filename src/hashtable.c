@@ -40,158 +40,289 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include "hash.h"
 #include "hashtable.h"
 #include "memory.h"
+#include "native.h"
+#include "pipe.h"
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
- * From Knuth -- a good choice for hash/rehash values is p, p-2 where
- * p and p-2 are both prime.  These tables are sized to have an extra 10%
- * free to avoid exponential performance degradation as the hash table fills
+ * Open addressing with power of two table sizes. Next to the slots there's
+ * an array with one control byte per slot, which is either HT_EMPTY,
+ * HT_DELETED, or, for a present entry, HT_FULL and the lower 7 bits of its
+ * hash. As HT_EMPTY is zero, freshly allocated tables need no setup. A
+ * lookup compares the control bytes of HT_GROUP slots at once and only
+ * looks at the slots whose control byte matches. The first HT_GROUP
+ * control bytes are mirrored at the end so that a group may start at any
+ * slot. Groups are probed quadratically.
  */
 
-static const struct {
-   uint32_t max_entries;
-   uint32_t size;
-   uint32_t rehash;
-} hash_sizes[] = {
-    { 2,            5,          3         },
-    { 4,            7,          5         },
-    { 8,            13,         11        },
-    { 16,           19,         17        },
-    { 32,           43,         41        },
-    { 64,           73,         71        },
-    { 128,          151,        149       },
-    { 256,          283,        281       },
-    { 512,          571,        569       },
-    { 1024,         1153,       1151      },
-    { 2048,         2269,       2267      },
-    { 4096,         4519,       4517      },
-    { 8192,         9013,       9011      },
-    { 16384,        18043,      18041     },
-    { 32768,        36109,      36107     },
-    { 65536,        72091,      72089     },
-    { 131072,       144409,     144407    },
-    { 262144,       288361,     288359    },
-    { 524288,       576883,     576881    },
-    { 1048576,      1153459,    1153457   },
-    { 2097152,      2307163,    2307161   },
-    { 4194304,      4613893,    4613891   },
-    { 8388608,      9227641,    9227639   },
-    { 16777216,     18455029,   18455027  },
-    { 33554432,     36911011,   36911009  },
-    { 67108864,     73819861,   73819859  },
-    { 134217728,    147639589,  147639587 },
-    { 268435456,    295279081,  295279079 },
-    { 536870912,    590559793,  590559791 },
-    { 1073741824,   1181116273, 1181116271},
-    { 2147483648,   2362232233, 2362232231},
-};
-
-#define entry_is_free(x) (x == NULL || x->length == 0)
-#define entry_is_deleted(x) (x->length == 0)
-#define entry_is_present(x) (x->length != 0)
+#define HT_EMPTY    0x00
+#define HT_DELETED  0x01
+#define HT_FULL     0x80
+
+// Tables are resized once 7/8th of the slots is taken.
+#define HT_MAXLOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Returns a bitmask of the control bytes in the group that equal value.
+static uint32_t _ht_match(const uint8_t *ctrl, uint8_t value)
+{
+#if __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char) value)));
+#else
+    uint32_t ret = 0;
+    for (uint32_t idx = 0; idx < HT_GROUP; idx++) {
+        ret |= (uint32_t)(ctrl[idx] == value) << idx;
+    }
+    return ret;
+#endif
+}
+
+// Returns a bitmask of the empty and deleted slots in the group.
+static uint32_t _ht_match_free(const uint8_t *ctrl)
+{
+#if __SSE2__
+    return ~_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl)) &
+        ((1 << HT_GROUP) - 1);
+#else
+    uint32_t ret = 0;
+    for (uint32_t idx = 0; idx < HT_GROUP; idx++) {
+        ret |= (uint32_t)((ctrl[idx] & HT_FULL) == 0) << idx;
+    }
+    return ret;
+#endif
+}
+
+static ht_entry_t *_ht_slot(const ht_t *ht, const ht_table_t *t,
+    uint32_t index)
+{
+    return (ht_entry_t *)(t->slots + (uintptr_t) index * ht->slot_size);
+}
+
+static void _ht_set_ctrl(ht_table_t *t, uint32_t index, uint8_t value)
+{
+    t->ctrl[index] = value;
+
+    // Keep the mirrored control bytes up-to-date.
+    if(index < HT_GROUP) {
+        t->ctrl[t->capacity + index] = value;
+    }
+}
+
+static int _ht_alloc(const ht_t *ht, ht_table_t *t, uint32_t capacity)
+{
+    uint32_t ctrl_length = (capacity + HT_GROUP + 15) & ~15;
+
+    uint8_t *ptr = (uint8_t *) mem_alloc(
+        ctrl_length + capacity * ht->slot_size);
+    if(ptr == NULL) {
+        return -1;
+    }
+
+    t->ctrl = ptr;
+    t->slots = ptr + ctrl_length;
+    t->capacity = capacity;
+    t->used = 0;
+    return 0;
+}
 
 /**
- * Finds a hash table entry with the given key and hash of that key.
+ * Finds the slot of the entry with the given hash in one of the tables.
  *
- * Returns NULL if no entry is found.  Note that the data pointer may be
- * modified by the user.
+ * Returns -1 if no entry is found.
  */
-static ht_entry_t* hashtable_search(const ht_t *ht, uint64_t hash)
+static int32_t _ht_search(const ht_t *ht, const ht_table_t *t, uint64_t hash)
 {
-    uint64_t double_hash, hash_address;
-    if(ht == NULL) {
-        return NULL;
+    if(t->ctrl == NULL) {
+        return -1;
     }
 
-    uint32_t element_size = sizeof(*ht->table) + ht->data_length;
-    hash_address = hash % ht->size;
-    do {
-        ht_entry_t *entry = (ht_entry_t *)(
-            (char *) ht->table + hash_address * element_size);
-        if(entry_is_free(entry)) {
-            return NULL;
-        }
-        if(entry_is_present(entry) && entry->hash == hash) {
-            return entry;
+    uint64_t mixed = hash_mix64(hash);
+    uint32_t mask = t->capacity - 1, index = (uint32_t)(mixed >> 7) & mask;
+    uint8_t h2 = HT_FULL | (mixed & 0x7f);
+
+    // Most entries reside in one of the first slots of their group, so
+    // fetch those alongside the control bytes.
+    __builtin_prefetch(_ht_slot(ht, t, index));
+
+    for (uint32_t probe = HT_GROUP; ; probe += HT_GROUP) {
+        const uint8_t *ctrl = &t->ctrl[index];
+
+        for (uint32_t bits = _ht_match(ctrl, h2); bits != 0;
+                bits &= bits - 1) {
+            uint32_t slot = (index + __builtin_ctz(bits)) & mask;
+            if(_ht_slot(ht, t, slot)->hash == hash) {
+                return slot;
+            }
         }
-        double_hash = hash % ht->rehash;
-        if(double_hash == 0) {
-            double_hash = 1;
+
+        // An empty slot terminates the probe sequence.
+        if(_ht_match(ctrl, HT_EMPTY) != 0 || probe > t->capacity) {
+            return -1;
         }
-        hash_address = (hash_address + double_hash) % ht->size;
-    } while (hash_address != hash % ht->size);
+
+        index = (index + probe) & mask;
+    }
+}
+
+static ht_entry_t *_ht_find(const ht_t *ht, uint64_t hash)
+{
+    int32_t slot;
+
+    if(ht == NULL) {
+        return NULL;
+    }
+
+    if((slot = _ht_search(ht, &ht->cur, hash)) >= 0) {
+        return _ht_slot(ht, &ht->cur, slot);
+    }
+
+    if((slot = _ht_search(ht, &ht->old, hash)) >= 0) {
+        return _ht_slot(ht, &ht->old, slot);
+    }
     return NULL;
 }
 
-static void hashtable_rehash(ht_t *ht, unsigned int new_size_index)
+// Returns the first empty or deleted slot for the given hash.
+static uint32_t _ht_find_free(const ht_table_t *t, uint64_t mixed)
+{
+    uint32_t mask = t->capacity - 1, index = (uint32_t)(mixed >> 7) & mask;
+
+    for (uint32_t probe = HT_GROUP; ; probe += HT_GROUP) {
+        uint32_t bits = _ht_match_free(&t->ctrl[index]);
+        if(bits != 0) {
+            return (index + __builtin_ctz(bits)) & mask;
+        }
+
+        index = (index + probe) & mask;
+    }
+}
+
+static ht_entry_t *_ht_place(ht_t *ht, ht_table_t *t, uint64_t hash)
 {
-    ht_t old_ht = *ht;
-    if(new_size_index >= ARRAY_SIZE(hash_sizes)) return;
+    uint64_t mixed = hash_mix64(hash);
+    uint32_t index = _ht_find_free(t, mixed);
+
+    if(t->ctrl[index] == HT_EMPTY) {
+        t->used++;
+    }
 
-    // XXX: This code is redupped! fuck't
-    ht->table = (ht_entry_t *) mem_alloc(hash_sizes[new_size_index].size *
-        (sizeof(*ht->table) + ht->data_length));
-    if(ht->table == NULL) {
+    _ht_set_ctrl(t, index, HT_FULL | (mixed & 0x7f));
+    return _ht_slot(ht, t, index);
+}
+
+// Removes the entry in the given slot. If no probe sequence could have
+// passed this slot without running into an empty slot, i.e., the slot is
+// surrounded by less than a group worth of used slots, then it's marked
+// empty right away rather than being left as a deleted slot.
+static void _ht_erase(ht_table_t *t, uint32_t index)
+{
+    uint32_t mask = t->capacity - 1;
+    uint32_t before = _ht_match(&t->ctrl[(index - HT_GROUP) & mask], HT_EMPTY);
+    uint32_t after = _ht_match(&t->ctrl[index], HT_EMPTY);
+
+    if(before != 0 && after != 0 &&
+            __builtin_ctz(after) + __builtin_clz(before << 16) < HT_GROUP) {
+        _ht_set_ctrl(t, index, HT_EMPTY);
+        t->used--;
         return;
     }
 
-    ht->data_length = old_ht.data_length;
-    ht->size_index = new_size_index;
-    ht->size = hash_sizes[ht->size_index].size;
-    ht->rehash = hash_sizes[ht->size_index].rehash;
-    ht->max_entries = hash_sizes[ht->size_index].max_entries;
-    ht->entries = 0;
-    ht->deleted_entries = 0;
-
-    uint32_t element_size = sizeof(*ht->table) + ht->data_length;
-    for (uint32_t idx = 0; idx < old_ht.size; idx++) {
-        ht_entry_t *e = (ht_entry_t *)(
-            (char *) old_ht.table + idx * element_size);
-        if(entry_is_present(e)) {
-            ht_insert2(ht, e->hash, e->data, e->length);
+    _ht_set_ctrl(t, index, HT_DELETED);
+}
+
+// Moves a few more entries from the previous table into the current one,
+// which bounds the amount of work of any single insertion or removal.
+static void _ht_migrate(ht_t *ht, uint32_t count)
+{
+    ht_table_t *old = &ht->old;
+
+    for (; count != 0 && ht->migrated < old->capacity; count--) {
+        uint32_t index = ht->migrated++;
+        if((old->ctrl[index] & HT_FULL) != 0) {
+            ht_entry_t *e = _ht_slot(ht, old, index);
+            memcpy(_ht_place(ht, &ht->cur, e->hash), e, ht->slot_size);
+
+            // Lookups in the previous table have to skip this entry from
+            // now on, but may not stop at it.
+            _ht_set_ctrl(old, index, HT_DELETED);
         }
     }
-    mem_free(old_ht.table);
+
+    if(old->ctrl != NULL && ht->migrated == old->capacity) {
+        mem_free(old->ctrl);
+        memset(old, 0, sizeof(ht_table_t));
+    }
+}
+
+// Starts moving all entries into a new table, which is either twice as big
+// or, if the current one is mostly filled up with deleted entries, equally
+// sized. Any previous resize is finished first.
+static int _ht_resize(ht_t *ht)
+{
+    uint32_t capacity = ht->cur.capacity;
+
+    _ht_migrate(ht, UINT32_MAX);
+
+    if(ht->entries >= HT_MAXLOAD(capacity) / 2) {
+        capacity *= 2;
+    }
+
+    ht_table_t table;
+    if(capacity == 0 || _ht_alloc(ht, &table, capacity) < 0) {
+        return -1;
+    }
+
+    ht->old = ht->cur;
+    ht->cur = table;
+    ht->migrated = 0;
+    return 0;
 }
 
 void ht_init(ht_t *ht, uint32_t data_length)
 {
+    memset(ht, 0, sizeof(ht_t));
+
     ht->data_length = data_length != 0 ? data_length : sizeof(void *);
-    // TODO: use slices here
-    ht->size = hash_sizes[0].size;
-    ht->table = (ht_entry_t *) mem_alloc(ht->size *
-        (sizeof(*ht->table) + ht->data_length));
-    if(ht->table == NULL) {
-        return;
-    }
-    ht->size_index = 0;
-    ht->entries = 0;
-    ht->deleted_entries = 0;
-    ht->rehash = hash_sizes[ht->size_index].rehash;
-    ht->max_entries = hash_sizes[ht->size_index].max_entries;
-    return;
+    ht->slot_size =
+        (sizeof(ht_entry_t) + ht->data_length + 7) & ~7;
+
+    _ht_alloc(ht, &ht->cur, HT_GROUP);
 }
 
 void ht_free(ht_t *ht)
 {
     if(ht != NULL) {
-        mem_free(ht->table);
+        mem_free(ht->cur.ctrl);
+        mem_free(ht->old.ctrl);
+        memset(&ht->cur, 0, sizeof(ht_table_t));
+        memset(&ht->old, 0, sizeof(ht_table_t));
+        ht->entries = 0;
     }
 }
 
+// Indices first cover the previous table, if any, and then the current
+// one. Entries may be skipped or returned twice if the table is modified
+// in the meantime.
 int ht_next_key(const ht_t *ht, uint32_t *index, uint64_t *hash)
 {
-    uint32_t element_size = sizeof(*ht->table) + ht->data_length;
+    uint32_t count = ht->old.capacity + ht->cur.capacity;
 
-    for (uint32_t idx = *index; idx < ht->size; idx++) {
-        ht_entry_t *e = (ht_entry_t *)(
-            (char *) ht->table + idx * element_size);
-        if(entry_is_present(e)) {
+    for (uint32_t idx = *index; idx < count; idx++) {
+        const ht_table_t *t = &ht->old; uint32_t slot = idx;
+        if(slot >= t->capacity) {
+            slot -= t->capacity, t = &ht->cur;
+        }
+
+        if((t->ctrl[slot] & HT_FULL) != 0) {
             *index = idx + 1;
-            *hash = e->hash;
+            *hash = _ht_slot(ht, t, slot)->hash;
             return 0;
         }
     }
@@ -200,7 +331,7 @@ int ht_next_key(const ht_t *ht, uint32_t *index, uint64_t *hash)
 
 void *ht_lookup(const ht_t *ht, uint64_t hash, uint32_t *length)
 {
-    ht_entry_t *entry = hashtable_search(ht, hash);
+    ht_entry_t *entry = _ht_find(ht, hash);
     if(entry != NULL) {
         if(length != NULL) {
             *length = entry->length;
@@ -212,93 +343,336 @@ void *ht_lookup(const ht_t *ht, uint64_t hash, uint32_t *length)
 
 int ht_contains(const ht_t *ht, uint64_t hash)
 {
-    ht_entry_t *entry = hashtable_search(ht, hash);
-    return entry != NULL && entry->length != 0;
+    return _ht_find(ht, hash) != NULL;
 }
 
 /**
- * Inserts the data with the given hash into the table.
+ * Inserts the data with the given hash into the table, replacing the data
+ * of an existing entry with the same hash.
  *
- * Note that insertion may rearrange the table on a resize or rehash,
+ * Note that insertion may move entries between tables while resizing,
  * so previously found hash_entries are no longer valid after this function.
  */
 int ht_insert2(ht_t *ht, uint64_t hash, void *data, uint32_t length)
 {
-    uint64_t hash_address;
-
-    if(length == 0 || length > ht->data_length) {
+    if(length == 0 || length > ht->data_length || ht->cur.ctrl == NULL) {
         return -1;
     }
 
-    if(ht->entries >= ht->max_entries) {
-        hashtable_rehash(ht, ht->size_index + 1);
+    ht_entry_t *entry = _ht_find(ht, hash);
+    if(entry == NULL) {
+        if(ht->cur.used >= HT_MAXLOAD(ht->cur.capacity) &&
+                _ht_resize(ht) < 0) {
+            return -1;
+        }
+
+        entry = _ht_place(ht, &ht->cur, hash);
+        entry->hash = hash;
+        ht->entries++;
     }
-    else if(ht->deleted_entries + ht->entries >= ht->max_entries) {
-        hashtable_rehash(ht, ht->size_index);
+
+    entry->length = length;
+    memcpy(entry->data, data, length);
+
+    _ht_migrate(ht, HT_MIGRATE_SLOTS);
+    return 0;
+}
+
+int ht_insert(ht_t *ht, uint64_t hash, void *data)
+{
+    return ht_insert2(ht, hash, data, ht->data_length);
+}
+
+void ht_remove(ht_t *ht, uint64_t hash)
+{
+    int32_t slot;
+
+    if((slot = _ht_search(ht, &ht->cur, hash)) >= 0) {
+        _ht_erase(&ht->cur, slot);
+        ht->entries--;
+    }
+    else if((slot = _ht_search(ht, &ht->old, hash)) >= 0) {
+        _ht_set_ctrl(&ht->old, slot, HT_DELETED);
+        ht->entries--;
     }
 
-    uint32_t element_size = sizeof(*ht->table) + ht->data_length;
+    _ht_migrate(ht, HT_MIGRATE_SLOTS);
+}
 
-    hash_address = hash % ht->size;
-    do {
-        ht_entry_t *entry = (ht_entry_t *)(
-            (char *) ht->table + hash_address * element_size);
+/*
+ * The concurrent hash map uses linear probing over slots of a hash and a
+ * value. A slot is claimed by swapping its hash from zero to the hash of
+ * the entry, after which the slot belongs to that hash for the lifetime of
+ * the table, so hash zero may not be used. Removal clears the value only.
+ * Resizing freezes all writers, rehashes the present entries into a new
+ * table and then publishes it. Lookups in the meantime see the old table,
+ * which doesn't change while writers are frozen.
+ */
 
-        if(!entry_is_present(entry)) {
-            if(entry_is_deleted(entry)) {
-                ht->deleted_entries--;
-            }
-            entry->hash = hash;
-            entry->length = length;
-            memcpy(entry->data, data, length);
-            ht->entries++;
-            return 0;
-        }
+// Tables are resized once 3/4th of the slots has been claimed.
+#define CHT_MAXLOAD(capacity) ((capacity) - (capacity) / 4)
+#define CHT_MINCAPACITY 16
+
+// 64-bit loads are not split in two on 32-bit, so a hash is never seen
+// half written.
+static uint64_t _cht_hash(const cht_slot_t *slot)
+{
+    return __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+}
+
+static cht_table_t *_cht_alloc(uint32_t capacity)
+{
+    cht_table_t *t = (cht_table_t *) mem_alloc(
+        sizeof(cht_table_t) + capacity * sizeof(cht_slot_t));
+    if(t != NULL) {
+        t->capacity = capacity;
+    }
+    return t;
+}
+
+// Waits for an ongoing resize, if any, and announces the current thread
+// as writer.
+static volatile LONG *_cht_write_begin(cht_t *cht)
+{
+    volatile LONG *writers =
+        &cht->stripes[get_current_thread_id() % CHT_STRIPES].writers;
 
-        uint64_t double_hash = hash % ht->rehash;
-        if(double_hash == 0) {
-            double_hash = 1;
+    while (1) {
+        InterlockedIncrement(writers);
+        if(cht->frozen == 0) {
+            return writers;
         }
-        hash_address = (hash_address + double_hash) % ht->size;
-    } while (hash_address != hash % ht->size);
 
-    /* We could hit here if a required resize failed. An unchecked-malloc
-     * application could ignore this result.
-     */
-    return -1;
+        InterlockedDecrement(writers);
+        while (cht->frozen != 0) {
+            YieldProcessor();
+        }
+    }
 }
 
-int ht_insert(ht_t *ht, uint64_t hash, void *data)
+static void _cht_write_end(volatile LONG *writers)
 {
-    return ht_insert2(ht, hash, data, ht->data_length);
+    InterlockedDecrement(writers);
 }
 
-void ht_remove(ht_t *ht, uint64_t hash)
+// Inserts into a table that is not visible to any other thread yet.
+static void _cht_place(cht_table_t *t, uint64_t hash, void *value)
 {
-    ht_entry_t *entry = hashtable_search(ht, hash);
-    if(entry != NULL && entry->length != 0) {
-        entry->length = 0;
-        ht->entries--;
-        ht->deleted_entries++;
+    uint32_t mask = t->capacity - 1;
+    uint32_t index = (uint32_t) hash_mix64(hash) & mask;
+
+    while (t->slots[index].hash != 0) {
+        index = (index + 1) & mask;
     }
+
+    t->slots[index].hash = hash;
+    t->slots[index].value = value;
+    t->used++;
 }
 
-uint64_t hash_str(const void *_s)
+static int _cht_resize(cht_t *cht, cht_table_t *t)
 {
-    const uint8_t *s = (const uint8_t *) _s;
-    uint64_t ret = 0;
-    while (*s != 0) {
-        ret ^= (ret << 7) | *s++;
+    int ret = 0;
+
+    EnterCriticalSection(&cht->resize_lock);
+
+    // Another thread may have resized the table in the meantime.
+    if(cht->table != t) {
+        LeaveCriticalSection(&cht->resize_lock);
+        return 0;
+    }
+
+    InterlockedExchange(&cht->frozen, 1);
+    for (uint32_t idx = 0; idx < CHT_STRIPES; idx++) {
+        while (cht->stripes[idx].writers != 0) {
+            YieldProcessor();
+        }
+    }
+
+    // Tables mostly filled up with removed entries are rebuilt at the
+    // same size.
+    uint32_t present = 0, capacity = t->capacity;
+    for (uint32_t idx = 0; idx < t->capacity; idx++) {
+        present += t->slots[idx].value != NULL;
+    }
+
+    if(present >= CHT_MAXLOAD(capacity) / 2) {
+        capacity *= 2;
+    }
+
+    cht_table_t *table = _cht_alloc(capacity);
+    if(table != NULL) {
+        for (uint32_t idx = 0; idx < t->capacity; idx++) {
+            if(t->slots[idx].value != NULL) {
+                _cht_place(table, t->slots[idx].hash, t->slots[idx].value);
+            }
+        }
+
+        table->retired = t;
+        InterlockedExchangePointer((void *volatile *) &cht->table, table);
     }
+    else {
+        ret = -1;
+    }
+
+    InterlockedExchange(&cht->frozen, 0);
+    LeaveCriticalSection(&cht->resize_lock);
     return ret;
 }
 
-uint64_t hash_mem(const void *_s, uint32_t length)
+/**
+ * Initializes the map for about capacity entries. It grows beyond that
+ * as required.
+ */
+int cht_init(cht_t *cht, uint32_t capacity)
+{
+    memset(cht, 0, sizeof(cht_t));
+    InitializeCriticalSection(&cht->resize_lock);
+
+    uint32_t slots = CHT_MINCAPACITY;
+    while (CHT_MAXLOAD(slots) < capacity && slots < 0x80000000) {
+        slots *= 2;
+    }
+
+    if((cht->table = _cht_alloc(slots)) == NULL) {
+        pipe("CRITICAL:Error allocating memory for concurrent hash map!");
+        return -1;
+    }
+    return 0;
+}
+
+// Must not be called while other threads may still access the map.
+void cht_free(cht_t *cht)
 {
-    const uint8_t *s = (const uint8_t *) _s;
-    uint64_t ret = 0;
-    while (length-- != 0) {
-        ret ^= (ret << 7) | *s++;
+    cht_table_t *t = cht->table;
+    while (t != NULL) {
+        cht_table_t *retired = t->retired;
+        mem_free(t);
+        t = retired;
     }
+    cht->table = NULL;
+    DeleteCriticalSection(&cht->resize_lock);
+}
+
+void *cht_lookup(const cht_t *cht, uint64_t hash)
+{
+    if(hash == 0) {
+        return NULL;
+    }
+
+    const cht_table_t *t = cht->table;
+    uint32_t mask = t->capacity - 1;
+    uint32_t index = (uint32_t) hash_mix64(hash) & mask;
+
+    // There's always an unclaimed slot, which ends the probe sequence.
+    while (1) {
+        uint64_t value = _cht_hash(&t->slots[index]);
+        if(value == hash) {
+            return t->slots[index].value;
+        }
+        if(value == 0) {
+            return NULL;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+/**
+ * Inserts the value with the given hash into the map, replacing the value
+ * of an existing entry with the same hash.
+ *
+ * Returns -1 for hash zero, a NULL value, or if the map couldn't grow.
+ */
+int cht_insert(cht_t *cht, uint64_t hash, void *value)
+{
+    if(hash == 0 || value == NULL) {
+        return -1;
+    }
+
+    while (1) {
+        volatile LONG *writers = _cht_write_begin(cht);
+        cht_table_t *t = cht->table;
+        uint32_t mask = t->capacity - 1;
+        uint32_t index = (uint32_t) hash_mix64(hash) & mask;
+
+        while (1) {
+            cht_slot_t *slot = &t->slots[index];
+            uint64_t prev = _cht_hash(slot);
+
+            // Reserve the slot before claiming it, so that concurrent
+            // insertions can't fill up the table entirely.
+            if(prev == 0 &&
+                    InterlockedIncrement(&t->used) <=
+                    (LONG) CHT_MAXLOAD(t->capacity)) {
+                prev = InterlockedCompareExchange64(
+                    (volatile LONGLONG *) &slot->hash, hash, 0);
+                if(prev == 0) {
+                    prev = hash;
+                }
+                else {
+                    InterlockedDecrement(&t->used);
+                }
+            }
+            else if(prev == 0) {
+                InterlockedDecrement(&t->used);
+            }
+
+            if(prev == hash) {
+                InterlockedExchangePointer(&slot->value, value);
+                _cht_write_end(writers);
+                return 0;
+            }
+
+            // The table is full, so grow it and then try again.
+            if(prev == 0) {
+                break;
+            }
+            index = (index + 1) & mask;
+        }
+
+        _cht_write_end(writers);
+        if(_cht_resize(cht, t) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Returns the value of the removed entry, if any.
+void *cht_remove(cht_t *cht, uint64_t hash)
+{
+    void *ret = NULL;
+
+    if(hash == 0) {
+        return NULL;
+    }
+
+    volatile LONG *writers = _cht_write_begin(cht);
+    cht_table_t *t = cht->table;
+    uint32_t mask = t->capacity - 1;
+    uint32_t index = (uint32_t) hash_mix64(hash) & mask;
+
+    while (1) {
+        uint64_t value = _cht_hash(&t->slots[index]);
+        if(value == hash) {
+            ret = InterlockedExchangePointer(&t->slots[index].value, NULL);
+            break;
+        }
+        if(value == 0) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+
+    _cht_write_end(writers);
     return ret;
 }
+
+uint64_t hash_str(const void *s)
+{
+    return hash64_string((const char *) s, -1);
+}
+
+uint64_t hash_mem(const void *s, uint32_t length)
+{
+    return hash64(s, length, 0);
+}
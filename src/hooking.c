@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +61,16 @@ static const char *g_missing_blacklist[] = {
 // we are "inside" the monitor.
 static uintptr_t g_Old_LdrLoadDll_address;
 
+// TEB slot pointing to the outermost active hook handler of each thread.
+static uint32_t g_frame_index = TLS_OUT_OF_INDEXES;
+
+uint8_t *g_hook_disabled;
+
+// Interval in milliseconds at which the list of disabled hooks is updated.
+static uint32_t g_control_interval;
+
+static hook_t *g_hooks_forwarded;
+
 static void *_cs_malloc(size_t size)
 {
     return mem_alloc(size);
@@ -117,6 +128,9 @@ int hook_init(HMODULE module_handle)
 
     GetSystemInfo(&g_si);
     _capstone_init();
+
+    // Without a TEB slot every hooked call walks the stack instead.
+    g_frame_index = teb_slot_alloc();
     return 0;
 }
 
@@ -147,6 +161,11 @@ int hook_init2()
     // shown by Brad Spengler it's fairly trivial to achieve the same on
     // Windows XP but for now.. it's fine.
     register_dll_notification(&_ldr_dll_notification, NULL);
+
+    // Has to be in place before any of the entry gates is emitted. Whole
+    // words are allocated as hook_disable() updates a word at a time.
+    g_hook_disabled = virtual_alloc_rw(NULL,
+        (sig_count() / 32 + 1) * sizeof(LONG));
     return 0;
 }
 
@@ -194,7 +213,10 @@ uint8_t *hook_addrcb_RtlDispatchException(hook_t *h,
     return NULL;
 }
 
-int hook_in_monitor()
+// Must be called directly by hook_in_monitor() or hook_enter_sp() as the
+// return addresses of stacktrace(), this function and its caller are
+// skipped, leaving the hook handler as first entry.
+static int _hook_in_monitor()
 {
     uintptr_t addrs[RETADDRCNT]; uint32_t count;
     int inside_LdrLoadDll = 0, outside_ntdll = 0, inside_monitor = 0;
@@ -207,7 +229,7 @@ int hook_in_monitor()
     // If an address that lies within the monitor DLL is found in the
     // stacktrace then we consider this call not interesting. Except for some
     // edge cases, please keep reading.
-    for (uint32_t idx = count - 1; idx >= 2 && idx < RETADDRCNT; idx--) {
+    for (uint32_t idx = count - 1; idx >= 3 && idx < RETADDRCNT; idx--) {
         if(addrs[idx] >= g_monitor_start && addrs[idx] < g_monitor_end) {
             // If this address belongs to New_LdrLoadDll, our hook handler,
             // then we increase the following flag and continue. This helps us
@@ -247,6 +269,152 @@ int hook_in_monitor()
     return 1;
 }
 
+int hook_in_monitor()
+{
+    return _hook_in_monitor();
+}
+
+int hook_enter_sp(hook_frame_t *frame, uintptr_t sp)
+{
+    frame->cookie = 0;
+
+    if(g_frame_index == TLS_OUT_OF_INDEXES) {
+        return _hook_in_monitor();
+    }
+
+    hook_frame_t **active = (hook_frame_t **) teb_slot(g_frame_index);
+    hook_frame_t *outer = *active;
+
+    // The outer hook handler has to be further up the stack than the
+    // return address of this hook handler, and intact. If it is not then it
+    // was left without hook_leave(), e.g., when an exception unwound the
+    // stack, and the frames it was nested in are looked at instead, as long
+    // as it is intact. Comparing against the stack pointer rather than the
+    // frame itself also rejects frames left behind by a sibling call at the
+    // same depth, just like the entry gate does.
+    while (outer != NULL && ((uintptr_t) outer < sp ||
+            outer->cookie != (uintptr_t) outer)) {
+        outer = outer->cookie == (uintptr_t) outer ? outer->prev : NULL;
+    }
+
+    // Calls made by the monitor itself are not interesting. The exception
+    // being DllMain of a library loaded through our LdrLoadDll hook handler,
+    // in which case the stacktrace tells whether it is ntdll or the library
+    // calling us.
+    if(outer != NULL &&
+            (outer->loaddll == 0 || _hook_in_monitor() != 0)) {
+        return 1;
+    }
+
+    frame->prev = outer;
+    frame->cookie = (uintptr_t) frame;
+    frame->loaddll = 0;
+    *active = frame;
+    return 0;
+}
+
+void hook_disable(uint32_t index, int disabled)
+{
+    if(g_hook_disabled == NULL || index >= sig_count()) {
+        return;
+    }
+
+    // The hook control thread may update the bitmap while other threads
+    // do so as well. The bitmap is little-endian, so byte index / 8 holds
+    // the same bit as word index / 32.
+    volatile LONG *word = (volatile LONG *) g_hook_disabled + index / 32;
+    if(disabled != 0) {
+        InterlockedOr(word, 1 << (index % 32));
+    }
+    else {
+        InterlockedAnd(word, ~(1 << (index % 32)));
+    }
+}
+
+void hook_disable_apis(const char *apis)
+{
+    char name[64];
+
+    while (*apis != 0) {
+        if(*apis == ' ' || *apis == ',') {
+            apis++;
+            continue;
+        }
+
+        int disabled = 1;
+        if(*apis == '+' || *apis == '-') {
+            disabled = *apis++ == '-';
+        }
+
+        uint32_t length = strcspn(apis, ", ");
+        if(length < sizeof(name)) {
+            memcpy(name, apis, length);
+            name[length] = 0;
+
+            // The same API may be hooked in more than one library.
+            for (uint32_t idx = sig_index_firsthookidx();
+                    idx < sig_count(); idx++) {
+                if(strcmp(sig_apiname(idx), name) == 0) {
+                    hook_disable(idx, disabled);
+                }
+            }
+        }
+        apis += length;
+    }
+}
+
+static DWORD WINAPI _hook_control_thread(LPVOID param)
+{
+    (void) param;
+
+    // API calls made by this thread are never logged.
+    hook_frame_t frame;
+    hook_enter(&frame);
+
+    char apis[512];
+
+    while (is_shutting_down() == 0) {
+        int32_t length = pipe2(apis, sizeof(apis) - 1,
+            "HOOKS:%d", get_current_process_id());
+        if(length > 0) {
+            apis[length] = 0;
+            hook_disable_apis(apis);
+        }
+
+        sleep(g_control_interval);
+    }
+    return 0;
+}
+
+int hook_control_init(uint32_t interval)
+{
+    if(interval == 0) {
+        return 0;
+    }
+
+    g_control_interval = interval;
+    if(CreateThread(NULL, 0, &_hook_control_thread, NULL, 0, NULL) == NULL) {
+        pipe("CRITICAL:Error initializing hook control thread!");
+        return -1;
+    }
+    return 0;
+}
+
+void hook_leave(hook_frame_t *frame)
+{
+    if(g_frame_index == TLS_OUT_OF_INDEXES) {
+        return;
+    }
+
+    // Frames nested in this one that were left without hook_leave(), e.g.,
+    // through copy_return(), are unregistered along with it.
+    hook_frame_t **active = (hook_frame_t **) teb_slot(g_frame_index);
+    if(frame->cookie == (uintptr_t) frame) {
+        frame->cookie = 0;
+        *active = frame->prev;
+    }
+}
+
 int lde(const void *addr)
 {
     if(g_capstone == 0) {
@@ -484,10 +652,9 @@ static uint8_t *_hook_alloc_closeby(uint8_t *target, uint32_t size)
     return NULL;
 }
 
-int hook_create_jump(hook_t *h)
+int hook_create_jump(hook_t *h, const uint8_t *target)
 {
     uint8_t *addr = h->addr + h->skip;
-    const uint8_t *target = (const uint8_t *) h->handler;
     int stub_used = h->stub_used - h->skip;
 
     NTSTATUS status =
@@ -524,10 +691,9 @@ int hook_create_jump(hook_t *h)
 
 #else
 
-int hook_create_jump(hook_t *h)
+int hook_create_jump(hook_t *h, const uint8_t *target)
 {
     uint8_t *addr = h->addr + h->skip;
-    const uint8_t *target = (const uint8_t *) h->handler;
     int stub_used = h->stub_used - h->skip;
 
     NTSTATUS status =
@@ -863,6 +1029,55 @@ int hook_hotpatch_guardpage(hook_t *h)
     return 0;
 }
 
+// Emits the entry gate of a hook in front of its original function stub.
+// Calls that are made from within the monitor, following the same checks as
+// hook_enter(), and calls to disabled hooks are passed on to the original
+// function right away. Only the remaining calls reach the hook handler.
+static uint8_t *_hook_emit_gate(hook_t *h, uint8_t **ptr)
+{
+    uint8_t *handler = *ptr, *p = *ptr, *disabled = NULL;
+
+    p += asm_pop_register(p, R_R0);
+    p += asm_jump(p, h->handler);
+
+    uint8_t *entry = p;
+    p += asm_push_register(p, R_R0);
+
+    // Only hooks that do nothing but logging may skip their hook handler
+    // when disabled. The others run it and drop the record instead.
+    if(h->log_only != 0 && g_hook_disabled != NULL) {
+        p += asm_move_regimmv(p, R_R0, &g_hook_disabled[h->index / 8]);
+        p += asm_test_memimm8(p, R_R0, 0, 1 << (h->index % 8));
+        disabled = p;
+        p += asm_jump_32bit_rel(p, p, ASM_CC_NZ);
+    }
+
+    // The outermost active hook handler, if any, has to be further up the
+    // stack, intact, and not be calling into LdrLoadDll.
+    p += asm_move_regtls(p, R_R0, teb_slot_offset(g_frame_index));
+    p += asm_jregz(p, R_R0, handler - p - ASM_JREGZ);
+    p += asm_cmp_regreg(p, R_R0, R_SP);
+    p += asm_jump_32bit_rel(p, handler, ASM_CC_BE);
+    p += asm_cmp_memreg(p, R_R0, offsetof(hook_frame_t, cookie), R_R0);
+    p += asm_jump_32bit_rel(p, handler, ASM_CC_NZ);
+    p += asm_test_memimm8(p, R_R0, offsetof(hook_frame_t, loaddll), 0xff);
+    p += asm_jump_32bit_rel(p, handler, ASM_CC_NZ);
+
+    // Falls through into the original function stub.
+    if(disabled != NULL) {
+        asm_jump_32bit_rel(disabled, p, ASM_CC_NZ);
+    }
+    p += asm_pop_register(p, R_R0);
+
+    *ptr = p;
+    return entry;
+}
+
+hook_t *hook_forwarded()
+{
+    return g_hooks_forwarded;
+}
+
 int hook(hook_t *h, void *module_handle)
 {
     if(h->is_hooked != 0) {
@@ -977,6 +1192,16 @@ int hook(hook_t *h, void *module_handle)
         h->module_handle = GetModuleHandle(library);
         h->addr = NULL;
 
+        hook_t *fh = g_hooks_forwarded;
+        while (fh != NULL && fh != h) {
+            fh = fh->forward_next;
+        }
+
+        if(fh == NULL) {
+            h->forward_next = g_hooks_forwarded;
+            g_hooks_forwarded = h;
+        }
+
         // We're having a special case here. When we return 1, the monitor
         // will attempt to re-apply the hook (but this time against the new
         // library). So we should only do this if the new module is already
@@ -985,15 +1210,26 @@ int hook(hook_t *h, void *module_handle)
     }
 
     h->func_stub = slab_getmem(&g_function_stubs);
+    if(h->func_stub == NULL) {
+        return -1;
+    }
+
     memset(h->func_stub, 0xcc, slab_size(&g_function_stubs));
 
+    // Special hooks always run their hook handler.
+    uint8_t *orig_stub = h->func_stub, *entry = (uint8_t *) h->handler;
+    if(h->type == HOOK_TYPE_NORMAL && h->special == 0 && h->orig != NULL &&
+            g_frame_index != TLS_OUT_OF_INDEXES) {
+        entry = _hook_emit_gate(h, &orig_stub);
+    }
+
     if(h->orig != NULL) {
-        *h->orig = (FARPROC) h->func_stub;
+        *h->orig = (FARPROC) orig_stub;
     }
 
     if(h->type == HOOK_TYPE_NORMAL) {
         // Create the original function stub.
-        h->stub_used = hook_create_stub(h->func_stub,
+        h->stub_used = hook_create_stub(orig_stub,
             h->addr, ASM_JUMP_32BIT_SIZE + h->skip);
     }
     else if(h->type == HOOK_TYPE_INSN) {
@@ -1001,6 +1237,7 @@ int hook(hook_t *h, void *module_handle)
     }
     else if(h->type == HOOK_TYPE_GUARD) {
         if(hook_hotpatch_guardpage(h) < 0) {
+            hook_release_stub(h);
             return -1;
         }
     }
@@ -1010,14 +1247,21 @@ int hook(hook_t *h, void *module_handle)
             "CRITICAL:Error creating function stub for %z!%z.",
             h->library, h->funcname
         );
+        hook_release_stub(h);
         return -1;
     }
 
     uint8_t region_original[FUNCTIONSTUBSIZE];
     memcpy(region_original, h->addr, h->stub_used);
 
+    // Instruction and guard page hooks update the handler.
+    if(h->type != HOOK_TYPE_NORMAL) {
+        entry = (uint8_t *) h->handler;
+    }
+
     // Patch the original function.
-    if(hook_create_jump(h) < 0) {
+    if(hook_create_jump(h, entry) < 0) {
+        hook_release_stub(h);
         return -1;
     }
 
@@ -1037,6 +1281,17 @@ uint8_t *hook_get_mem()
     return slab_getmem(&g_function_stubs);
 }
 
+void hook_release_stub(hook_t *h)
+{
+    uint8_t *orig = h->orig != NULL ? (uint8_t *) *h->orig : NULL;
+    if(orig >= h->func_stub && orig < h->func_stub + FUNCTIONSTUBSIZE) {
+        *h->orig = NULL;
+    }
+
+    slab_free(&g_function_stubs, h->func_stub);
+    h->func_stub = NULL;
+}
+
 static void _hook_missing_hooks_worker(
     const char *funcname, uintptr_t address, void *module_handle)
 {
@@ -49,7 +49,8 @@ void chtmtag_attrs(const void *chtmtag, bson *b)
 
         bson_append_binary(b, utf8key+4, BSON_BIN_BINARY,
             utf8val+4, utf8vallen);
-        mem_free(utf8val);
+        scratch_free(utf8val);
+        scratch_free(utf8key);
 
         ptr += 40 / sizeof(uintptr_t);
     }
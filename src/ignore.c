@@ -31,11 +31,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define IGNORE_START(s) \
     if(wcsnicmp(fname, s, sizeof(s)/sizeof(wchar_t)-1) == 0) return 1
 
-static array_t g_ignored_handles;
+static table_t g_ignored_handles;
 
 void ignore_init()
 {
-    array_init(&g_ignored_handles);
+    table_init(&g_ignored_handles);
 }
 
 int is_ignored_filepath(const wchar_t *fname)
@@ -88,7 +88,7 @@ void ignored_object_add(HANDLE object_handle)
     uintptr_t index = (uintptr_t) object_handle / 4;
 
     // The value doesn't matter - it just has to be non-null.
-    if(array_set(&g_ignored_handles, index, &ignored_object_add) < 0) {
+    if(table_set(&g_ignored_handles, index, &ignored_object_add) < 0) {
         pipe("CRITICAL:Error adding ignored object handle!");
     }
 }
@@ -97,14 +97,14 @@ void ignored_object_remove(HANDLE object_handle)
 {
     uintptr_t index = (uintptr_t) object_handle / 4;
 
-    array_unset(&g_ignored_handles, index);
+    table_unset(&g_ignored_handles, index);
 }
 
 int is_ignored_object_handle(HANDLE object_handle)
 {
     uintptr_t index = (uintptr_t) object_handle / 4;
 
-    return array_get(&g_ignored_handles, index) != NULL;
+    return table_get(&g_ignored_handles, index) != NULL;
 }
 
 // Determines whether a created process should be injected. And if injected,
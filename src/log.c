@@ -36,19 +36,109 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define BUFFER_LOG_MAX 4096
 #define EXCEPTION_MAXCOUNT 0x10000
 
+// Interval in milliseconds between memory usage reports.
+#define MEMORY_REPORT_INTERVAL 30000
+
+// Space reserved for the fixed header fields of each API record, i.e., "I",
+// "T", "t", "h", and optionally "e" and "E".
+#define LOG_HEADER_SIZE (5 * BSON_INT_SIZE(1) + BSON_LONG_SIZE(1))
+
+// Strings are encoded as UTF-8 straight into the space reserved for them in
+// the bson object. Strings longer than this many characters are checked to
+// be readable before reserving space for them.
+#define LOG_STRING_CHECK 0x10000
+
+// Each thread appends its records to a ring of LOG_RING_SIZE bytes. The
+// flusher thread drains all rings into the log pipe every so many
+// milliseconds, or as soon as a ring holds a batch worth of records, in
+// writes of up to a batch. Both can be set through the configuration,
+// within the given limits.
+#define LOG_RING_SIZE 0x8000
+#define LOG_BATCH_SIZE 0x10000
+#define LOG_BATCH_MINSIZE 0x400
+#define LOG_BATCH_MAXSIZE 0x100000
+#define LOG_FLUSH_INTERVAL 20
+#define LOG_FLUSH_MAXINTERVAL 1000
+
+// Amount of times, a millisecond apart, that draining waits for a record
+// of which the sequence number has been taken but which hasn't been
+// published yet. Its thread may also have been suspended or killed.
+#define LOG_GAP_RETRIES 10
+
+// Interval in milliseconds at which the flusher thread looks for rings,
+// allocation caches, and scratch arenas of threads that have exited
+// without releasing them.
+#define LOG_RING_CHECK 1000
+
+// Interval in milliseconds at which a thread waiting for the log lock
+// checks whether its owner is still alive. Threads may be killed while
+// holding it, e.g., the flusher thread when the process exits.
+#define LOG_LOCK_CHECK 100
+
+// Value of the TEB slot of threads that are taking or holding the log lock.
+#define LOG_LOCK_MARK 1
+
+// Records are padded to 8 bytes. A record length of LOG_RECORD_WRAP marks
+// the end of the ring as unused.
+typedef struct _log_record_t {
+    uint32_t length;
+    uint32_t seq;
+} log_record_t;
+
+#define LOG_RECORD_WRAP 0xffffffff
+
+// Only the owning thread moves head, and only the thread holding the log
+// lock moves tail. Rings of exited threads are handed over to new threads.
+// The owner is the thread identifier of the owning thread, or zero, and is
+// only changed together with the TEB slot of the owner, under the ring
+// lock.
+typedef struct _log_ring_t {
+    struct _log_ring_t *next;
+    struct _log_ring_t *next_free;
+    uint8_t *buf;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t owner;
+} log_ring_t;
+
 static CRITICAL_SECTION g_mutex;
 static uint32_t g_starttick;
+static volatile LONG g_memory_tick;
 static uint8_t *g_api_init;
 
 static wchar_t g_log_pipename[MAX_PATH];
 static HANDLE g_log_handle;
 
+static uint32_t g_ring_index = TLS_OUT_OF_INDEXES;
+static uint32_t g_lock_index = TLS_OUT_OF_INDEXES;
+static log_ring_t *volatile g_rings;
+static log_ring_t *g_ring_freelist;
+static CRITICAL_SECTION g_ring_mutex;
+
+// Sequence numbers of the last appended and the next record to be written.
+static volatile LONG g_log_seq;
+static uint32_t g_drain_seq = 1;
+
+// Guards writing to the log pipe, the batch buffer, and the ring tails.
+static volatile LONG g_log_lock;
+static uint8_t *g_batch;
+static uint32_t g_batch_length;
+static uint32_t g_batch_size = LOG_BATCH_SIZE;
+static uint32_t g_flush_interval = LOG_FLUSH_INTERVAL;
+
+// Pending bytes in a ring at which the flusher thread is woken up.
+static uint32_t g_wakeup_size = LOG_RING_SIZE / 2;
+
+// Records go through the rings while the flusher thread is running.
+static volatile LONG g_log_async;
+static HANDLE g_flush_event;
+
 #if DEBUG
 static wchar_t g_debug_filepath[MAX_PATH];
 static HANDLE g_debug_handle;
 #endif
 
-static void log_raw(const char *buf, size_t length);
+static void _log_write(const char *buf, uint32_t length);
 
 static int open_handles()
 {
@@ -63,7 +153,8 @@ static int open_handles()
 
     // The process identifier.
     uint32_t process_identifier = get_current_process_id();
-    log_raw((const char *) &process_identifier, sizeof(process_identifier));
+    _log_write((const char *) &process_identifier,
+        sizeof(process_identifier));
 
 #if DEBUG
     g_debug_handle = CreateFileW(g_debug_filepath,
@@ -73,10 +164,8 @@ static int open_handles()
     return 0;
 }
 
-static void log_raw(const char *buf, size_t length)
+static void _log_write(const char *buf, uint32_t length)
 {
-    EnterCriticalSection(&g_mutex);
-
     while (length != 0) {
         uint32_t written = 0; uint32_t status;
 
@@ -99,74 +188,416 @@ static void log_raw(const char *buf, size_t length)
 
         length -= written, buf += written;
     }
+}
 
-    LeaveCriticalSection(&g_mutex);
+// The lock holds the thread identifier of its owner. Threads mark their TEB
+// slot while taking or holding it, so that a thread that has been handed
+// the identifier of a killed owner is not mistaken for that owner.
+static void _log_lock()
+{
+    LONG tid = get_current_thread_id(), owner;
+
+    if(g_lock_index != TLS_OUT_OF_INDEXES) {
+        *teb_slot(g_lock_index) = (void *) LOG_LOCK_MARK;
+    }
+
+    for (uint32_t idx = 1;
+            (owner = InterlockedCompareExchange(&g_log_lock, tid, 0)) != 0;
+            idx++) {
+        // If the owner has our thread identifier, then it has been killed
+        // while holding the lock.
+        if(idx % LOG_LOCK_CHECK == 0 && (owner == tid ||
+                teb_slot_owner_alive(owner,
+                    g_lock_index, LOG_LOCK_MARK) == 0) &&
+                InterlockedCompareExchange(&g_log_lock,
+                    tid, owner) == owner) {
+            break;
+        }
+        sleep(1);
+    }
+}
+
+static void _log_unlock()
+{
+    InterlockedExchange(&g_log_lock, 0);
+
+    if(g_lock_index != TLS_OUT_OF_INDEXES) {
+        *teb_slot(g_lock_index) = NULL;
+    }
+}
+
+static log_ring_t *_log_ring()
+{
+    if(g_ring_index == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+
+    log_ring_t *ring = (log_ring_t *) *teb_slot(g_ring_index);
+    if(ring != NULL) {
+        return ring;
+    }
+
+    EnterCriticalSection(&g_ring_mutex);
+    ring = g_ring_freelist;
+    if(ring != NULL) {
+        g_ring_freelist = ring->next_free;
+    }
+    LeaveCriticalSection(&g_ring_mutex);
+
+    if(ring == NULL) {
+        uint32_t offset = (sizeof(log_ring_t) + 7) & ~7;
+        ring = (log_ring_t *) mem_alloc(offset + LOG_RING_SIZE);
+        if(ring == NULL) {
+            return NULL;
+        }
+
+        ring->buf = (uint8_t *) ring + offset;
+
+        do {
+            ring->next = g_rings;
+        } while (InterlockedCompareExchangePointer(
+            (void *volatile *) &g_rings, ring, ring->next) != ring->next);
+    }
+
+    EnterCriticalSection(&g_ring_mutex);
+    *teb_slot(g_ring_index) = ring;
+    ring->owner = get_current_thread_id();
+    LeaveCriticalSection(&g_ring_mutex);
+    return ring;
+}
+
+// Must be called with the ring lock held.
+static void _log_ring_free(log_ring_t *ring)
+{
+    ring->owner = 0;
+    ring->next_free = g_ring_freelist;
+    g_ring_freelist = ring;
+}
+
+// Hands the rings of threads that have exited without releasing them, e.g.,
+// threads that were terminated by another thread, over to new threads once
+// their pending records have been written. Rings of which the owner can't
+// be told to have exited are left alone.
+static void _log_ring_collect()
+{
+    EnterCriticalSection(&g_ring_mutex);
+    for (log_ring_t *ring = g_rings; ring != NULL; ring = ring->next) {
+        if(ring->owner != 0 && ring->tail == ring->head &&
+                teb_slot_owner_alive(ring->owner, g_ring_index,
+                    (uintptr_t) ring) == 0) {
+            _log_ring_free(ring);
+        }
+    }
+    LeaveCriticalSection(&g_ring_mutex);
+}
+
+/**
+ * Appends a record to the ring of the current thread.
+ *
+ * Returns -1 if there's not enough room in the ring.
+ */
+static int _log_ring_append(log_ring_t *ring, const char *buf,
+    uint32_t length)
+{
+    uint32_t head = ring->head, used = head - ring->tail;
+    uint32_t offset = head & (LOG_RING_SIZE - 1), skip = 0;
+    uint32_t size = (sizeof(log_record_t) + length + 7) & ~7;
+
+    // Records are not split across the end of the ring.
+    if(offset + size > LOG_RING_SIZE) {
+        skip = LOG_RING_SIZE - offset;
+    }
+
+    if(used + skip + size > LOG_RING_SIZE) {
+        return -1;
+    }
+
+    if(skip != 0) {
+        ((log_record_t *)(ring->buf + offset))->length = LOG_RECORD_WRAP;
+        head += skip, offset = 0;
+    }
+
+    log_record_t *record = (log_record_t *)(ring->buf + offset);
+    record->length = length;
+    memcpy(record + 1, buf, length);
+
+    // The sequence number is taken right before the record is published,
+    // so that draining rarely has to wait for it.
+    record->seq = InterlockedIncrement(&g_log_seq);
+    MemoryBarrier();
+    ring->head = head + size;
+
+    if(used < g_wakeup_size && used + skip + size >= g_wakeup_size) {
+        SetEvent(g_flush_event);
+    }
+    return 0;
+}
+
+// Finds the oldest record over all rings, skipping over unused ring ends.
+static log_ring_t *_log_ring_oldest(log_record_t **record)
+{
+    log_ring_t *ret = NULL;
+
+    for (log_ring_t *ring = g_rings; ring != NULL; ring = ring->next) {
+        uint32_t tail = ring->tail, head = ring->head;
+        MemoryBarrier();
+
+        if(tail == head) {
+            continue;
+        }
+
+        log_record_t *r =
+            (log_record_t *)(ring->buf + (tail & (LOG_RING_SIZE - 1)));
+        if(r->length == LOG_RECORD_WRAP) {
+            tail += LOG_RING_SIZE - (tail & (LOG_RING_SIZE - 1));
+            ring->tail = tail;
+            if(tail == head) {
+                continue;
+            }
+            r = (log_record_t *) ring->buf;
+        }
+
+        if(ret == NULL || (int32_t)(r->seq - (*record)->seq) < 0) {
+            ret = ring, *record = r;
+        }
+    }
+    return ret;
+}
+
+static void _log_batch_flush()
+{
+    if(g_batch_length != 0) {
+        _log_write((const char *) g_batch, g_batch_length);
+        g_batch_length = 0;
+    }
+}
+
+/**
+ * Writes all published records to the log pipe, in the order of their
+ * sequence numbers. Must be called with the log lock held.
+ *
+ * Returns -1 when it stopped at a record of which the sequence number has
+ * been taken but which hasn't been published yet, unless force is set, in
+ * which case the missing record is not waited for.
+ */
+static int _log_drain(int force)
+{
+    log_ring_t *ring; log_record_t *r;
+
+    while ((ring = _log_ring_oldest(&r)) != NULL) {
+        if((int32_t)(r->seq - g_drain_seq) > 0 && force == 0) {
+            _log_batch_flush();
+            return -1;
+        }
+
+        // Records that we've given up on waiting for are written as soon
+        // as they show up.
+        if((int32_t)(r->seq - g_drain_seq) >= 0) {
+            g_drain_seq = r->seq + 1;
+        }
+
+        if(g_batch_length + r->length > g_batch_size) {
+            _log_batch_flush();
+        }
+
+        if(r->length > g_batch_size) {
+            _log_write((const char *)(r + 1), r->length);
+        }
+        else {
+            memcpy(g_batch + g_batch_length, r + 1, r->length);
+            g_batch_length += r->length;
+        }
+
+        MemoryBarrier();
+        ring->tail += (sizeof(log_record_t) + r->length + 7) & ~7;
+    }
+
+    _log_batch_flush();
+    return 0;
+}
+
+// Drains the rings, waiting for missing records for a little while. The
+// log lock is not held while waiting.
+static void _log_drain_wait()
+{
+    uint32_t retries = 0;
+
+    while (1) {
+        _log_lock();
+        uint32_t seq = g_drain_seq;
+        int ret = _log_drain(retries == LOG_GAP_RETRIES);
+        retries = seq == g_drain_seq ? retries + 1 : 0;
+        _log_unlock();
+
+        if(ret == 0) {
+            break;
+        }
+        sleep(1);
+    }
+}
+
+static void log_raw(const char *buf, size_t length)
+{
+    log_ring_t *ring;
+
+    if(g_log_async != 0 && length <= LOG_RING_SIZE / 2 &&
+            (ring = _log_ring()) != NULL &&
+            _log_ring_append(ring, buf, length) == 0) {
+        return;
+    }
+
+    // Otherwise everything that's pending is written first, followed by
+    // this record. This is also what happens when a ring is full, in which
+    // case this thread does not wait for missing records.
+    _log_lock();
+    _log_drain(1);
+    _log_write(buf, length);
+    _log_unlock();
+}
+
+static DWORD WINAPI _log_flush_thread(LPVOID param)
+{
+    (void) param;
+
+    // API calls made by this thread are never logged.
+    hook_frame_t frame;
+    hook_enter(&frame);
+
+    uint32_t last_check = get_tick_count();
+
+    while (g_log_async != 0) {
+        WaitForSingleObject(g_flush_event, g_flush_interval);
+        _log_drain_wait();
+
+        if(get_tick_count() - last_check >= LOG_RING_CHECK) {
+            _log_ring_collect();
+            mem_collect();
+            last_check = get_tick_count();
+        }
+    }
+    return 0;
 }
 
-static void log_int32(bson *b, const char *idx, int value)
+void log_flush()
 {
-    bson_append_int(b, idx, value);
+    _log_drain_wait();
 }
 
-static void log_int64(bson *b, const char *idx, int64_t value)
+// From here on records are written right away, as the flusher thread is
+// about to be killed. Anything that's still pending is written now.
+void log_exit()
 {
-    bson_append_long(b, idx, value);
+    InterlockedExchange(&g_log_async, 0);
+    log_flush();
+}
+
+// Hands the ring of the current thread over to the next thread. Its
+// pending records are written by the flusher thread as usual.
+void log_ring_release()
+{
+    if(g_ring_index == TLS_OUT_OF_INDEXES) {
+        return;
+    }
+
+    log_ring_t *ring = (log_ring_t *) *teb_slot(g_ring_index);
+    if(ring == NULL) {
+        return;
+    }
+
+    EnterCriticalSection(&g_ring_mutex);
+    *teb_slot(g_ring_index) = NULL;
+    _log_ring_free(ring);
+    LeaveCriticalSection(&g_ring_mutex);
+}
+
+void log_int32(bson *b, const char *idx, int value)
+{
+    bson_fast_int(b, idx, strlen(idx), value);
+}
+
+void log_int64(bson *b, const char *idx, int64_t value)
+{
+    bson_fast_long(b, idx, strlen(idx), value);
 }
 
 void log_intptr(bson *b, const char *idx, intptr_t value)
 {
 #if __x86_64__
-    bson_append_long(b, idx, value);
+    bson_fast_long(b, idx, strlen(idx), value);
 #else
-    bson_append_int(b, idx, value);
+    bson_fast_int(b, idx, strlen(idx), value);
 #endif
 }
 
 void log_string(bson *b, const char *idx, const char *str, int length)
 {
+    size_t idxlen = strlen(idx);
+
     if(str == NULL || length == 0) {
-        bson_append_string_n(b, idx, "", 0);
+        bson_fast_string(b, idx, idxlen, "", 0);
         return;
     }
 
-    char *utf8s = copy_utf8_string(str, length);
-    if(utf8s != NULL) {
-        int utf8len = *(int *) utf8s;
-        if(bson_append_string_n(b, idx, utf8s+4, utf8len) == BSON_ERROR) {
-            pipe("CRITICAL:Error creating bson string, error, %x utf8len %d.",
-                b->err, utf8len);
-        }
-        mem_free(utf8s);
+    // Don't reserve space for long strings that can't be read anyway.
+    if(length > LOG_STRING_CHECK && range_is_readable(str, length) == 0) {
+        bson_fast_binary(b, idx, idxlen, BSON_BIN_BINARY,
+            "<INVALID POINTER>", 17);
+        return;
     }
-    else {
-        bson_append_binary(b, idx, BSON_BIN_BINARY, "<INVALID POINTER>", 17);
+
+    char *utf8s = bson_fast_string_begin(b, idxlen,
+        UTF8_MAXLEN_ASCII(length));
+    if(utf8s == NULL) {
+        pipe("CRITICAL:Error creating bson string, error, %x length %d.",
+            b->err, length);
+        return;
     }
+
+    int utf8len = copy_utf8_encode(str, length, (uint8_t *) utf8s);
+    if(utf8len < 0) {
+        bson_fast_binary(b, idx, idxlen, BSON_BIN_BINARY,
+            "<INVALID POINTER>", 17);
+        return;
+    }
+    bson_fast_string_commit(b, idx, idxlen, utf8len);
 }
 
 void log_wstring(bson *b, const char *idx, const wchar_t *str, int length)
 {
+    size_t idxlen = strlen(idx);
+
     if(str == NULL || length == 0) {
-        bson_append_string_n(b, idx, "", 0);
+        bson_fast_string(b, idx, idxlen, "", 0);
         return;
     }
 
-    char *utf8s = copy_utf8_wstring(str, length);
-    if(utf8s != NULL) {
-        int utf8len = *(int *) utf8s;
-        if(bson_append_string_n(b, idx, utf8s+4, utf8len) == BSON_ERROR) {
-            pipe("CRITICAL:Error creating bson wstring, error %x, utf8len %d.",
-                b->err, utf8len);
-        }
-        mem_free(utf8s);
+    if(length > LOG_STRING_CHECK &&
+            range_is_readable(str, length * sizeof(wchar_t)) == 0) {
+        bson_fast_binary(b, idx, idxlen, BSON_BIN_BINARY,
+            "<INVALID POINTER>", 17);
+        return;
     }
-    else {
-        bson_append_binary(b, idx, BSON_BIN_BINARY, "<INVALID POINTER>", 17);
+
+    char *utf8s = bson_fast_string_begin(b, idxlen,
+        UTF8_MAXLEN_UNICODE(length));
+    if(utf8s == NULL) {
+        pipe("CRITICAL:Error creating bson wstring, error %x, length %d.",
+            b->err, length);
+        return;
     }
+
+    int utf8len = copy_utf8_encodeW(str, length, (uint8_t *) utf8s);
+    if(utf8len < 0) {
+        bson_fast_binary(b, idx, idxlen, BSON_BIN_BINARY,
+            "<INVALID POINTER>", 17);
+        return;
+    }
+    bson_fast_string_commit(b, idx, idxlen, utf8len);
 }
 
-static void log_argv(bson *b, const char *idx, int argc, const char **argv)
+void log_argv(bson *b, const char *idx, int argc, const char **argv)
 {
-    bson_append_start_array(b, idx);
+    bson_fast_start_array(b, idx, strlen(idx));
     char index[5];
 
     for (int i = 0; i < argc; i++) {
@@ -176,13 +607,13 @@ static void log_argv(bson *b, const char *idx, int argc, const char **argv)
             log_string(b, index, value, copy_strlen(value));
         }
     }
-    bson_append_finish_array(b);
+    bson_fast_finish_array(b);
 }
 
-static void log_wargv(bson *b, const char *idx,
+void log_wargv(bson *b, const char *idx,
     int argc, const wchar_t **argv)
 {
-    bson_append_start_array(b, idx);
+    bson_fast_start_array(b, idx, strlen(idx));
     char index[5];
 
     for (int i = 0; i < argc; i++) {
@@ -193,7 +624,7 @@ static void log_wargv(bson *b, const char *idx,
         }
     }
 
-    bson_append_finish_array(b);
+    bson_fast_finish_array(b);
 }
 
 static void log_buffer(bson *b, const char *idx,
@@ -206,11 +637,12 @@ static void log_buffer(bson *b, const char *idx,
     }
 
     if(range_is_readable(buf, length) != 0) {
-        bson_append_binary(b, idx, BSON_BIN_BINARY,
+        bson_fast_binary(b, idx, strlen(idx), BSON_BIN_BINARY,
             (const char *) buf, trunclength);
     }
     else {
-        bson_append_binary(b, idx, BSON_BIN_BINARY, "<INVALID POINTER>", 17);
+        bson_fast_binary(b, idx, strlen(idx), BSON_BIN_BINARY,
+            "<INVALID POINTER>", 17);
     }
 }
 
@@ -242,92 +674,173 @@ static void log_buffer_notrunc(const uint8_t *buf, uintptr_t length)
     bson_destroy(&b);
 }
 
-void log_explain(uint32_t index)
+void log_arg_string(bson *b, const char *idx, const char *str)
 {
-    bson b; char argidx[4];
+    log_string(b, idx, str, str != NULL ? copy_strlen(str) : 0);
+}
 
-    bson_init_size(&b, mem_suggested_size(1024));
-    bson_append_int(&b, "I", index);
-    bson_append_string(&b, "name", sig_apiname(index));
-    bson_append_string(&b, "type", "info");
-    bson_append_string(&b, "category", sig_category(index));
+void log_arg_wstring(bson *b, const char *idx, const wchar_t *str)
+{
+    log_wstring(b, idx, str, str != NULL ? copy_strlenW(str) : 0);
+}
 
-    bson_append_start_array(&b, "args");
-    bson_append_string(&b, "0", "is_success");
-    bson_append_string(&b, "1", "retval");
+void log_arg_buffer(bson *b, const char *idx, uintptr_t length,
+    const uint8_t *buf, int override)
+{
+    // Limitation override. Instead of displaying this right away in the
+    // report we turn it into a buffer (much like the dropped files).
+    if(override == 0 || length < BUFFER_LOG_MAX) {
+        log_buffer(b, idx, buf, length);
+    }
+    else {
+        log_buffer(b, idx, NULL, 0);
+        log_buffer_notrunc(buf, length);
+    }
+}
 
-    const char *fmt = sig_paramtypes(index);
+void log_arg_bufferp(bson *b, const char *idx, uintptr_t *length,
+    const uint8_t *buf, int override)
+{
+    log_arg_buffer(b, idx, length != NULL ? copy_uintptr(length) : 0,
+        buf, override);
+}
 
-    for (uint32_t argnum = 2; *fmt != 0; argnum++, fmt++) {
-        ultostr(argnum, argidx, 10);
+void log_arg_int32p(bson *b, const char *idx, uint32_t *value)
+{
+    log_int32(b, idx, value != NULL ? copy_uint32(value) : 0);
+}
 
-        // Handle overrides.
-        if(*fmt == '!') {
-            argnum--;
-            continue;
-        }
+void log_arg_intptrp(bson *b, const char *idx, uintptr_t *value)
+{
+    log_intptr(b, idx, value != NULL ? copy_uintptr(value) : 0);
+}
+
+void log_arg_int64p(bson *b, const char *idx, LARGE_INTEGER *value)
+{
+    log_int64(b, idx, value != NULL ? copy_uint64(&value->QuadPart) : 0);
+}
 
-        const char *argname = sig_param_name(index, argnum-2);
+void log_arg_ansi(bson *b, const char *idx, ANSI_STRING *str)
+{
+    ANSI_STRING str_;
+    if(str != NULL && copy_bytes(&str_, str, sizeof(ANSI_STRING)) == 0) {
+        log_string(b, idx, str_.Buffer, str_.Length);
+    }
+    else {
+        log_string(b, idx, "", 0);
+    }
+}
 
-        // On certain formats, we need to tell cuckoo about them for
-        // nicer display / matching.
-        if(*fmt == 'p' || *fmt == 'P' || *fmt == 'x') {
-            bson_append_start_array(&b, argidx);
-            bson_append_string(&b, "0", argname);
+void log_arg_registry(bson *b, const char *idx, uint32_t *type,
+    uint32_t *size, uint8_t *data, int unicode)
+{
+    uint32_t _type = REG_NONE, _size = 0;
 
-            if(*fmt == 'p' || *fmt == 'P') {
-                bson_append_string(&b, "1", "p");
-            }
-            else if(*fmt == 'x') {
-                bson_append_string(&b, "1", "x");
+    if(type == NULL) {
+        type = &_type;
+    }
+    if(size == NULL) {
+        size = &_size;
+    }
+
+    switch (copy_uint32(type)) {
+    case REG_NONE:
+        log_string(b, idx, NULL, 0);
+        break;
+
+    case REG_DWORD:
+        log_int32(b, idx, copy_uint32(data));
+        break;
+
+    case REG_DWORD_BIG_ENDIAN:
+        log_int32(b, idx, our_htonl(copy_uint32(data)));
+        break;
+
+    case REG_EXPAND_SZ: case REG_SZ: case REG_MULTI_SZ:
+        if(unicode == 0) {
+            uint32_t length = copy_uint32(size);
+            // Strings tend to be zero-terminated twice, so check for
+            // that and if that's the case, then ignore the trailing
+            // nullbyte.
+            if(data != NULL &&
+                    copy_strlen((const char *) data) == length - 1) {
+                length--;
             }
-            bson_append_finish_array(&b);
+            log_string(b, idx, (const char *) data, length);
         }
         else {
-            bson_append_string(&b, argidx, argname);
+            uint32_t length = copy_uint32(size) / sizeof(wchar_t);
+            // Strings tend to be zero-terminated twice, so check for
+            // that and if that's the case, then ignore the trailing
+            // nullbyte.
+            if(data != NULL && copy_strlenW(
+                    (const wchar_t *) data) == length - 1) {
+                length--;
+            }
+            log_wstring(b, idx, (const wchar_t *) data, length);
         }
+        break;
+
+    case REG_QWORD:
+        log_int64(b, idx, copy_uint64(data));
+        break;
+
+    default:
+        log_buffer(b, idx, data, copy_uint32(size));
+        break;
     }
+}
 
-    bson_append_finish_array(&b);
-    bson_append_start_object(&b, "flags_value");
+void log_arg_bson(bson *b, const char *idx, bson *value)
+{
+    if(value == NULL) {
+        bson_fast_null(b, idx, strlen(idx));
+    }
+    else {
+        bson_iterator i;
+        bson_iterator_init(&i, value);
+        bson_iterator_next(&i);
+        bson_append_element(b, idx, &i);
+    }
+}
 
-    for (uint32_t idx = 0; sig_flag_name(index, idx) != NULL; idx++) {
-        const flag_repr_t *f = flag_value(sig_flag_value(index, idx));
-        bson_append_start_array(&b, sig_flag_name(index, idx));
+void log_arg_clsid(bson *b, const char *idx, REFCLSID rclsid)
+{
+    char buf[64];
+    clsid_to_string(rclsid, buf);
+    log_string(b, idx, buf, strlen(buf));
+}
 
-        for (uint32_t idx2 = 0; f->repr != NULL; idx2++, f++) {
-            ultostr(idx, argidx, 10);
-            bson_append_start_array(&b, argidx);
-            bson_append_int(&b, "0", f->value);
-            bson_append_string(&b, "1", f->repr);
-            bson_append_finish_array(&b);
-        }
+void log_arg_bstr(bson *b, const char *idx, BSTR bstr)
+{
+    const wchar_t *s = L""; uint32_t len = 0;
 
-        bson_append_finish_array(&b);
+    if(bstr != NULL) {
+        s = (const wchar_t *) bstr;
+        len = sys_string_length(bstr);
     }
 
-    bson_append_finish_object(&b);
-    bson_append_start_object(&b, "flags_bitmask");
-
-    for (uint32_t idx = 0; sig_flag_name(index, idx) != NULL; idx++) {
-        const flag_repr_t *f = flag_bitmask(sig_flag_value(index, idx));
-        bson_append_start_array(&b, sig_flag_name(index, idx));
+    log_wstring(b, idx, s, len);
+}
 
-        for (uint32_t idx2 = 0; f->repr != NULL; idx2++, f++) {
-            ultostr(idx, argidx, 10);
-            bson_append_start_array(&b, argidx);
-            bson_append_int(&b, "0", f->value);
-            bson_append_string(&b, "1", f->repr);
-            bson_append_finish_array(&b);
-        }
+void log_arg_variant(bson *b, const char *idx, const VARIANT *v)
+{
+    const wchar_t *s = L""; uint32_t len = 0;
 
-        bson_append_finish_array(&b);
+    // TODO Support other VARIANT types as needed.
+    if(v != NULL && v->vt == VT_BSTR && v->bstrVal != NULL) {
+        s = (const wchar_t *) v->bstrVal;
+        len = sys_string_length(v->bstrVal);
     }
 
-    bson_append_finish_object(&b);
-    bson_finish(&b);
-    log_raw(bson_data(&b), bson_size(&b));
-    bson_destroy(&b);
+    log_wstring(b, idx, s, len);
+}
+
+void log_explain(uint32_t index)
+{
+    // The explain records are serialized at build time.
+    uint32_t length; const uint8_t *record = sig_explain(index, &length);
+    log_raw((const char *) record, length);
 }
 
 #if DEBUG
@@ -360,17 +873,22 @@ static void _log_stacktrace(bson *b)
 
 #endif
 
-void log_api(uint32_t index, int is_success, uintptr_t return_value,
-    uint64_t hash, last_error_t *lasterr, ...)
+int log_api_start(bson *b, uint32_t index, int is_success,
+    uintptr_t return_value, uint64_t hash, last_error_t *lasterr)
 {
-    va_list args; char idx[4];
-
-    // We haven't started logging yet.
-    if(index >= sig_index_firsthookidx() && g_monitor_logging == 0) {
-        return;
+    // We haven't started logging yet or this hook has been disabled.
+    if(index >= sig_index_firsthookidx() &&
+            (g_monitor_logging == 0 || hook_is_disabled(index) != 0)) {
+        return -1;
     }
 
-    va_start(args, lasterr);
+    // Every now and then report the memory usage of the monitor. Only the
+    // thread that manages to update the tick count does so.
+    uint32_t tick = get_tick_count(), last = g_memory_tick;
+    if(tick - last >= MEMORY_REPORT_INTERVAL && (uint32_t)
+            InterlockedCompareExchange(&g_memory_tick, tick, last) == last) {
+        log_memory();
+    }
 
     EnterCriticalSection(&g_mutex);
 
@@ -381,46 +899,74 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
 
     LeaveCriticalSection(&g_mutex);
 
-    bson b;
+    // The unchecked appenders below rely on the reserved space.
+    if(bson_init_size(b, mem_suggested_size(1024)) == BSON_ERROR ||
+            bson_reserve(b, LOG_HEADER_SIZE) == BSON_ERROR) {
+        bson_destroy(b);
+        return -1;
+    }
 
-    bson_init_size(&b, mem_suggested_size(1024));
-    bson_append_int(&b, "I", index);
-    bson_append_int(&b, "T", get_current_thread_id());
-    bson_append_int(&b, "t", get_tick_count() - g_starttick);
-    bson_append_long(&b, "h", hash);
+    bson_fast_int_unchecked(b, BSON_KEY("I"), index);
+    bson_fast_int_unchecked(b, BSON_KEY("T"), get_current_thread_id());
+    bson_fast_int_unchecked(b, BSON_KEY("t"),
+        get_tick_count() - g_starttick);
+    bson_fast_long_unchecked(b, BSON_KEY("h"), hash);
 
     // If failure has been determined, then log the last error as well.
     if(is_success == 0) {
-        bson_append_int(&b, "e", lasterr->lasterror);
-        bson_append_int(&b, "E", lasterr->nt_status);
+        bson_fast_int_unchecked(b, BSON_KEY("e"), lasterr->lasterror);
+        bson_fast_int_unchecked(b, BSON_KEY("E"), lasterr->nt_status);
     }
 
 #if DEBUG
     if(index != sig_index_exception()) {
-        _log_stacktrace(&b);
+        _log_stacktrace(b);
     }
 #endif
 
-    bson_append_start_array(&b, "args");
-    bson_append_int(&b, "0", is_success);
-    bson_append_long(&b, "1", return_value);
+    if(bson_fast_start_array(b, BSON_KEY("args")) == BSON_ERROR ||
+            bson_fast_int(b, BSON_KEY("0"), is_success) == BSON_ERROR ||
+            bson_fast_long(b, BSON_KEY("1"), return_value) == BSON_ERROR) {
+        bson_destroy(b);
+        return -1;
+    }
+    return 0;
+}
+
+void log_api_finish(bson *b)
+{
+    bson_fast_finish_array(b);
+    bson_fast_finish(b);
+    log_raw(bson_data(b), bson_size(b));
+    bson_destroy(b);
+}
+
+void log_api(uint32_t index, int is_success, uintptr_t return_value,
+    uint64_t hash, last_error_t *lasterr, ...)
+{
+    va_list args; char idx[4]; bson b;
+
+    if(log_api_start(&b, index, is_success, return_value,
+            hash, lasterr) < 0) {
+        return;
+    }
+
+    va_start(args, lasterr);
 
     int argnum = 2, override = 0;
 
     for (const char *fmt = sig_paramtypes(index); *fmt != 0; fmt++) {
-        ultostr(argnum++, idx, 10);
-
-        // Limitation override. Instead of displaying this right away in the
-        // report we turn it into a buffer (much like the dropped files).
+        // Limitation override, see also log_arg_buffer().
         if(*fmt == '!') {
             override = 1;
-            argnum--;
             fmt++;
         }
 
+        ultostr(argnum++, idx, 10);
+
         if(*fmt == 's') {
             const char *s = va_arg(args, const char *);
-            log_string(&b, idx, s, s != NULL ? copy_strlen(s) : 0);
+            log_arg_string(&b, idx, s);
         }
         else if(*fmt == 'S') {
             int len = va_arg(args, int);
@@ -429,7 +975,7 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
         }
         else if(*fmt == 'u') {
             const wchar_t *s = va_arg(args, const wchar_t *);
-            log_wstring(&b, idx, s, s != NULL ? copy_strlenW(s) : 0);
+            log_arg_wstring(&b, idx, s);
         }
         else if(*fmt == 'U') {
             int len = va_arg(args, int);
@@ -439,25 +985,12 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
         else if(*fmt == 'b') {
             uintptr_t len = va_arg(args, uintptr_t);
             const uint8_t *s = va_arg(args, const uint8_t *);
-            if(override == 0 || len < BUFFER_LOG_MAX) {
-                log_buffer(&b, idx, s, len);
-            }
-            else {
-                log_buffer(&b, idx, NULL, 0);
-                log_buffer_notrunc(s, len);
-            }
+            log_arg_buffer(&b, idx, len, s, override);
         }
         else if(*fmt == 'B') {
             uintptr_t *ptr = va_arg(args, uintptr_t *);
-            uintptr_t len = ptr != NULL ? copy_uintptr(ptr) : 0;
             const uint8_t *s = va_arg(args, const uint8_t *);
-            if(override == 0 || len < BUFFER_LOG_MAX) {
-                log_buffer(&b, idx, s, len);
-            }
-            else {
-                log_buffer(&b, idx, NULL, 0);
-                log_buffer_notrunc(s, len);
-            }
+            log_arg_bufferp(&b, idx, ptr, s, override);
         }
         else if(*fmt == 'i' || *fmt == 'x') {
             int value = va_arg(args, int);
@@ -465,7 +998,7 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
         }
         else if(*fmt == 'I') {
             uint32_t *value = va_arg(args, uint32_t *);
-            log_int32(&b, idx, value != NULL ? copy_uint32(value) : 0);
+            log_arg_int32p(&b, idx, value);
         }
         else if(*fmt == 'l' || *fmt == 'p') {
             uintptr_t value = va_arg(args, uintptr_t);
@@ -473,17 +1006,11 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
         }
         else if(*fmt == 'L' || *fmt == 'P') {
             uintptr_t *value = va_arg(args, uintptr_t *);
-            log_intptr(&b, idx, value != NULL ? copy_uintptr(value) : 0);
+            log_arg_intptrp(&b, idx, value);
         }
         else if(*fmt == 'o') {
-            ANSI_STRING *str = va_arg(args, ANSI_STRING *), str_;
-            if(str != NULL &&
-                    copy_bytes(&str_, str, sizeof(ANSI_STRING)) == 0) {
-                log_string(&b, idx, str_.Buffer, str_.Length);
-            }
-            else {
-                log_string(&b, idx, "", 0);
-            }
+            ANSI_STRING *str = va_arg(args, ANSI_STRING *);
+            log_arg_ansi(&b, idx, str);
         }
         else if(*fmt == 'a') {
             int argc = va_arg(args, int);
@@ -499,62 +1026,7 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
             uint32_t *type = va_arg(args, uint32_t *);
             uint32_t *size = va_arg(args, uint32_t *);
             uint8_t *data = va_arg(args, uint8_t *);
-
-            uint32_t _type = REG_NONE, _size = 0;
-
-            if(type == NULL) {
-                type = &_type;
-            }
-            if(size == NULL) {
-                size = &_size;
-            }
-
-            switch (copy_uint32(type)) {
-            case REG_NONE:
-                log_string(&b, idx, NULL, 0);
-                break;
-
-            case REG_DWORD:
-                log_int32(&b, idx, copy_uint32(data));
-                break;
-
-            case REG_DWORD_BIG_ENDIAN:
-                log_int32(&b, idx, our_htonl(copy_uint32(data)));
-                break;
-
-            case REG_EXPAND_SZ: case REG_SZ: case REG_MULTI_SZ:
-                if(*fmt == 'r') {
-                    uint32_t length = copy_uint32(size);
-                    // Strings tend to be zero-terminated twice, so check for
-                    // that and if that's the case, then ignore the trailing
-                    // nullbyte.
-                    if(data != NULL &&
-                            copy_strlen((const char *) data) == length - 1) {
-                        length--;
-                    }
-                    log_string(&b, idx, (const char *) data, length);
-                }
-                else {
-                    uint32_t length = copy_uint32(size) / sizeof(wchar_t);
-                    // Strings tend to be zero-terminated twice, so check for
-                    // that and if that's the case, then ignore the trailing
-                    // nullbyte.
-                    if(data != NULL && copy_strlenW(
-                            (const wchar_t *) data) == length - 1) {
-                        length--;
-                    }
-                    log_wstring(&b, idx, (const wchar_t *) data, length);
-                }
-                break;
-
-            case REG_QWORD:
-                log_int64(&b, idx, copy_uint64(data));
-                break;
-
-            default:
-                log_buffer(&b, idx, data, copy_uint32(size));
-                break;
-            }
+            log_arg_registry(&b, idx, type, size, data, *fmt == 'R');
         }
         else if(*fmt == 'q') {
             int64_t value = va_arg(args, int64_t);
@@ -562,49 +1034,23 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
         }
         else if(*fmt == 'Q') {
             LARGE_INTEGER *value = va_arg(args, LARGE_INTEGER *);
-            log_int64(&b, idx,
-                value != NULL ? copy_uint64(&value->QuadPart) : 0);
+            log_arg_int64p(&b, idx, value);
         }
         else if(*fmt == 'z') {
             bson *value = va_arg(args, bson *);
-            if(value == NULL) {
-                bson_append_null(&b, idx);
-            }
-            else {
-                bson_iterator i;
-                bson_iterator_init(&i, value);
-                bson_iterator_next(&i);
-                bson_append_element(&b, idx, &i);
-            }
+            log_arg_bson(&b, idx, value);
         }
         else if(*fmt == 'c') {
-            char buf[64];
             REFCLSID rclsid = va_arg(args, REFCLSID);
-            clsid_to_string(rclsid, buf);
-            log_string(&b, idx, buf, strlen(buf));
+            log_arg_clsid(&b, idx, rclsid);
         }
         else if(*fmt == 't') {
             const BSTR bstr = va_arg(args, const BSTR);
-            const wchar_t *s = L""; uint32_t len = 0;
-
-            if(bstr != NULL) {
-                s = (const wchar_t *) bstr;
-                len = sys_string_length(bstr);
-            }
-
-            log_wstring(&b, idx, s, len);
+            log_arg_bstr(&b, idx, bstr);
         }
         else if(*fmt == 'v') {
             const VARIANT *v = va_arg(args, const VARIANT *);
-            const wchar_t *s = L""; uint32_t len = 0;
-
-            // TODO Support other VARIANT types as needed.
-            if(v != NULL && v->vt == VT_BSTR && v->bstrVal != NULL) {
-                s = (const wchar_t *) v->bstrVal;
-                len = sys_string_length(v->bstrVal);
-            }
-
-            log_wstring(&b, idx, s, len);
+            log_arg_variant(&b, idx, v);
         }
         else {
             char buf[2] = {*fmt, 0};
@@ -615,11 +1061,7 @@ void log_api(uint32_t index, int is_success, uintptr_t return_value,
     }
 
     va_end(args);
-
-    bson_append_finish_array(&b);
-    bson_finish(&b);
-    log_raw(bson_data(&b), bson_size(&b));
-    bson_destroy(&b);
+    log_api_finish(&b);
 }
 
 void log_new_process(int track)
@@ -662,6 +1104,9 @@ void log_anomaly(const char *subcategory,
 {
     log_api(sig_index_anomaly(), 1, 0, 0, NULL,
         get_current_thread_id(), subcategory, funcname, msg);
+
+    // Anomalies often precede the process going down.
+    log_flush();
 }
 
 void log_exception(CONTEXT *ctx, EXCEPTION_RECORD *rec,
@@ -790,6 +1235,9 @@ void log_exception(CONTEXT *ctx, EXCEPTION_RECORD *rec,
 
     log_api(sig_index_exception(), 1, 0, 0, NULL, &e, &r, &s);
 
+    // The exception may well crash the process.
+    log_flush();
+
     bson_destroy(&e);
     bson_destroy(&r);
     bson_destroy(&s);
@@ -800,6 +1248,55 @@ void log_action(const char *action)
     log_api(sig_index_action(), 1, 0, 0, NULL, action);
 }
 
+// Bytes of the monitor image that are private to this process, i.e., the
+// pages of its writable sections that have been written to.
+static uint32_t _image_private()
+{
+    MEMORY_BASIC_INFORMATION_CROSS mbi; uint32_t ret = 0;
+
+    for (uintptr_t addr = g_monitor_start; addr < g_monitor_end;
+            addr = (uintptr_t) mbi.BaseAddress + mbi.RegionSize) {
+        if(virtual_query((const void *) addr, &mbi) == FALSE ||
+                mbi.RegionSize == 0) {
+            break;
+        }
+
+        if(mbi.State == MEM_COMMIT && (mbi.Protect == PAGE_READWRITE ||
+                mbi.Protect == PAGE_EXECUTE_READWRITE)) {
+            ret += mbi.RegionSize;
+        }
+    }
+    return ret;
+}
+
+void log_memory()
+{
+    mem_stats_t st; char size[16];
+    mem_stats(&st);
+
+    bson allocs;
+    bson_init(&allocs);
+    bson_append_start_object(&allocs, "allocations");
+    for (uint32_t idx = 0; idx < MEM_POOL_CLASSES; idx++) {
+        ultostr(MEM_POOL_MINSIZE << idx, size, 10);
+        bson_append_int(&allocs, size, st.allocs[idx]);
+    }
+    bson_append_finish_object(&allocs);
+    bson_finish(&allocs);
+
+    // The amount of live bytes may be off briefly as the statistics of
+    // each thread are gathered separately.
+    if((int32_t) st.live < 0) {
+        st.live = 0;
+    }
+
+    log_api(sig_index_memory(), 1, 0, 0, NULL, st.live, st.peak,
+        st.syscalls, st.reserved, st.committed, st.direct, st.slab_pages,
+        unicode_buffer_count(), _image_private(), &allocs);
+
+    bson_destroy(&allocs);
+}
+
 void WINAPI log_guardrw(uintptr_t addr)
 {
     if(exploit_is_registered_guard_page(addr) == 0) {
@@ -814,19 +1311,20 @@ void WINAPI log_guardrw(uintptr_t addr)
     }
 }
 
+// Within hook handlers BSON objects are built in the scratch arena.
 static void *_bson_malloc(size_t length)
 {
-    return mem_alloc(length);
+    return scratch_alloc(length);
 }
 
 static void *_bson_realloc(void *ptr, size_t length)
 {
-    return mem_realloc(ptr, length);
+    return scratch_realloc(ptr, length);
 }
 
 static void _bson_free(void *ptr)
 {
-    mem_free(ptr);
+    scratch_free(ptr);
 }
 
 #if DEBUG
@@ -855,13 +1353,30 @@ void WINAPI log_missing_hook(const char *funcname)
     // }
 }
 
-void log_init(const char *pipe_name, int track)
+void log_init(const char *pipe_name, int track, uint32_t batch_size,
+    uint32_t flush_interval)
 {
     InitializeCriticalSection(&g_mutex);
+    InitializeCriticalSection(&g_ring_mutex);
+    g_memory_tick = get_tick_count();
+    g_lock_index = teb_slot_alloc();
 
     bson_set_heap_stuff(&_bson_malloc, &_bson_realloc, &_bson_free);
     g_api_init = virtual_alloc_rw(NULL, sig_count() * sizeof(uint8_t));
 
+    if(batch_size != 0) {
+        g_batch_size = MIN(batch_size, LOG_BATCH_MAXSIZE);
+        if(g_batch_size < LOG_BATCH_MINSIZE) {
+            g_batch_size = LOG_BATCH_MINSIZE;
+        }
+    }
+    if(flush_interval != 0) {
+        g_flush_interval = MIN(flush_interval, LOG_FLUSH_MAXINTERVAL);
+    }
+
+    g_wakeup_size = MIN(g_batch_size, LOG_RING_SIZE / 2);
+    g_batch = virtual_alloc_rw(NULL, g_batch_size);
+
 #if DEBUG
     char filepath[MAX_PATH];
     our_snprintf(filepath, MAX_PATH, "C:\\monitor-debug-%d.txt",
@@ -878,4 +1393,15 @@ void log_init(const char *pipe_name, int track)
 
     log_raw(header, strlen(header));
     log_new_process(track);
+
+    // If any of this fails, then records are simply written right away.
+    g_ring_index = teb_slot_alloc();
+    g_flush_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(g_ring_index != TLS_OUT_OF_INDEXES && g_flush_event != NULL &&
+            g_batch != NULL) {
+        g_log_async = 1;
+        if(CreateThread(NULL, 0, &_log_flush_thread, NULL, 0, NULL) == NULL) {
+            g_log_async = 0;
+        }
+    }
 }
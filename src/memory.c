@@ -19,12 +19,45 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdint.h>
 #include <windows.h>
+#include "hash.h"
 #include "memory.h"
+#include "misc.h"
 #include "native.h"
 #include "pipe.h"
 
 static SYSTEM_INFO g_si;
 
+static mem_stats_t g_stats;
+
+// Interior and leaf nodes of all thread-indexed tables.
+static slab_t g_table_nodes;
+
+// Each allocation is preceded by this header. The length is always found
+// right before the returned pointer. While a pooled block is not in use,
+// its owner field links it into a free list.
+typedef struct _mem_header_t {
+    void *owner;
+    uintptr_t length;
+} mem_header_t;
+
+static void _stats_add(volatile uint32_t *counter, int32_t value)
+{
+    InterlockedExchangeAdd((volatile LONG *) counter, value);
+}
+
+static void _stats_peak()
+{
+    LONG live = g_stats.live, peak = g_stats.peak;
+    while (live > peak) {
+        LONG prev = InterlockedCompareExchange(
+            (volatile LONG *) &g_stats.peak, live, peak);
+        if(prev == peak) {
+            break;
+        }
+        peak = prev;
+    }
+}
+
 uintptr_t roundup2(uintptr_t value)
 {
     value--;
@@ -36,54 +69,953 @@ uintptr_t roundup2(uintptr_t value)
 #if __x86_64__
     value |= value >> 32;
 #endif
-    return ++value;
+    return ++value;
+}
+
+uintptr_t mem_suggested_size(uintptr_t size)
+{
+    size = roundup2(size);
+
+    // Go for at least one page.
+    if(size < g_si.dwPageSize) {
+        size = g_si.dwPageSize;
+    }
+
+    return size - sizeof(mem_header_t);
+}
+
+#if __x86_64__
+#define TEB_TLSSLOTS 0x1480
+#else
+#define TEB_TLSSLOTS 0xe10
+#endif
+
+// Only slots that live in the TEB itself are used, so that per-thread
+// state can be found without calling TlsGetValue().
+uint32_t teb_slot_alloc()
+{
+    uint32_t index = TlsAlloc();
+    if(index < TLS_MINIMUM_AVAILABLE) {
+        return index;
+    }
+
+    if(index != TLS_OUT_OF_INDEXES) {
+        TlsFree(index);
+    }
+    return TLS_OUT_OF_INDEXES;
+}
+
+void **teb_slot(uint32_t index)
+{
+    return (void **)(readtls(TLS_TEB) + TEB_TLSSLOTS) + index;
+}
+
+uint32_t teb_slot_offset(uint32_t index)
+{
+    return TEB_TLSSLOTS + index * sizeof(void *);
+}
+
+static void _spin_lock(volatile LONG *lock)
+{
+    while (InterlockedCompareExchange(lock, 1, 0) != 0) {
+        while (*lock != 0) {
+            YieldProcessor();
+        }
+    }
+}
+
+static void _spin_unlock(volatile LONG *lock)
+{
+    InterlockedExchange(lock, 0);
+}
+
+void mem_stats(mem_stats_t *stats)
+{
+    memcpy(stats, &g_stats, sizeof(mem_stats_t));
+}
+
+#if DEBUG_HEAPCORRUPTION
+
+static void _stats_event(int index, int32_t live)
+{
+    (void) index;
+
+    _stats_add(&g_stats.live, live);
+    _stats_peak();
+}
+
+void mem_init()
+{
+    GetSystemInfo(&g_si);
+
+    slab_init(&g_table_nodes, TABLE_FANOUT * sizeof(void *),
+        TABLE_NODECOUNT, PAGE_READWRITE);
+}
+
+void mem_cache_release()
+{
+}
+
+void scratch_open(scratch_t *scratch)
+{
+    scratch->arena = NULL;
+}
+
+void scratch_close(scratch_t *scratch)
+{
+    (void) scratch;
+}
+
+void *scratch_get(uint32_t length)
+{
+    (void) length;
+    return NULL;
+}
+
+int scratch_contains(const void *ptr)
+{
+    (void) ptr;
+    return 0;
+}
+
+void *scratch_realloc(void *ptr, uint32_t length)
+{
+    return mem_realloc(ptr, length);
+}
+
+void scratch_free(void *ptr)
+{
+    mem_free(ptr);
+}
+
+void scratch_release()
+{
+}
+
+static void _cache_reclaim()
+{
+}
+
+static void _scratch_reclaim()
+{
+}
+
+#else
+
+// Size-class pool. Each class hands out blocks of a power of two bytes
+// (including the header) which are carved out of chunks that are
+// committed on-demand from large reserved regions. Freed blocks are kept
+// on a per-class free list and are never returned to the system.
+typedef struct _mem_pool_t {
+    volatile LONG lock;
+    mem_header_t *freelist;
+    uint8_t *ptr;
+    uint8_t *end;
+} mem_pool_t;
+
+static mem_pool_t g_pools[MEM_POOL_CLASSES];
+
+static volatile LONG g_region_lock;
+static uint8_t *g_region_ptr, *g_region_end;
+
+// Per-thread cache of free blocks for the smaller size classes, found
+// through a TLS slot in the TEB. Allocated blocks are owned by the cache
+// of the thread that allocated them. Blocks freed by another thread are
+// pushed onto the remote list of their owner without taking a lock and
+// are collected by the owning thread during its next allocation. The
+// owner is the thread identifier of the owning thread, or zero.
+typedef struct _mem_cache_t {
+    mem_header_t *volatile remote;
+    volatile LONG remote_count;
+    volatile LONG released;
+    volatile LONG owner;
+    struct _mem_cache_t *next;
+    struct _mem_cache_t *next_free;
+    uint32_t count[MEM_CACHE_CLASSES];
+    mem_header_t *blocks[MEM_CACHE_CLASSES][MEM_CACHE_DEPTH];
+
+    // Statistics that have not been added to the global counters yet.
+    int32_t live;
+    uint32_t events;
+    uint32_t allocs[MEM_POOL_CLASSES];
+} mem_cache_t;
+
+// Statistics are gathered per thread and added to the global counters
+// every MEM_STATS_BATCH allocations and deallocations.
+#define MEM_STATS_BATCH 64
+
+// Maximum amount of blocks that may be waiting on a remote list.
+#define MEM_CACHE_REMOTEMAX (4 * MEM_CACHE_DEPTH)
+
+static uint32_t g_cache_index = TLS_OUT_OF_INDEXES;
+
+// All caches, and the caches of threads that have exited, ready to be
+// taken over.
+static mem_cache_t *volatile g_caches;
+static volatile LONG g_cache_lock;
+static mem_cache_t *g_cache_freelist;
+
+// Per-thread scratch arena. The arena header lives at the start of a
+// reserved range of SCRATCH_RESERVE bytes, the remainder is committed as
+// the arena grows. Each allocation is preceded by its length. The owner is
+// the thread identifier of the owning thread, or zero.
+typedef struct _scratch_arena_t {
+    uint8_t *ptr;
+    uint8_t *committed;
+    uint32_t depth;
+    volatile LONG owner;
+    struct _scratch_arena_t *next;
+    struct _scratch_arena_t *next_free;
+} scratch_arena_t;
+
+#define SCRATCH_RESERVE 0x100000
+#define SCRATCH_COMMITSIZE 0x10000
+#define SCRATCH_HEADER MEM_ALIGNMENT
+
+static uint32_t g_scratch_index = TLS_OUT_OF_INDEXES;
+
+// All arenas, and the arenas of threads that have exited, ready to be
+// taken over.
+static scratch_arena_t *volatile g_scratch_arenas;
+static volatile LONG g_scratch_lock;
+static scratch_arena_t *g_scratch_freelist;
+
+void mem_init()
+{
+    GetSystemInfo(&g_si);
+
+    g_cache_index = teb_slot_alloc();
+    g_scratch_index = teb_slot_alloc();
+
+    slab_init(&g_table_nodes, TABLE_FANOUT * sizeof(void *),
+        TABLE_NODECOUNT, PAGE_READWRITE);
+}
+
+// Returns the size class for an allocation of real_length bytes, including
+// its header, or -1 if it's too big for the pool.
+static int _pool_index(uintptr_t real_length)
+{
+    if(real_length > MEM_POOL_MAXSIZE) {
+        return -1;
+    }
+
+    int index = 0;
+    for (real_length = (real_length - 1) >> MEM_POOL_MINSHIFT;
+            real_length != 0; real_length >>= 1) {
+        index++;
+    }
+    return index;
+}
+
+// Commits a new chunk from the current region, reserving a new region
+// when the current one has been used up.
+static uint8_t *_pool_chunk()
+{
+    _spin_lock(&g_region_lock);
+
+    if(g_region_ptr == g_region_end) {
+        g_region_ptr = virtual_alloc(NULL, MEM_POOL_REGIONSIZE,
+            MEM_RESERVE, PAGE_READWRITE);
+        _stats_add(&g_stats.syscalls, 1);
+        if(g_region_ptr == NULL) {
+            g_region_end = NULL;
+            _spin_unlock(&g_region_lock);
+            return NULL;
+        }
+
+        g_region_end = g_region_ptr + MEM_POOL_REGIONSIZE;
+        _stats_add(&g_stats.reserved, MEM_POOL_REGIONSIZE);
+    }
+
+    uint8_t *ret = virtual_alloc(g_region_ptr, MEM_POOL_CHUNKSIZE,
+        MEM_COMMIT, PAGE_READWRITE);
+    _stats_add(&g_stats.syscalls, 1);
+    if(ret != NULL) {
+        g_region_ptr += MEM_POOL_CHUNKSIZE;
+        _stats_add(&g_stats.committed, MEM_POOL_CHUNKSIZE);
+    }
+
+    _spin_unlock(&g_region_lock);
+    return ret;
+}
+
+// Takes a block from the pool, which must be locked by the caller.
+static mem_header_t *_pool_take(mem_pool_t *pool, int index)
+{
+    mem_header_t *ret = pool->freelist;
+    if(ret != NULL) {
+        pool->freelist = ret->owner;
+        return ret;
+    }
+
+    if(pool->ptr == pool->end) {
+        pool->ptr = _pool_chunk();
+        if(pool->ptr == NULL) {
+            pool->end = NULL;
+            pipe("CRITICAL:Error allocating memory for pool!");
+            return NULL;
+        }
+
+        pool->end = pool->ptr + MEM_POOL_CHUNKSIZE;
+    }
+
+    ret = (mem_header_t *) pool->ptr;
+    pool->ptr += MEM_POOL_MINSIZE << index;
+    return ret;
+}
+
+static mem_header_t *_pool_alloc(int index)
+{
+    mem_pool_t *pool = &g_pools[index];
+
+    _spin_lock(&pool->lock);
+    mem_header_t *ret = _pool_take(pool, index);
+    _spin_unlock(&pool->lock);
+    return ret;
+}
+
+static void _pool_free(int index, mem_header_t *hdr)
+{
+    mem_pool_t *pool = &g_pools[index];
+
+    _spin_lock(&pool->lock);
+    hdr->owner = pool->freelist;
+    pool->freelist = hdr;
+    _spin_unlock(&pool->lock);
+}
+
+// Moves up to half a magazine of blocks from the pool into the cache.
+static void _cache_refill(mem_cache_t *cache, int index)
+{
+    mem_pool_t *pool = &g_pools[index];
+    mem_header_t *hdr;
+
+    _spin_lock(&pool->lock);
+    while (cache->count[index] < MEM_CACHE_DEPTH / 2 &&
+            (hdr = _pool_take(pool, index)) != NULL) {
+        cache->blocks[index][cache->count[index]++] = hdr;
+    }
+    _spin_unlock(&pool->lock);
+}
+
+// Moves count blocks from the cache back into the pool.
+static void _cache_flush(mem_cache_t *cache, int index, uint32_t count)
+{
+    mem_pool_t *pool = &g_pools[index];
+
+    _spin_lock(&pool->lock);
+    while (count-- != 0) {
+        mem_header_t *hdr = cache->blocks[index][--cache->count[index]];
+        hdr->owner = pool->freelist;
+        pool->freelist = hdr;
+    }
+    _spin_unlock(&pool->lock);
+}
+
+static void _cache_put(mem_cache_t *cache, int index, mem_header_t *hdr)
+{
+    if(cache->count[index] == MEM_CACHE_DEPTH) {
+        _cache_flush(cache, index, MEM_CACHE_DEPTH / 2);
+    }
+
+    cache->blocks[index][cache->count[index]++] = hdr;
+}
+
+// Collects the blocks that other threads have freed on our behalf. This
+// is checked on every allocation so that the remote list remains short.
+static void _cache_collect(mem_cache_t *cache)
+{
+    if(cache->remote == NULL) {
+        return;
+    }
+
+    mem_header_t *hdr = (mem_header_t *)
+        InterlockedExchangePointer((void *volatile *) &cache->remote, NULL);
+
+    int32_t count = 0;
+    while (hdr != NULL) {
+        mem_header_t *next = hdr->owner;
+        _cache_put(cache,
+            _pool_index(hdr->length + sizeof(mem_header_t)), hdr);
+        hdr = next, count++;
+    }
+
+    InterlockedExchangeAdd(&cache->remote_count, -count);
+}
+
+// Hands a block back to the thread that owns it. If that thread has not
+// been around to collect its blocks for a while, the block goes back to
+// the pool instead so that the remote list remains bounded.
+static void _cache_push_remote(mem_cache_t *cache, int index,
+    mem_header_t *hdr)
+{
+    if(InterlockedIncrement(&cache->remote_count) > MEM_CACHE_REMOTEMAX) {
+        InterlockedDecrement(&cache->remote_count);
+        _pool_free(index, hdr);
+        return;
+    }
+
+    mem_header_t *head;
+    do {
+        head = cache->remote;
+        hdr->owner = head;
+    } while (InterlockedCompareExchangePointer(
+        (void *volatile *) &cache->remote, hdr, head) != head);
+}
+
+static mem_cache_t *_cache_get()
+{
+    if(g_cache_index == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+    return (mem_cache_t *) *teb_slot(g_cache_index);
+}
+
+static void _cache_set(mem_cache_t *cache)
+{
+    *teb_slot(g_cache_index) = cache;
+}
+
+// Returns the cache of the current thread, taking over the cache of an
+// exited thread or allocating a new one if required.
+static mem_cache_t *_cache_current()
+{
+    mem_cache_t *cache = _cache_get();
+    if(cache != NULL || g_cache_index == TLS_OUT_OF_INDEXES) {
+        return cache;
+    }
+
+    _spin_lock(&g_cache_lock);
+    cache = g_cache_freelist;
+    if(cache != NULL) {
+        g_cache_freelist = cache->next_free;
+        InterlockedExchange(&cache->released, 0);
+    }
+    _spin_unlock(&g_cache_lock);
+
+    if(cache == NULL) {
+        cache = (mem_cache_t *) _pool_alloc(_pool_index(sizeof(mem_cache_t)));
+        if(cache == NULL) {
+            return NULL;
+        }
+
+        memset(cache, 0, sizeof(mem_cache_t));
+
+        do {
+            cache->next = g_caches;
+        } while (InterlockedCompareExchangePointer(
+            (void *volatile *) &g_caches, cache, cache->next) != cache->next);
+    }
+
+    // The TEB slot is set before the owner, see _cache_reclaim().
+    _cache_set(cache);
+    InterlockedExchange(&cache->owner, get_current_thread_id());
+    return cache;
+}
+
+static void _stats_flush(mem_cache_t *cache)
+{
+    for (int index = 0; index < MEM_POOL_CLASSES; index++) {
+        if(cache->allocs[index] != 0) {
+            _stats_add(&g_stats.allocs[index], cache->allocs[index]);
+            cache->allocs[index] = 0;
+        }
+    }
+
+    _stats_add(&g_stats.live, cache->live);
+    _stats_peak();
+
+    cache->live = 0;
+    cache->events = 0;
+}
+
+// Accounts for an allocation from size class index (if any) and for a
+// change in live bytes.
+static void _stats_event(int index, int32_t live)
+{
+    mem_cache_t *cache = _cache_get();
+    if(cache == NULL) {
+        if(index >= 0) {
+            _stats_add(&g_stats.allocs[index], 1);
+        }
+        _stats_add(&g_stats.live, live);
+        _stats_peak();
+        return;
+    }
+
+    if(index >= 0) {
+        cache->allocs[index]++;
+    }
+
+    cache->live += live;
+    if(++cache->events == MEM_STATS_BATCH) {
+        _stats_flush(cache);
+    }
+}
+
+// Hands a cache over to the next thread. The caller has claimed the cache
+// by resetting its owner.
+static void _cache_release(mem_cache_t *cache)
+{
+    _stats_flush(cache);
+
+    InterlockedExchange(&cache->released, 1);
+    _cache_collect(cache);
+
+    for (int index = 0; index < MEM_CACHE_CLASSES; index++) {
+        _cache_flush(cache, index, cache->count[index]);
+    }
+
+    // Blocks owned by this cache are now returned to the pool directly by
+    // other threads. Any remote frees that race with the release are
+    // collected by the next thread that takes over this cache.
+    _spin_lock(&g_cache_lock);
+    cache->next_free = g_cache_freelist;
+    g_cache_freelist = cache;
+    _spin_unlock(&g_cache_lock);
+}
+
+void mem_cache_release()
+{
+    mem_cache_t *cache = _cache_get();
+    if(cache == NULL || InterlockedExchange(&cache->owner, 0) == 0) {
+        return;
+    }
+
+    _cache_set(NULL);
+    _cache_release(cache);
+}
+
+// Releases the caches of threads that have exited without releasing them,
+// e.g., threads that were terminated by another thread. Whoever resets the
+// owner first, this or the owning thread itself, releases the cache.
+static void _cache_reclaim()
+{
+    for (mem_cache_t *cache = g_caches; cache != NULL; cache = cache->next) {
+        LONG owner = cache->owner;
+        if(owner != 0 && teb_slot_owner_alive(owner, g_cache_index,
+                    (uintptr_t) cache) == 0 &&
+                InterlockedCompareExchange(&cache->owner,
+                    0, owner) == owner) {
+            _cache_release(cache);
+        }
+    }
+}
+
+static mem_header_t *_block_alloc(int index)
+{
+    mem_cache_t *cache;
+    mem_header_t *hdr;
+
+    if(index < MEM_CACHE_CLASSES && (cache = _cache_current()) != NULL) {
+        _cache_collect(cache);
+        if(cache->count[index] == 0) {
+            _cache_refill(cache, index);
+        }
+        if(cache->count[index] == 0) {
+            return NULL;
+        }
+
+        hdr = cache->blocks[index][--cache->count[index]];
+        hdr->owner = cache;
+        return hdr;
+    }
+
+    hdr = _pool_alloc(index);
+    if(hdr != NULL) {
+        hdr->owner = NULL;
+    }
+    return hdr;
+}
+
+static void _block_free(int index, mem_header_t *hdr)
+{
+    mem_cache_t *owner = (mem_cache_t *) hdr->owner;
+    if(owner == NULL || owner->released != 0) {
+        _pool_free(index, hdr);
+        return;
+    }
+
+    if(owner == _cache_get()) {
+        _cache_put(owner, index, hdr);
+        return;
+    }
+
+    _cache_push_remote(owner, index, hdr);
+}
+
+static scratch_arena_t *_scratch_get()
+{
+    if(g_scratch_index == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+    return (scratch_arena_t *) *teb_slot(g_scratch_index);
+}
+
+static uint8_t *_scratch_base(scratch_arena_t *arena)
+{
+    return (uint8_t *) arena +
+        ((sizeof(scratch_arena_t) + MEM_ALIGNMENT-1) & ~(MEM_ALIGNMENT-1));
+}
+
+// Returns the arena of the current thread, taking over the arena of an
+// exited thread or reserving a new one if required.
+static scratch_arena_t *_scratch_current()
+{
+    scratch_arena_t *arena = _scratch_get();
+    if(arena != NULL || g_scratch_index == TLS_OUT_OF_INDEXES) {
+        return arena;
+    }
+
+    _spin_lock(&g_scratch_lock);
+    arena = g_scratch_freelist;
+    if(arena != NULL) {
+        g_scratch_freelist = arena->next_free;
+    }
+    _spin_unlock(&g_scratch_lock);
+
+    if(arena == NULL) {
+        arena = virtual_alloc(NULL, SCRATCH_RESERVE,
+            MEM_RESERVE, PAGE_READWRITE);
+        _stats_add(&g_stats.syscalls, 1);
+        if(arena == NULL) {
+            return NULL;
+        }
+
+        if(virtual_alloc(arena, SCRATCH_COMMITSIZE,
+                MEM_COMMIT, PAGE_READWRITE) == NULL) {
+            virtual_free(arena, 0, MEM_RELEASE);
+            _stats_add(&g_stats.syscalls, 2);
+            return NULL;
+        }
+
+        _stats_add(&g_stats.syscalls, 1);
+        arena->committed = (uint8_t *) arena + SCRATCH_COMMITSIZE;
+
+        do {
+            arena->next = g_scratch_arenas;
+        } while (InterlockedCompareExchangePointer(
+            (void *volatile *) &g_scratch_arenas,
+            arena, arena->next) != arena->next);
+    }
+
+    arena->ptr = _scratch_base(arena);
+    arena->depth = 0;
+
+    // The TEB slot is set before the owner, see _scratch_reclaim().
+    *teb_slot(g_scratch_index) = arena;
+    InterlockedExchange(&arena->owner, get_current_thread_id());
+    return arena;
+}
+
+// Makes sure the arena is committed up to the given address.
+static int _scratch_ensure(scratch_arena_t *arena, uint8_t *end)
+{
+    if(end <= arena->committed) {
+        return 0;
+    }
+
+    if(end > (uint8_t *) arena + SCRATCH_RESERVE) {
+        return -1;
+    }
+
+    uintptr_t length = (end - arena->committed + SCRATCH_COMMITSIZE-1) &
+        ~(SCRATCH_COMMITSIZE-1);
+
+    _stats_add(&g_stats.syscalls, 1);
+    if(virtual_alloc(arena->committed, length,
+            MEM_COMMIT, PAGE_READWRITE) == NULL) {
+        return -1;
+    }
+
+    arena->committed += length;
+    return 0;
+}
+
+static uintptr_t _scratch_size(uintptr_t length)
+{
+    return (length + MEM_ALIGNMENT-1) & ~(MEM_ALIGNMENT-1);
+}
+
+void scratch_open(scratch_t *scratch)
+{
+    scratch_arena_t *arena = _scratch_current();
+
+    scratch->arena = arena;
+    if(arena != NULL) {
+        scratch->ptr = arena->ptr;
+        scratch->depth = arena->depth++;
+    }
+}
+
+void scratch_close(scratch_t *scratch)
+{
+    scratch_arena_t *arena = (scratch_arena_t *) scratch->arena;
+
+    // Restoring the depth, rather than decrementing it, also takes care of
+    // nested scopes that were left through copy_return().
+    if(arena != NULL && arena == _scratch_get()) {
+        arena->ptr = scratch->ptr;
+        arena->depth = scratch->depth;
+    }
+}
+
+void *scratch_get(uint32_t length)
+{
+    scratch_arena_t *arena = _scratch_get();
+    if(length == 0 || arena == NULL || arena->depth == 0) {
+        return NULL;
+    }
+
+    uint8_t *ret = arena->ptr + SCRATCH_HEADER;
+    if(_scratch_ensure(arena, ret + _scratch_size(length)) < 0) {
+        return NULL;
+    }
+
+    *((uintptr_t *) ret - 1) = length;
+    arena->ptr = ret + _scratch_size(length);
+    return ret;
+}
+
+int scratch_contains(const void *ptr)
+{
+    scratch_arena_t *arena = _scratch_get();
+    return arena != NULL && (const uint8_t *) ptr >= _scratch_base(arena) &&
+        (const uint8_t *) ptr < (uint8_t *) arena + SCRATCH_RESERVE;
+}
+
+void *scratch_realloc(void *ptr, uint32_t length)
+{
+    if(ptr == NULL) {
+        return scratch_alloc(length);
+    }
+
+    if(scratch_contains(ptr) == 0) {
+        return mem_realloc(ptr, length);
+    }
+
+    scratch_arena_t *arena = _scratch_get();
+    uintptr_t oldlength = *((uintptr_t *) ptr - 1);
+
+    // The most recent allocation is resized in-place.
+    if((uint8_t *) ptr + _scratch_size(oldlength) == arena->ptr &&
+            _scratch_ensure(arena,
+                (uint8_t *) ptr + _scratch_size(length)) == 0) {
+        *((uintptr_t *) ptr - 1) = length;
+        arena->ptr = (uint8_t *) ptr + _scratch_size(length);
+        return ptr;
+    }
+
+    // Big buffers move out of the arena and continue as growable buffers.
+    void *ret = length > MEM_POOL_MAXSIZE ?
+        mem_realloc(NULL, length) : scratch_alloc(length);
+    if(ret != NULL) {
+        memcpy(ret, ptr, min(length, oldlength));
+    }
+    return ret;
+}
+
+void scratch_free(void *ptr)
+{
+    if(ptr == NULL) {
+        return;
+    }
+
+    if(scratch_contains(ptr) == 0) {
+        mem_free(ptr);
+        return;
+    }
+
+    // Only the most recent allocation is actually handed back, everything
+    // else is released when the scope is closed.
+    scratch_arena_t *arena = _scratch_get();
+    uintptr_t length = *((uintptr_t *) ptr - 1);
+    if((uint8_t *) ptr + _scratch_size(length) == arena->ptr) {
+        arena->ptr = (uint8_t *) ptr - SCRATCH_HEADER;
+    }
+}
+
+// Hands an arena over to the next thread. The caller has claimed the arena
+// by resetting its owner.
+static void _scratch_release(scratch_arena_t *arena)
+{
+    _spin_lock(&g_scratch_lock);
+    arena->next_free = g_scratch_freelist;
+    g_scratch_freelist = arena;
+    _spin_unlock(&g_scratch_lock);
+}
+
+void scratch_release()
+{
+    scratch_arena_t *arena = _scratch_get();
+    if(arena == NULL || InterlockedExchange(&arena->owner, 0) == 0) {
+        return;
+    }
+
+    *teb_slot(g_scratch_index) = NULL;
+    _scratch_release(arena);
+}
+
+// Releases the arenas of threads that have exited without releasing them,
+// see _cache_reclaim().
+static void _scratch_reclaim()
+{
+    for (scratch_arena_t *arena = g_scratch_arenas; arena != NULL;
+            arena = arena->next) {
+        LONG owner = arena->owner;
+        if(owner != 0 && teb_slot_owner_alive(owner, g_scratch_index,
+                    (uintptr_t) arena) == 0 &&
+                InterlockedCompareExchange(&arena->owner,
+                    0, owner) == owner) {
+            _scratch_release(arena);
+        }
+    }
+}
+
+#endif
+
+void *scratch_alloc(uint32_t length)
+{
+    void *ret = scratch_get(length);
+    if(ret == NULL) {
+        ret = mem_alloc(length);
+    }
+    return ret;
 }
 
-uintptr_t mem_suggested_size(uintptr_t size)
+#if DEBUG_HEAPCORRUPTION
+
+static mem_header_t *_direct_alloc(uintptr_t real_length, uintptr_t reserve)
 {
-    size = roundup2(size);
+    (void) reserve;
 
-    // Go for at least one page.
-    if(size < g_si.dwPageSize) {
-        size = g_si.dwPageSize;
+    _stats_add(&g_stats.syscalls, 1);
+    _stats_add(&g_stats.direct, 1);
+    return virtual_alloc(NULL, real_length,
+        MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+}
+
+#else
+
+static uintptr_t _page_round(uintptr_t length)
+{
+    return (length + g_si.dwPageSize - 1) & ~(uintptr_t)(g_si.dwPageSize - 1);
+}
+
+// Blocks that are too big for the pool are growable buffers. Of the
+// reserved address space, of which the size is kept in the owner field,
+// only the pages in use are committed. This way mem_realloc() is able to
+// grow such blocks in-place.
+static mem_header_t *_direct_alloc(uintptr_t real_length, uintptr_t reserve)
+{
+    uintptr_t committed = _page_round(real_length);
+    reserve = _page_round(reserve > real_length ? reserve : real_length);
+
+    uint8_t *mem = virtual_alloc(NULL, reserve,
+        reserve == committed ? MEM_RESERVE|MEM_COMMIT : MEM_RESERVE,
+        PAGE_READWRITE);
+    _stats_add(&g_stats.syscalls, 1);
+    if(mem == NULL) {
+        return NULL;
     }
 
-    return size - sizeof(uintptr_t);
+    if(reserve != committed) {
+        _stats_add(&g_stats.syscalls, 1);
+        if(virtual_alloc(mem, committed, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+            virtual_free(mem, 0, MEM_RELEASE);
+            _stats_add(&g_stats.syscalls, 1);
+            return NULL;
+        }
+    }
+
+    _stats_add(&g_stats.direct, 1);
+
+    mem_header_t *hdr = (mem_header_t *) mem;
+    hdr->owner = (void *) reserve;
+    return hdr;
 }
 
-void mem_init()
+// Resizes a growable buffer within its reserved address space.
+static int _direct_resize(mem_header_t *hdr, uint32_t length)
 {
-    GetSystemInfo(&g_si);
+    uintptr_t real_length = length + sizeof(mem_header_t);
+    if(real_length > (uintptr_t) hdr->owner) {
+        return -1;
+    }
+
+    // Pages that are committed already are committed once again after
+    // the buffer has shrunk, which is harmless.
+    uintptr_t committed = _page_round(hdr->length + sizeof(mem_header_t));
+    if(_page_round(real_length) > committed) {
+        _stats_add(&g_stats.syscalls, 1);
+        if(virtual_alloc((uint8_t *) hdr + committed,
+                _page_round(real_length) - committed,
+                MEM_COMMIT, PAGE_READWRITE) == NULL) {
+            return -1;
+        }
+    }
+
+    if(length > hdr->length) {
+        memset((uint8_t *)(hdr + 1) + hdr->length, 0, length - hdr->length);
+    }
+
+    hdr->length = length;
+    return 0;
 }
 
-void *mem_alloc(uint32_t length)
+#endif
+
+static void *_mem_alloc(uint32_t length, uintptr_t reserve)
 {
     if(length == 0) {
         return NULL;
     }
 
-    uint32_t real_length = length + sizeof(uintptr_t);
+    uint32_t real_length = length + sizeof(mem_header_t);
 
 #if DEBUG_HEAPCORRUPTION
     real_length = (real_length + 0x1fff) / 0x1000 * 0x1000;
+    mem_header_t *hdr = _direct_alloc(real_length, reserve);
+#else
+    int index = _pool_index(real_length);
+    mem_header_t *hdr = index >= 0 ?
+        _block_alloc(index) : _direct_alloc(real_length, reserve);
 #endif
 
-    void *ptr = virtual_alloc(NULL, real_length,
-        MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
-    if(ptr == NULL) {
+    if(hdr == NULL) {
         return NULL;
     }
 
+    // Direct allocations are freshly committed pages, which are zeroed
+    // already, so they're only touched once they're used.
+#if !DEBUG_HEAPCORRUPTION
+    if(index >= 0) {
+        memset(hdr + 1, 0, length);
+    }
+#endif
+
 #if DEBUG_HEAPCORRUPTION
     // gflags.exe-like heap corruption functionality.
+    uint8_t *ptr = (uint8_t *) hdr;
     virtual_protect(ptr + real_length - 0x1000, 0x1000, PAGE_READONLY);
-    ptr += real_length - 0x1000 - length - sizeof(uintptr_t);
+    hdr = (mem_header_t *)
+        (ptr + real_length - 0x1000 - length - sizeof(mem_header_t));
+    hdr->owner = NULL;
 #endif
 
-    memset(ptr, 0, length + sizeof(uintptr_t));
+#if DEBUG_HEAPCORRUPTION
+    _stats_event(-1, length);
+#else
+    _stats_event(index, length);
+#endif
+
+    hdr->length = length;
+    return hdr + 1;
+}
 
-    *(uintptr_t *) ptr = length;
-    return (uintptr_t *) ptr + 1;
+void *mem_alloc(uint32_t length)
+{
+    return _mem_alloc(length, 0);
 }
 
 void *mem_alloc_aligned(uint32_t length)
@@ -94,13 +1026,58 @@ void *mem_alloc_aligned(uint32_t length)
 
 void *mem_realloc(void *ptr, uint32_t length)
 {
-    void *newptr = mem_alloc(length);
+#if !DEBUG_HEAPCORRUPTION
+    if(ptr != NULL && length != 0) {
+        mem_header_t *hdr = (mem_header_t *) ptr - 1;
+        int index = _pool_index(hdr->length + sizeof(mem_header_t));
+        int newindex = _pool_index(length + sizeof(mem_header_t));
+
+        // Blocks that remain within the same size class are resized
+        // in-place, as are growable buffers that remain growable buffers.
+        int32_t delta = (int32_t)(length - hdr->length);
+
+        if(index >= 0 && index == newindex) {
+            if(length > hdr->length) {
+                memset((uint8_t *) ptr + hdr->length, 0, length - hdr->length);
+            }
+
+            _stats_event(-1, delta);
+            hdr->length = length;
+            return ptr;
+        }
+
+        if(index < 0 && newindex < 0 && _direct_resize(hdr, length) == 0) {
+            _stats_event(-1, delta);
+            return ptr;
+        }
+    }
+#endif
+
+    // A buffer that is being grown beyond the pool is likely to grow even
+    // further, so reserve room for it. New buffers only reserve what they
+    // need, as they may well never grow.
+    uintptr_t reserve = length + sizeof(mem_header_t);
+    if(ptr != NULL && length > ((mem_header_t *) ptr - 1)->length) {
+        uintptr_t extra = reserve * (MEM_GROW_FACTOR - 1);
+        if(extra > MEM_GROW_LIMIT) {
+            extra = MEM_GROW_LIMIT;
+        }
+
+        if(reserve + extra < MEM_GROW_RESERVE) {
+            reserve = MEM_GROW_RESERVE;
+        }
+        else if(reserve + extra > reserve) {
+            reserve += extra;
+        }
+    }
+
+    void *newptr = _mem_alloc(length, reserve);
     if(newptr == NULL) {
         return NULL;
     }
 
     if(ptr != NULL) {
-        uintptr_t oldlength = *((uintptr_t *) ptr - 1);
+        uintptr_t oldlength = ((mem_header_t *) ptr - 1)->length;
         memcpy(newptr, ptr, min(length, oldlength));
         mem_free(ptr);
     }
@@ -110,9 +1087,23 @@ void *mem_realloc(void *ptr, uint32_t length)
 void mem_free(void *ptr)
 {
     if(ptr != NULL) {
-        uintptr_t oldlength = *((uintptr_t *) ptr - 1);
-        virtual_free((uintptr_t *) ptr - 1,
-            oldlength + sizeof(uintptr_t), MEM_RELEASE);
+        mem_header_t *hdr = (mem_header_t *) ptr - 1;
+
+        _stats_event(-1, -(int32_t) hdr->length);
+
+#if DEBUG_HEAPCORRUPTION
+        virtual_free(hdr, hdr->length + sizeof(mem_header_t), MEM_RELEASE);
+#else
+        int index = _pool_index(hdr->length + sizeof(mem_header_t));
+        if(index >= 0) {
+            _block_free(index, hdr);
+            return;
+        }
+
+        virtual_free(hdr, 0, MEM_RELEASE);
+#endif
+        _stats_add(&g_stats.syscalls, 1);
+        _stats_add(&g_stats.direct, -1);
     }
 }
 
@@ -186,6 +1177,121 @@ int array_unset(array_t *array, uintptr_t index)
     return ret;
 }
 
+// Returns the node that slot points to. When create is set, a missing
+// node is allocated and published with a compare-and-swap. The thread
+// that loses the race hands its node back and uses the winning one.
+static void *volatile *_table_node(void *volatile *slot, int create)
+{
+    void *node = *slot;
+    if(node != NULL || create == 0) {
+        return (void *volatile *) node;
+    }
+
+    node = slab_getmem(&g_table_nodes);
+    if(node == NULL) {
+        return NULL;
+    }
+
+    memset(node, 0, TABLE_FANOUT * sizeof(void *));
+
+    void *prev = InterlockedCompareExchangePointer(slot, node, NULL);
+    if(prev != NULL) {
+        slab_free(&g_table_nodes, node);
+        return (void *volatile *) prev;
+    }
+    return (void *volatile *) node;
+}
+
+// Walks down to the leaf slot for index, or returns NULL if the index is
+// out of range or (when not creating) part of the path doesn't exist.
+static void *volatile *_table_slot(table_t *table, uintptr_t index,
+    int create)
+{
+    if(((uint64_t) index >> (TABLE_LEVELS * TABLE_SHIFT)) != 0) {
+        return NULL;
+    }
+
+    void *volatile *slot = &table->root;
+    for (int shift = (TABLE_LEVELS - 1) * TABLE_SHIFT; shift >= 0;
+            shift -= TABLE_SHIFT) {
+        void *volatile *node = _table_node(slot, create);
+        if(node == NULL) {
+            return NULL;
+        }
+
+        slot = &node[(index >> shift) & (TABLE_FANOUT - 1)];
+    }
+    return slot;
+}
+
+void table_init(table_t *table)
+{
+    table->root = NULL;
+}
+
+int table_set(table_t *table, uintptr_t index, void *value)
+{
+    void *volatile *slot = _table_slot(table, index, 1);
+    if(slot == NULL) {
+        return -1;
+    }
+
+    *slot = value;
+    return 0;
+}
+
+void *table_get(table_t *table, uintptr_t index)
+{
+    void *volatile *slot = _table_slot(table, index, 0);
+    return slot != NULL ? *slot : NULL;
+}
+
+void *table_exchange(table_t *table, uintptr_t index, void *value)
+{
+    void *volatile *slot = _table_slot(table, index, value != NULL);
+    if(slot == NULL) {
+        return NULL;
+    }
+    return InterlockedExchangePointer(slot, value);
+}
+
+int table_unset(table_t *table, uintptr_t index)
+{
+    void *volatile *slot = _table_slot(table, index, 0);
+    if(slot == NULL) {
+        return -1;
+    }
+
+    *slot = NULL;
+    return 0;
+}
+
+// Freed objects are linked through their first pointer-sized field.
+typedef struct _slab_object_t {
+    struct _slab_object_t *next;
+} slab_object_t;
+
+// Per-thread cache of free objects for one slab. The owner is the thread
+// identifier of the owning thread, or zero.
+typedef struct _slab_cache_t {
+    volatile LONG owner;
+    slab_t *slab;
+    struct _slab_cache_t *next;
+    struct _slab_cache_t *next_free;
+    uint32_t count;
+    slab_object_t *objects[SLAB_CACHE_DEPTH];
+} slab_cache_t;
+
+// Slabs with per-thread caches, flushed by slab_cache_release().
+static slab_t *g_slab_caches[SLAB_CACHE_SLABS];
+static volatile LONG g_slab_cache_count;
+
+// All caches, and the caches of threads that have exited, ready to be
+// taken over by another thread for any slab.
+static slab_cache_t *volatile g_slab_cachelist;
+static volatile LONG g_slab_cache_lock;
+static slab_cache_t *g_slab_cache_freelist;
+
 static int _slab_ensure(slab_t *slab)
 {
     if(slab->offset == slab->length) {
@@ -196,6 +1302,11 @@ static int _slab_ensure(slab_t *slab)
             return -1;
         }
 
+        _stats_add(&g_stats.syscalls, 1);
+        _stats_add(&g_stats.slab_pages,
+            (slab->size * slab->count + g_si.dwPageSize - 1) /
+            g_si.dwPageSize);
+
         array_set(&slab->array, slab->offset / slab->count, mem);
 
         slab->length += slab->count;
@@ -207,55 +1318,237 @@ void slab_init(slab_t *slab, uint32_t size, uint32_t count,
     uint32_t memory_protection)
 {
     array_init(&slab->array);
-    slab->size = size;
+    slab->size = size < sizeof(slab_object_t) ? sizeof(slab_object_t) : size;
     slab->count = count;
     slab->offset = 0;
     slab->length = 0;
     slab->memprot = memory_protection;
+
+    slab->lock = 0;
+    slab->freelist = NULL;
+    slab->used = 0;
+    slab->cache_index = TLS_OUT_OF_INDEXES;
+}
+
+int slab_enable_cache(slab_t *slab)
+{
+    LONG index = InterlockedIncrement(&g_slab_cache_count) - 1;
+    if(index >= SLAB_CACHE_SLABS) {
+        InterlockedDecrement(&g_slab_cache_count);
+        pipe("WARNING:Too many slabs with a per-thread cache!");
+        return -1;
+    }
+
+    slab->cache_index = teb_slot_alloc();
+    if(slab->cache_index == TLS_OUT_OF_INDEXES) {
+        pipe("WARNING:Unable to allocate a TLS slot for a slab cache!");
+    }
+
+    g_slab_caches[index] = slab;
+    return 0;
+}
+
+// Takes over the cache of an exited thread or allocates a new one.
+static slab_cache_t *_slab_cache_new(slab_t *slab)
+{
+    _spin_lock(&g_slab_cache_lock);
+    slab_cache_t *cache = g_slab_cache_freelist;
+    if(cache != NULL) {
+        g_slab_cache_freelist = cache->next_free;
+    }
+    _spin_unlock(&g_slab_cache_lock);
+
+    if(cache == NULL) {
+        cache = (slab_cache_t *) mem_alloc(sizeof(slab_cache_t));
+        if(cache == NULL) {
+            return NULL;
+        }
+
+        do {
+            cache->next = g_slab_cachelist;
+        } while (InterlockedCompareExchangePointer(
+            (void *volatile *) &g_slab_cachelist,
+            cache, cache->next) != cache->next);
+    }
+
+    cache->slab = slab;
+
+    // The TEB slot is set before the owner, see _slab_cache_reclaim().
+    *teb_slot(slab->cache_index) = cache;
+    InterlockedExchange(&cache->owner, get_current_thread_id());
+    return cache;
+}
+
+static slab_cache_t *_slab_cache(slab_t *slab, int create)
+{
+    if(slab->cache_index == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+
+    slab_cache_t *cache = (slab_cache_t *) *teb_slot(slab->cache_index);
+    if(cache == NULL && create != 0) {
+        cache = _slab_cache_new(slab);
+    }
+    return cache;
+}
+
+// Returns up to count cached objects to the free list of the slab.
+static void _slab_cache_flush(slab_t *slab, slab_cache_t *cache,
+    uint32_t count)
+{
+    _spin_lock(&slab->lock);
+    while (count-- != 0) {
+        slab_object_t *obj = cache->objects[--cache->count];
+        obj->next = slab->freelist;
+        slab->freelist = obj;
+    }
+    _spin_unlock(&slab->lock);
 }
 
 void *slab_getmem(slab_t *slab)
 {
-    if(_slab_ensure(slab) == 0) {
+    slab_cache_t *cache = _slab_cache(slab, 1);
+    uint8_t *ret = NULL;
+
+    if(cache != NULL && cache->count != 0) {
+        _stats_add(&slab->used, 1);
+        return cache->objects[--cache->count];
+    }
+
+    _spin_lock(&slab->lock);
+
+    if(slab->freelist != NULL) {
+        ret = (uint8_t *) slab->freelist;
+        slab->freelist = slab->freelist->next;
+    }
+    else if(_slab_ensure(slab) == 0) {
         uint8_t *mem = array_get(&slab->array, slab->offset / slab->count);
-        uint8_t *ret = mem + slab->size * (slab->offset % slab->count);
+        ret = mem + slab->size * (slab->offset % slab->count);
         slab->offset++;
-        return ret;
     }
-    return NULL;
+
+    if(ret != NULL) {
+        _stats_add(&slab->used, 1);
+    }
+
+    _spin_unlock(&slab->lock);
+    return ret;
+}
+
+void slab_free(slab_t *slab, void *ptr)
+{
+    if(ptr == NULL) {
+        return;
+    }
+
+    slab_cache_t *cache = _slab_cache(slab, 0);
+
+    _stats_add(&slab->used, -1);
+
+    if(cache != NULL) {
+        if(cache->count == SLAB_CACHE_DEPTH) {
+            _slab_cache_flush(slab, cache, SLAB_CACHE_DEPTH / 2);
+        }
+        cache->objects[cache->count++] = (slab_object_t *) ptr;
+        return;
+    }
+
+    _spin_lock(&slab->lock);
+    ((slab_object_t *) ptr)->next = slab->freelist;
+    slab->freelist = (slab_object_t *) ptr;
+    _spin_unlock(&slab->lock);
+}
+
+// Hands a cache over to the next thread. The caller has claimed the cache
+// by resetting its owner.
+static void _slab_cache_release(slab_cache_t *cache)
+{
+    _slab_cache_flush(cache->slab, cache, cache->count);
+
+    _spin_lock(&g_slab_cache_lock);
+    cache->next_free = g_slab_cache_freelist;
+    g_slab_cache_freelist = cache;
+    _spin_unlock(&g_slab_cache_lock);
+}
+
+void slab_cache_release()
+{
+    for (LONG idx = 0; idx < g_slab_cache_count; idx++) {
+        slab_t *slab = g_slab_caches[idx];
+        slab_cache_t *cache;
+        if(slab == NULL || (cache = _slab_cache(slab, 0)) == NULL ||
+                InterlockedExchange(&cache->owner, 0) == 0) {
+            continue;
+        }
+
+        *teb_slot(slab->cache_index) = NULL;
+        _slab_cache_release(cache);
+    }
 }
 
-void slab_return_last(slab_t *slab)
+// Releases the caches of threads that have exited without releasing them,
+// see _cache_reclaim().
+static void _slab_cache_reclaim()
 {
-    if(slab->offset != 0) {
-        slab->offset--;
+    for (slab_cache_t *cache = g_slab_cachelist; cache != NULL;
+            cache = cache->next) {
+        LONG owner = cache->owner;
+        if(owner != 0 && teb_slot_owner_alive(owner,
+                    cache->slab->cache_index, (uintptr_t) cache) == 0 &&
+                InterlockedCompareExchange(&cache->owner,
+                    0, owner) == owner) {
+            _slab_cache_release(cache);
+        }
     }
 }
 
+void mem_collect()
+{
+    _cache_reclaim();
+    _scratch_reclaim();
+    _slab_cache_reclaim();
+}
+
 uint32_t slab_size(const slab_t *slab)
 {
     return slab->size;
 }
 
+// The comparators may not return the difference of both values as that
+// does not fit in an int.
 static int _sort_uint32(const void *a, const void *b)
 {
     uint32_t _a = *(const uint32_t *) a;
     uint32_t _b = *(const uint32_t *) b;
-    return _a - _b;
+    return (_a > _b) - (_a < _b);
 }
 
 static int _sort_uint64(const void *a, const void *b)
 {
     uint64_t _a = *(const uint64_t *) a;
     uint64_t _b = *(const uint64_t *) b;
-    return _a - _b;
+    return (_a > _b) - (_a < _b);
+}
+
+// Places the sorted values into the Eytzinger layout through an in-order
+// traversal of the implicit tree, in which node k (starting at one) has
+// its children at 2k and 2k+1.
+static uint32_t _dnq_layout(uint8_t *out, const uint8_t *sorted,
+    uint32_t size, uint32_t length, uint32_t index, uintptr_t k)
+{
+    if(k <= length) {
+        index = _dnq_layout(out, sorted, size, length, index, 2 * k);
+        memcpy(out + (k - 1) * size, sorted + index * size, size);
+        index = _dnq_layout(out, sorted, size, length, index + 1, 2 * k + 1);
+    }
+    return index;
 }
 
 int dnq_init(dnq_t *dnq, void *list, uint32_t size, uint32_t length)
 {
     dnq->list = list;
     dnq->size = size;
-    dnq->length = length;
+    dnq->length = 0;
 
     switch (size) {
     case sizeof(uint32_t):
@@ -265,8 +1558,25 @@ int dnq_init(dnq_t *dnq, void *list, uint32_t size, uint32_t length)
     case sizeof(uint64_t):
         qsort(list, length, size, &_sort_uint64);
         break;
+
+    default:
+        pipe("CRITICAL:Unsupported dnq element size: %d", size);
+        return -1;
+    }
+
+    if(length > 1) {
+        uint8_t *sorted = (uint8_t *) mem_alloc(length * size);
+        if(sorted == NULL) {
+            pipe("CRITICAL:Error allocating memory for dnq layout!");
+            return -1;
+        }
+
+        memcpy(sorted, list, length * size);
+        _dnq_layout((uint8_t *) list, sorted, size, length, 0, 1);
+        mem_free(sorted);
     }
 
+    dnq->length = length;
     return 0;
 }
 
@@ -290,62 +1600,37 @@ int dnq_isempty(dnq_t *dnq)
     return dnq->list == NULL || dnq->length == 0;
 }
 
+// Descends the tree without branching on the comparisons. Afterwards the
+// trailing one bits of k represent the right turns taken since the last
+// left turn, i.e., since the smallest value not less than the one we're
+// looking for. The cache line holding the descendants a few levels further
+// down is fetched ahead of time.
 int dnq_has32(dnq_t *dnq, uint32_t value)
 {
-    uint32_t low = 0, high = dnq->length - 1;
     uint32_t *list = dnq_iter32(dnq);
+    uintptr_t k = 1;
 
-    while (high - low > 1) {
-        uint32_t index = low + (high - low) / 2;
-        if(value == list[index]) {
-            return 1;
-        }
-
-        if(value > list[index]) {
-            low = index;
-            continue;
-        }
-
-        if(value < list[index]) {
-            high = index;
-            continue;
-        }
-    }
-
-    if(value == list[low] || value == list[high]) {
-        return 1;
+    while (k <= dnq->length) {
+        __builtin_prefetch(list + 16 * k - 1);
+        k = 2 * k + (list[k - 1] < value);
     }
 
-    return 0;
+    k >>= __builtin_ffsll(~(uint64_t) k);
+    return k != 0 && list[k - 1] == value;
 }
 
 int dnq_has64(dnq_t *dnq, uint64_t value)
 {
-    uint32_t low = 0, high = dnq->length - 1;
     uint64_t *list = dnq_iter64(dnq);
+    uintptr_t k = 1;
 
-    while (high - low > 1) {
-        uint32_t index = low + (high - low) / 2;
-        if(value == list[index]) {
-            return 1;
-        }
-
-        if(value > list[index]) {
-            low = index;
-            continue;
-        }
-
-        if(value < list[index]) {
-            high = index;
-            continue;
-        }
-    }
-
-    if(value == list[low] || value == list[high]) {
-        return 1;
+    while (k <= dnq->length) {
+        __builtin_prefetch(list + 8 * k - 1);
+        k = 2 * k + (list[k - 1] < value);
     }
 
-    return 0;
+    k >>= __builtin_ffsll(~(uint64_t) k);
+    return k != 0 && list[k - 1] == value;
 }
 
 int dnq_hasptr(dnq_t *dnq, uintptr_t value)
@@ -358,3 +1643,74 @@ int dnq_hasptr(dnq_t *dnq, uintptr_t value)
         return dnq_has64(dnq, value);
     }
 }
+
+static const uint32_t g_bloom_salts[BLOOM_WORDS] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+};
+
+// The hashes from call_hash() are mostly mixed towards their upper bits,
+// so they're mixed once more. The upper half selects the block, the lower
+// half the bits within the block.
+static uint32_t *_bloom_block(const bloom_t *bloom, uint64_t hash,
+    uint32_t *key)
+{
+    hash = hash_mix64(hash);
+
+    *key = (uint32_t) hash;
+    return bloom->blocks +
+        ((hash >> 32) * bloom->count >> 32) * BLOOM_WORDS;
+}
+
+int bloom_init(bloom_t *bloom, uint32_t count)
+{
+    uint32_t bits = BLOOM_WORDS * 32;
+
+    bloom->count = ((uint64_t) count * BLOOM_BITS_PER_HASH + bits - 1) / bits;
+    if(bloom->count == 0) {
+        bloom->count = 1;
+    }
+
+    // Blocks from mem_alloc() follow its header and may thus straddle
+    // cache lines. Its header is only eight bytes on x86, so nothing more
+    // than byte alignment is assumed when rounding up to a cache line.
+    bloom->base = mem_alloc(bloom->count * bits / 8 + BLOOM_ALIGNMENT - 1);
+    if(bloom->base == NULL) {
+        pipe("CRITICAL:Error allocating memory for bloom filter!");
+        bloom->blocks = NULL;
+        bloom->count = 0;
+        return -1;
+    }
+
+    bloom->blocks = (uint32_t *)(((uintptr_t) bloom->base +
+        BLOOM_ALIGNMENT - 1) & ~(uintptr_t)(BLOOM_ALIGNMENT - 1));
+    return 0;
+}
+
+void bloom_add(bloom_t *bloom, uint64_t hash)
+{
+    uint32_t key, *block = _bloom_block(bloom, hash, &key);
+
+    for (uint32_t idx = 0; idx < BLOOM_WORDS; idx++) {
+        block[idx] |= 1u << ((key * g_bloom_salts[idx]) >> 27);
+    }
+}
+
+int bloom_has(const bloom_t *bloom, uint64_t hash)
+{
+    uint32_t key, *block = _bloom_block(bloom, hash, &key), ret = 1;
+
+    // Without branches, which lets gcc evaluate all words at once.
+    for (uint32_t idx = 0; idx < BLOOM_WORDS; idx++) {
+        ret &= block[idx] >> ((key * g_bloom_salts[idx]) >> 27);
+    }
+    return ret;
+}
+
+void bloom_free(bloom_t *bloom)
+{
+    mem_free(bloom->base);
+    bloom->base = NULL;
+    bloom->blocks = NULL;
+    bloom->count = 0;
+}
@@ -35,8 +35,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "symbol.h"
 
 static char g_shutdown_mutex[MAX_PATH];
-static array_t g_unicode_buffer_ptr_array;
-static array_t g_unicode_buffer_use_array;
+static slab_t g_unicode_buffers;
+
+// Amount of unicode buffers per slab chunk.
+#define UNICODE_BUFFER_COUNT 4
 
 static monitor_hook_t g_hook_library;
 static monitor_hook_t g_unhook_library;
@@ -45,9 +47,14 @@ static monitor_hook_t g_unhook_library;
 #define HKCU_PREFIX2 L"HKEY_USERS\\S-1-5-"
 #define HKLM_PREFIX  L"\\REGISTRY\\MACHINE"
 
-static wchar_t g_aliases[64][2][MAX_PATH];
+// Each alias is allocated as it's added, rather than reserving MAX_PATH
+// characters for all of them up front.
+static wchar_t *g_aliases[64][2];
 static uint32_t g_alias_index;
 
+// Whether the TEB slots of other threads can be read, see misc_init().
+static int g_teb_slots_visible;
+
 static uintptr_t g_exception_addrs[32];
 static uint32_t g_exception_addr_count;
 
@@ -65,19 +72,26 @@ int g_monitor_logging;
         pipe("CRITICAL:Too many aliases!"); \
         exit(1); \
     } \
-    wcscpy(g_aliases[g_alias_index][0], before); \
-    wcscpy(g_aliases[g_alias_index][1], after); \
+    g_aliases[g_alias_index][0] = our_wcsdup(before); \
+    g_aliases[g_alias_index][1] = our_wcsdup(after); \
     g_alias_index++;
 
 int misc_init(const char *shutdown_mutex)
 {
     strncpy(g_shutdown_mutex, shutdown_mutex, sizeof(g_shutdown_mutex));
 
-    // TODO Replace custom unicode buffer logic by implementing free() support
-    // to our slab allocator (which is actually what a slab allocator is
-    // supposed to do, afaik).
-    array_init(&g_unicode_buffer_ptr_array);
-    array_init(&g_unicode_buffer_use_array);
+    // Owners of per-thread state are told apart through their TEB slots,
+    // which requires the TEB that Windows reports for a thread to be the
+    // one that teb_slot() addresses. Otherwise they're never replaced.
+    THREAD_BASIC_INFORMATION tbi;
+    g_teb_slots_visible = query_information_thread(get_current_thread(),
+            ThreadBasicInformation, &tbi, sizeof(tbi)) == sizeof(tbi) &&
+        (uintptr_t) tbi.TebBaseAddress == readtls(TLS_TEB);
+
+    // Unicode buffers are recycled through a per-thread cache.
+    slab_init(&g_unicode_buffers, (MAX_PATH_W+1) * sizeof(wchar_t),
+        UNICODE_BUFFER_COUNT, PAGE_READWRITE);
+    slab_enable_cache(&g_unicode_buffers);
 
     ADD_ALIAS(L"\\SystemRoot\\", L"C:\\Windows\\");
 
@@ -133,78 +147,34 @@ void misc_set_monitor_options(uint32_t track, uint32_t mode,
     }
 }
 
-// Maximum number of buffers that we reuse.
-#define UNICODE_BUFFER_COUNT (0x1000/sizeof(void *))
-
 wchar_t *get_unicode_buffer()
 {
-    uint8_t *used = (uint8_t *)
-        array_get(&g_unicode_buffer_use_array, get_current_thread_id());
-
-    wchar_t **ptrs = (wchar_t **)
-        array_get(&g_unicode_buffer_ptr_array, get_current_thread_id());
-
-    // If not done yet, allocate initial memory management data.
-    if(used == NULL && ptrs == NULL) {
-        used = (uint8_t *)
-            virtual_alloc_rw(NULL, UNICODE_BUFFER_COUNT * sizeof(uint8_t));
-
-        ptrs = (wchar_t **)
-            virtual_alloc_rw(NULL, UNICODE_BUFFER_COUNT * sizeof(wchar_t **));
-
-        array_set(&g_unicode_buffer_use_array, get_current_thread_id(), used);
-        array_set(&g_unicode_buffer_ptr_array, get_current_thread_id(), ptrs);
+    // Within hook handlers the buffer is taken from the scratch arena.
+    wchar_t *ret = scratch_get((MAX_PATH_W+1) * sizeof(wchar_t));
+    if(ret == NULL) {
+        ret = slab_getmem(&g_unicode_buffers);
     }
 
-    for (uint32_t idx = 0; idx < UNICODE_BUFFER_COUNT; idx++) {
-        if(ptrs[idx] == NULL) {
-            ptrs[idx] =
-                virtual_alloc_rw(NULL, (MAX_PATH_W+1) * sizeof(wchar_t));
-            if(ptrs[idx] == NULL) {
-                pipe("WARNING:Error allocating memory for unicode buffer");
-            }
-        }
-
-        // Return this pointer if it has not been used yet. Zero-terminate it
-        // just in case.
-        if(used[idx] == 0) {
-            used[idx] = 1, *ptrs[idx] = 0;
-            return ptrs[idx];
-        }
+    // Zero-terminate it just in case.
+    if(ret != NULL) {
+        *ret = 0;
     }
-
-    // If we get here there is probably a memory leak going on somewhere.
-    pipe("CRITICAL:We probably encountered a memory leak with regards to "
-        "unicode buffers somewhere");
-
-    // However, just in case, return some memory in order not to crash.
-    return virtual_alloc_rw(NULL, (MAX_PATH_W+1) * sizeof(wchar_t));
+    return ret;
 }
 
 void free_unicode_buffer(wchar_t *ptr)
 {
-    if(ptr == NULL) {
+    if(scratch_contains(ptr) != 0) {
+        scratch_free(ptr);
         return;
     }
 
-    uint8_t *used = (uint8_t *)
-        array_get(&g_unicode_buffer_use_array, get_current_thread_id());
-
-    wchar_t **ptrs = (wchar_t **)
-        array_get(&g_unicode_buffer_ptr_array, get_current_thread_id());
-
-    // Cross-reference the pointer against the list of pointers. If found,
-    // set used to zero.
-    for (uint32_t idx = 0; idx < UNICODE_BUFFER_COUNT; idx++) {
-        if(ptrs[idx] == ptr) {
-            used[idx] = 0;
-            return;
-        }
-    }
+    slab_free(&g_unicode_buffers, ptr);
+}
 
-    // If we reach here, then this buffer is not maintained by the list of
-    // available buffers, and we have to deallocate it manually.
-    virtual_free(ptr, (MAX_PATH_W+1) * sizeof(wchar_t), MEM_RELEASE);
+uint32_t unicode_buffer_count()
+{
+    return g_unicode_buffers.used;
 }
 
 uint32_t pid_from_process_handle(HANDLE process_handle)
@@ -275,6 +245,48 @@ uint32_t tid_from_thread_handle(HANDLE thread_handle)
     return ret;
 }
 
+/**
+ * Tells whether the owner of per-thread state, i.e., the thread with the
+ * given identifier that stored value in its TEB slot index, is still
+ * running. Thread identifiers are reused, so a running thread with
+ * this identifier is only the owner if its TEB slot holds the value.
+ *
+ * Returns 0 only if the owner has positively exited, i.e., there's no such
+ * thread anymore, its exit status has been set, or the thread is another
+ * one. Returns -1 if this can't be told, e.g., if the thread can't be
+ * opened, and 1 if the owner is still running.
+ */
+int teb_slot_owner_alive(uint32_t thread_identifier, uint32_t index,
+    uintptr_t value)
+{
+    THREAD_BASIC_INFORMATION tbi; HANDLE thread_handle;
+    uintptr_t slot; int ret = -1;
+
+    NTSTATUS status = open_thread_status(THREAD_QUERY_INFORMATION,
+        thread_identifier, &thread_handle);
+    if(status == STATUS_INVALID_CID) {
+        return 0;
+    }
+    if(NT_SUCCESS(status) == FALSE) {
+        return -1;
+    }
+
+    if(query_information_thread(thread_handle, ThreadBasicInformation,
+            &tbi, sizeof(tbi)) == sizeof(tbi)) {
+        if(tbi.ExitStatus != STATUS_PENDING) {
+            ret = 0;
+        }
+        else if(g_teb_slots_visible != 0 && index != TLS_OUT_OF_INDEXES &&
+                copy_bytes(&slot, (const uint8_t *) tbi.TebBaseAddress +
+                    teb_slot_offset(index), sizeof(slot)) == 0) {
+            ret = slot == value;
+        }
+    }
+
+    close_handle(thread_handle);
+    return ret;
+}
+
 uint32_t parent_process_identifier()
 {
     PROCESS_BASIC_INFORMATION pbi;
@@ -1186,6 +1198,18 @@ void *memdup(const void *addr, uint32_t length)
     return NULL;
 }
 
+void *scratch_memdup(const void *addr, uint32_t length)
+{
+    if(addr != NULL && length != 0) {
+        void *ret = scratch_alloc(length);
+        if(ret != NULL) {
+            memcpy(ret, addr, length);
+            return ret;
+        }
+    }
+    return NULL;
+}
+
 wchar_t *our_wcsdup(const wchar_t *s)
 {
     if(s != NULL) {
@@ -1265,59 +1289,6 @@ void secbuf_get_buffer(uint32_t buffer_count, SecBuffer *buffers,
     }
 }
 
-uint64_t hash_buffer(const void *buf, uint32_t length)
-{
-    if(buf == NULL || length == 0) {
-        return 0;
-    }
-
-    const uint8_t *p = (const uint8_t *) buf;
-    uint64_t ret = *p << 7;
-    for (uint32_t idx = 0; idx < length; idx++) {
-        ret = (ret * 1000003) ^ *p++;
-    }
-    return ret ^ length;
-}
-
-uint64_t hash_string(const char *buf, int32_t length)
-{
-    if(buf == NULL || length == 0) {
-        return 0;
-    }
-
-    if(length < 0) {
-        length = strlen(buf);
-    }
-
-    uint64_t ret = *buf << 7;
-    for (int32_t idx = 0; idx < length; idx++) {
-        ret = (ret * 1000003) ^ (uint8_t) *buf++;
-    }
-    return ret ^ length;
-}
-
-uint64_t hash_stringW(const wchar_t *buf, int32_t length)
-{
-    if(buf == NULL || length == 0) {
-        return 0;
-    }
-
-    if(length < 0) {
-        length = lstrlenW(buf);
-    }
-
-    uint64_t ret = *buf << 7;
-    for (int32_t idx = 0; idx < length; idx++) {
-        ret = (ret * 1000003) ^ (uint16_t) *buf++;
-    }
-    return ret ^ length;
-}
-
-uint64_t hash_uint64(uint64_t value)
-{
-    return hash_buffer(&value, sizeof(value));
-}
-
 // http://stackoverflow.com/questions/9655202/how-to-convert-integer-to-string-in-c
 int ultostr(int64_t value, char *str, int base)
 {
@@ -630,23 +630,29 @@ int message_box(HWND hwnd, const char *body, const char *title, int flags)
 
 HANDLE open_thread(uint32_t desired_access, uint32_t thread_identifier)
 {
-    assert(pNtOpenThread != NULL, "pNtOpenThread is NULL!", NULL);
+    HANDLE thread_handle;
 
-    HANDLE thread_handle; OBJECT_ATTRIBUTES objattr; CLIENT_ID cid;
+    if(NT_SUCCESS(open_thread_status(desired_access, thread_identifier,
+            &thread_handle)) != FALSE) {
+        return thread_handle;
+    }
+    return NULL;
+}
+
+NTSTATUS open_thread_status(uint32_t desired_access,
+    uint32_t thread_identifier, HANDLE *thread_handle)
+{
+    assert(pNtOpenThread != NULL, "pNtOpenThread is NULL!",
+        STATUS_ACCESS_DENIED);
+
+    OBJECT_ATTRIBUTES objattr; CLIENT_ID cid;
 
     InitializeObjectAttributes(&objattr, NULL, 0, NULL, NULL);
 
     cid.UniqueProcess = NULL;
     cid.UniqueThread = (HANDLE)(uintptr_t) thread_identifier;
 
-    NTSTATUS ret = pNtOpenThread(
-        &thread_handle, desired_access, &objattr, &cid
-    );
-
-    if(NT_SUCCESS(ret) != FALSE) {
-        return thread_handle;
-    }
-    return NULL;
+    return pNtOpenThread(thread_handle, desired_access, &objattr, &cid);
 }
 
 uint32_t resume_thread(HANDLE thread_handle)
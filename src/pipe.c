@@ -26,6 +26,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 static CRITICAL_SECTION g_cs;
 static wchar_t g_pipe_name[MAX_PATH];
+
+// Message buffer shared by pipe() and pipe2(), protected by g_cs. Being
+// part of the .bss section, only the pages that are actually used become
+// resident.
+static char g_pipe_buf[0x10000];
 static HANDLE g_pipe_handle;
 static int g_pipe_pid;
 
@@ -40,11 +45,21 @@ static int _pipe_utf8x(char **out, unsigned short x)
     return len;
 }
 
+// Both copy runs of ASCII characters in bulk. Other characters, including
+// surrogates, are encoded one by one.
 static int _pipe_ascii(char **out, const char *s, int len)
 {
     int ret = 0;
-    while (len-- != 0) {
+    while (len > 0) {
+        if(*out != NULL) {
+            int count = utf8_ascii_prefix(s, len, (uint8_t *) *out);
+            *out += count, s += count, len -= count, ret += count;
+            if(len == 0) {
+                break;
+            }
+        }
         ret += _pipe_utf8x(out, *(unsigned char *) s++);
+        len--;
     }
     return ret;
 }
@@ -52,8 +67,16 @@ static int _pipe_ascii(char **out, const char *s, int len)
 static int _pipe_unicode(char **out, const wchar_t *s, int len)
 {
     int ret = 0;
-    while (len-- != 0) {
+    while (len > 0) {
+        if(*out != NULL) {
+            int count = utf8_ascii_prefixW(s, len, (uint8_t *) *out);
+            *out += count, s += count, len -= count, ret += count;
+            if(len == 0) {
+                break;
+            }
+        }
         ret += _pipe_utf8x(out, *(unsigned short *) s++);
+        len--;
     }
     return ret;
 }
@@ -191,7 +214,7 @@ int pipe(const char *fmt, ...)
 
     open_pipe_handle();
 
-    static char buf[0x10000]; va_list args; int ret = -1, len = 0;
+    char *buf = g_pipe_buf; va_list args; int ret = -1, len = 0;
 
     EnterCriticalSection(&g_cs);
 
@@ -204,7 +227,8 @@ int pipe(const char *fmt, ...)
     va_end(args);
 
     if(len > 0) {
-        transact_named_pipe(g_pipe_handle, buf, len, buf, sizeof(buf), NULL);
+        transact_named_pipe(g_pipe_handle, buf, len,
+            buf, sizeof(g_pipe_buf), NULL);
         ret = 0;
     }
 
@@ -229,7 +253,7 @@ int32_t pipe2(void *out, uint32_t outlen, const char *fmt, ...)
 
     open_pipe_handle();
 
-    static char buf[0x10000]; va_list args;
+    char *buf = g_pipe_buf; va_list args;
     int32_t ret = -1, len = 0; uintptr_t written;
 
     EnterCriticalSection(&g_cs);
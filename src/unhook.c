@@ -21,16 +21,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hooking.h"
 #include "pipe.h"
 #include "log.h"
+#include "memory.h"
 #include "misc.h"
 
 #define UNHOOK_MAXCOUNT 2048
 #define UNHOOK_BUFSIZE 256
 
+// Each region is allocated with just enough room for its original and
+// modified contents, which follow the structure.
 typedef struct _region_t {
     uint32_t        region_length;
     const uint8_t  *region_address;
-    uint8_t         region_original[UNHOOK_BUFSIZE];
-    uint8_t         region_modified[UNHOOK_BUFSIZE];
+    uint8_t        *region_original;
+    uint8_t        *region_modified;
 
     char            funcname[64];
     uint32_t        region_reported;
@@ -38,7 +41,10 @@ typedef struct _region_t {
 
 static HANDLE g_unhook_thread_handle, g_watcher_thread_handle, g_main_thread;
 static uint32_t g_region_index, g_unhook_exited, g_unhook_enabled;
-static region_t g_regions[UNHOOK_MAXCOUNT];
+
+// Regions indexed by their position, which lets the detection thread walk
+// them without locking while new ones are being added.
+static table_t g_regions;
 
 void unhook_detect_add_region(const char *funcname, const uint8_t *addr,
     const uint8_t *original, const uint8_t *modified, uint32_t length)
@@ -48,17 +54,30 @@ void unhook_detect_add_region(const char *funcname, const uint8_t *addr,
         return;
     }
 
-    region_t *r = &g_regions[g_region_index];
+    length = MIN(length, UNHOOK_BUFSIZE);
+
+    region_t *r = (region_t *) mem_alloc(sizeof(region_t) + 2 * length);
+    if(r == NULL) {
+        pipe("CRITICAL:Error allocating unhook detection entry!");
+        return;
+    }
 
     r->region_length = length;
     r->region_address = addr;
+    r->region_original = (uint8_t *)(r + 1);
+    r->region_modified = r->region_original + length;
 
     if(funcname != NULL) {
-        strcpy(r->funcname, funcname);
+        strncpy(r->funcname, funcname, sizeof(r->funcname) - 1);
     }
 
-    memcpy(r->region_original, original, MIN(length, UNHOOK_BUFSIZE));
-    memcpy(r->region_modified, modified, MIN(length, UNHOOK_BUFSIZE));
+    memcpy(r->region_original, original, length);
+    memcpy(r->region_modified, modified, length);
+
+    if(table_set(&g_regions, g_region_index, r) < 0) {
+        mem_free(r);
+        return;
+    }
 
     g_region_index++;
 }
@@ -68,14 +87,15 @@ void unhook_detect_remove_dead_regions()
     uint32_t outidx = 0;
 
     for (uint32_t idx = 0; idx < g_region_index; idx++) {
-        region_t *r = &g_regions[idx];
+        region_t *r = table_get(&g_regions, idx);
 
-        // Remove the region by ignoring it.
+        // Remove the region altogether.
         if(page_is_readable(r->region_address) == 0) {
+            mem_free(r);
             continue;
         }
 
-        memcpy(&g_regions[outidx++], r, sizeof(region_t));
+        table_set(&g_regions, outidx++, r);
     }
 
     g_region_index = outidx;
@@ -85,6 +105,10 @@ static DWORD WINAPI _unhook_detect_thread(LPVOID param)
 {
     (void) param;
 
+    // API calls made by this thread are never logged.
+    hook_frame_t frame;
+    hook_enter(&frame);
+
     char msg[512];
     static int watcher_first = 1;
 
@@ -105,7 +129,7 @@ static DWORD WINAPI _unhook_detect_thread(LPVOID param)
         if(g_unhook_enabled == 0) continue;
 
         for (uint32_t idx = 0; idx < g_region_index; idx++) {
-            region_t *r = &g_regions[idx];
+            region_t *r = table_get(&g_regions, idx);
 
             // Check whether this memory region still equals what we made it.
             if(memcmp(r->region_address, r->region_modified,
@@ -157,6 +181,10 @@ static DWORD WINAPI _unhook_watch_thread(LPVOID param)
 {
     (void) param;
 
+    // API calls made by this thread are never logged.
+    hook_frame_t frame;
+    hook_enter(&frame);
+
     while (WaitForSingleObject(g_unhook_thread_handle, 1000) == WAIT_TIMEOUT);
 
     if(g_unhook_exited == 0 && is_shutting_down() == 0) {
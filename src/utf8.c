@@ -21,6 +21,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "memory.h"
 #include "utf8.h"
 
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
 int utf8_encode(uint32_t c, uint8_t *out)
 {
     if(c < 0x80) {
@@ -102,15 +106,89 @@ int utf8_decode_strn(const char *in, wchar_t *out, uint32_t len)
 
 int utf8_length(uint32_t c)
 {
-    uint8_t buf[6];
-    return utf8_encode(c, buf);
+    if(c < 0x80) return 1;
+    if(c < 0x800) return 2;
+    if(c < 0x10000) return 3;
+    if(c < 0x200000) return 4;
+    if(c < 0x4000000) return 5;
+    if(c < 0x80000000) return 6;
+    return -1;
+}
+
+int utf8_ascii_prefix(const char *s, int len, uint8_t *out)
+{
+    int idx = 0;
+
+#if __SSE2__
+    // Copy sixteen characters at a time until one has its MSB set.
+    for (; idx + 16 <= len; idx += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *) &s[idx]);
+        _mm_storeu_si128((__m128i *) &out[idx], value);
+
+        uint32_t mask = _mm_movemask_epi8(value);
+        if(mask != 0) {
+            return idx + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; idx < len && (uint8_t) s[idx] < 0x80; idx++) {
+        out[idx] = s[idx];
+    }
+    return idx;
+}
+
+#if __SSE2__
+
+// Returns a bitmask with two bits set for each non-ASCII character.
+static uint32_t _utf8_nonascii8(__m128i value)
+{
+    const __m128i ascii = _mm_set1_epi16((short) 0xff80);
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(value, ascii), _mm_setzero_si128())) ^ 0xffff;
+}
+
+#endif
+
+int utf8_ascii_prefixW(const wchar_t *s, int len, uint8_t *out)
+{
+    int idx = 0;
+
+#if __SSE2__
+    // Narrow sixteen characters at a time until one is not ASCII. The
+    // saturated bytes of non-ASCII characters are overwritten later on.
+    for (; idx + 16 <= len; idx += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) &s[idx]);
+        __m128i hi = _mm_loadu_si128((const __m128i *) &s[idx + 8]);
+        _mm_storeu_si128((__m128i *) &out[idx], _mm_packus_epi16(lo, hi));
+
+        uint32_t mask = _utf8_nonascii8(lo) | _utf8_nonascii8(hi) << 16;
+        if(mask != 0) {
+            return idx + __builtin_ctz(mask) / 2;
+        }
+    }
+#endif
+
+    for (; idx < len && (uint16_t) s[idx] < 0x80; idx++) {
+        out[idx] = (uint8_t) s[idx];
+    }
+    return idx;
 }
 
 int utf8_bytecnt_ascii(const char *s, int len)
 {
-    int ret = 0;
-    while (len-- != 0) {
-        ret += utf8_length((uint8_t) *s++);
+    int ret = len, idx = 0;
+
+#if __SSE2__
+    // Each character with its MSB set takes up one extra byte.
+    for (; idx + 16 <= len; idx += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *) &s[idx]);
+        ret += __builtin_popcount(_mm_movemask_epi8(value));
+    }
+#endif
+
+    for (; idx < len; idx++) {
+        ret += (uint8_t) s[idx] >= 0x80;
     }
     return ret;
 }
@@ -118,78 +196,141 @@ int utf8_bytecnt_ascii(const char *s, int len)
 int utf8_bytecnt_unicode(const wchar_t *s, int len)
 {
     int ret = 0;
-    while (len-- != 0) {
+
+#if __SSE2__
+    const __m128i above7 = _mm_set1_epi16((short) 0xff80);
+    const __m128i above11 = _mm_set1_epi16((short) 0xf800);
+    const __m128i surrogate = _mm_set1_epi16((short) 0xd800);
+    const __m128i zero = _mm_setzero_si128();
+#endif
+
+    while (len != 0) {
+#if __SSE2__
+        // Blocks of eight characters without surrogates take up one byte
+        // per character, plus one for each character of 0x80 and up, plus
+        // one for each character of 0x800 and up.
+        if(len >= 8) {
+            __m128i value = _mm_loadu_si128((const __m128i *) s);
+            __m128i top = _mm_and_si128(value, above11);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(top, surrogate)) == 0) {
+                uint32_t two = _mm_movemask_epi8(_mm_cmpeq_epi16(
+                    _mm_and_si128(value, above7), zero)) ^ 0xffff;
+                uint32_t three = _mm_movemask_epi8(
+                    _mm_cmpeq_epi16(top, zero)) ^ 0xffff;
+                ret += 8 + (__builtin_popcount(two) +
+                    __builtin_popcount(three)) / 2;
+                s += 8, len -= 8;
+                continue;
+            }
+        }
+#endif
+
+        uint16_t ch = (uint16_t) *s;
+
         // Handle Supplementary Planes.
-        if((uint16_t) *s >= 0xd800 && (uint16_t) *s < 0xdc00) {
+        if(ch >= 0xd800 && ch < 0xdc00) {
             // No remaining space? Prevent possibly reading out of bounds.
-            if(len == 0) {
+            if(len == 1) {
                 break;
             }
 
-            uint32_t ch = ((uint32_t)(uint16_t) *s - 0xd800) << 10;
+            uint32_t ch32 = ((uint32_t) ch - 0xd800) << 10;
 
             // We'll just ignore invalid low surrogates..
             if((uint16_t) s[1] >= 0xdc00 && (uint16_t) s[1] < 0xe000) {
-                ch += (uint16_t) s[1] - 0xdc00;
+                ch32 += (uint16_t) s[1] - 0xdc00;
             }
 
-            ret += utf8_length(ch);
-            s += 2, len--;
+            ret += utf8_length(ch32);
+            s += 2, len -= 2;
         }
         else {
-            ret += utf8_length((uint16_t) *s++);
+            ret += utf8_length(ch);
+            s++, len--;
         }
     }
     return ret;
 }
 
-char *utf8_string(const char *s, int len)
+int utf8_encode_string(const char *s, int len, uint8_t *out)
 {
-    int encoded_length = utf8_bytecnt_ascii(s, len);
-    char *utf8string = (char *) mem_alloc(encoded_length+5);
-    if(utf8string == NULL) {
-        return NULL;
-    }
-
-    *((int *) utf8string) = encoded_length;
-    int pos = 4;
+    const uint8_t *base = out;
+    while (len != 0) {
+        int count = utf8_ascii_prefix(s, len, out);
+        s += count, out += count, len -= count;
+        if(len == 0) {
+            break;
+        }
 
-    while (len-- != 0) {
-        pos += utf8_encode((uint8_t) *s++, (uint8_t *) &utf8string[pos]);
+        uint8_t ch = (uint8_t) *s++;
+        out[0] = 0xc0 + (ch >> 6);
+        out[1] = 0x80 + (ch & 0x3f);
+        out += 2, len--;
     }
-    utf8string[pos] = 0;
-    return utf8string;
+    return out - base;
 }
 
-char *utf8_wstring(const wchar_t *s, int len)
+int utf8_encode_wstring(const wchar_t *s, int len, uint8_t *out)
 {
-    int encoded_length = utf8_bytecnt_unicode(s, len);
-    char *utf8string = (char *) mem_alloc(encoded_length+5);
-    *((int *) utf8string) = encoded_length;
-    int pos = 4;
+    const uint8_t *base = out;
+    while (len != 0) {
+        int count = utf8_ascii_prefixW(s, len, out);
+        s += count, out += count, len -= count;
+        if(len == 0) {
+            break;
+        }
+
+        uint16_t ch = (uint16_t) *s;
 
-    while (len-- != 0) {
         // Handle Supplementary Planes.
-        if((uint16_t) *s >= 0xd800 && (uint16_t) *s < 0xdc00) {
+        if(ch >= 0xd800 && ch < 0xdc00) {
             // No remaining space? Prevent possibly reading out of bounds.
-            if(len == 0) {
+            if(len == 1) {
                 break;
             }
 
-            uint32_t ch = ((uint32_t)(uint16_t) *s - 0xd800) << 10;
+            uint32_t ch32 = ((uint32_t) ch - 0xd800) << 10;
 
             // We'll just ignore invalid low surrogates..
             if((uint16_t) s[1] >= 0xdc00 && (uint16_t) s[1] < 0xe000) {
-                ch += (uint16_t) s[1] - 0xdc00;
+                ch32 += (uint16_t) s[1] - 0xdc00;
             }
 
-            pos += utf8_encode(ch, (uint8_t *) &utf8string[pos]);
-            s += 2, len--;
+            out += utf8_encode(ch32, out);
+            s += 2, len -= 2;
         }
         else {
-            pos += utf8_encode((uint16_t) *s++, (uint8_t *) &utf8string[pos]);
+            out += utf8_encode(ch, out);
+            s++, len--;
         }
     }
+    return out - base;
+}
+
+char *utf8_string(const char *s, int len)
+{
+    int encoded_length = utf8_bytecnt_ascii(s, len);
+    char *utf8string = (char *) scratch_alloc(encoded_length+5);
+    if(utf8string == NULL) {
+        return NULL;
+    }
+
+    *((int *) utf8string) = encoded_length;
+    int pos = 4 + utf8_encode_string(s, len, (uint8_t *) &utf8string[4]);
+    utf8string[pos] = 0;
+    return utf8string;
+}
+
+char *utf8_wstring(const wchar_t *s, int len)
+{
+    int encoded_length = utf8_bytecnt_unicode(s, len);
+    char *utf8string = (char *) scratch_alloc(encoded_length+5);
+    if(utf8string == NULL) {
+        return NULL;
+    }
+
+    *((int *) utf8string) = encoded_length;
+    int pos = 4 + utf8_encode_wstring(s, len, (uint8_t *) &utf8string[4]);
     utf8string[pos] = 0;
     return utf8string;
 }
@@ -0,0 +1,99 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the Bloom filter that is used in front of the diffing hash list.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define HASH_COUNT 100000
+
+static uint64_t _xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    bloom_t b; uint64_t seed = 0x1337;
+    assert(bloom_init(&b, HASH_COUNT) == 0);
+    assert(b.count == (HASH_COUNT * BLOOM_BITS_PER_HASH + 255) / 256);
+    assert(((uintptr_t) b.blocks & (BLOOM_ALIGNMENT - 1)) == 0);
+
+    for (uint32_t idx = 0; idx < HASH_COUNT; idx++) {
+        bloom_add(&b, _xorshift(&seed));
+    }
+
+    // There are no false negatives.
+    uint32_t missing = 0;
+
+    seed = 0x1337;
+    for (uint32_t idx = 0; idx < HASH_COUNT; idx++) {
+        missing += bloom_has(&b, _xorshift(&seed)) == 0;
+    }
+    assert(missing == 0);
+
+    // Few false positives for both random and sequential hashes.
+    uint32_t positives = 0;
+    for (uint32_t idx = 0; idx < HASH_COUNT; idx++) {
+        positives += bloom_has(&b, _xorshift(&seed));
+        positives += bloom_has(&b, idx);
+    }
+
+    pipe("INFO:%d false positives out of %d", positives, 2 * HASH_COUNT);
+    assert(positives < 2 * HASH_COUNT / 200);
+
+    bloom_free(&b);
+    assert(b.blocks == NULL);
+
+    // An empty filter still consists of a single block.
+    assert(bloom_init(&b, 0) == 0 && b.count == 1);
+    assert(((uintptr_t) b.blocks & (BLOOM_ALIGNMENT - 1)) == 0);
+    assert(bloom_has(&b, 0) == 0);
+    bloom_add(&b, 0);
+    assert(bloom_has(&b, 0) == 1);
+    bloom_free(&b);
+    pipe("INFO:Test finished!");
+    return 0;
+}
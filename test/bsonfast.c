@@ -0,0 +1,158 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that the bson_fast_* appenders encode exactly the same records as
+// the regular bson appenders and reports the records per second encoded by
+// both. Only the bson library itself is involved. Also runs natively on
+// the host through "make host-tests".
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "bson.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 1000000
+
+static const char g_path[] = "C:\\Windows\\System32\\kernel32.dll";
+
+// A typical API record as built by log_api().
+static void _record_regular(bson *b, uint32_t idx)
+{
+    bson_init_size(b, 1024);
+    bson_append_int(b, "I", 42);
+    bson_append_int(b, "T", 1234);
+    bson_append_int(b, "t", idx);
+    bson_append_long(b, "h", 0x1122334455667788);
+    bson_append_int(b, "e", 5);
+    bson_append_int(b, "E", 0xc0000022);
+    bson_append_start_array(b, "args");
+    bson_append_int(b, "0", 0);
+    bson_append_long(b, "1", -1);
+    bson_append_int(b, "2", idx);
+    bson_append_string_n(b, "3", g_path, sizeof(g_path) - 1);
+    bson_append_binary(b, "4", BSON_BIN_BINARY, "buffer", 6);
+    bson_append_null(b, "5");
+    bson_append_start_array(b, "6");
+    bson_append_string_n(b, "0", "argv", 4);
+    bson_append_finish_array(b);
+    bson_append_finish_array(b);
+    bson_finish(b);
+}
+
+static void _record_fast(bson *b, uint32_t idx)
+{
+    bson_init_size(b, 1024);
+    bson_reserve(b, 5 * BSON_INT_SIZE(1) + BSON_LONG_SIZE(1));
+    bson_fast_int_unchecked(b, BSON_KEY("I"), 42);
+    bson_fast_int_unchecked(b, BSON_KEY("T"), 1234);
+    bson_fast_int_unchecked(b, BSON_KEY("t"), idx);
+    bson_fast_long_unchecked(b, BSON_KEY("h"), 0x1122334455667788);
+    bson_fast_int_unchecked(b, BSON_KEY("e"), 5);
+    bson_fast_int_unchecked(b, BSON_KEY("E"), 0xc0000022);
+    bson_fast_start_array(b, BSON_KEY("args"));
+    bson_fast_int(b, BSON_KEY("0"), 0);
+    bson_fast_long(b, BSON_KEY("1"), -1);
+    bson_fast_int(b, BSON_KEY("2"), idx);
+    bson_fast_string(b, BSON_KEY("3"), g_path, sizeof(g_path) - 1);
+    bson_fast_binary(b, BSON_KEY("4"), BSON_BIN_BINARY, "buffer", 6);
+    bson_fast_null(b, BSON_KEY("5"));
+    bson_fast_start_array(b, BSON_KEY("6"));
+    bson_fast_string(b, BSON_KEY("0"), "argv", 4);
+    bson_fast_finish_array(b);
+    bson_fast_finish_array(b);
+    bson_fast_finish(b);
+}
+
+static uint32_t _records_per_second(LARGE_INTEGER start, uint32_t count)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)(count * freq.QuadPart /
+        (end.QuadPart - start.QuadPart + 1));
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    bson a, b;
+
+    _record_regular(&a, 1);
+    _record_fast(&b, 1);
+    assert(bson_size(&a) == bson_size(&b));
+    assert(memcmp(bson_data(&a), bson_data(&b), bson_size(&a)) == 0);
+    bson_destroy(&a);
+    bson_destroy(&b);
+
+    // Growing beyond the initial allocation, also of the nesting stack.
+    bson_init_size(&a, 8);
+    bson_init_size(&b, 8);
+    for (uint32_t idx = 0; idx < 40; idx++) {
+        bson_append_start_array(&a, "x");
+        bson_fast_start_array(&b, BSON_KEY("x"));
+        bson_append_string_n(&a, "p", g_path, sizeof(g_path) - 1);
+        bson_fast_string(&b, BSON_KEY("p"), g_path, sizeof(g_path) - 1);
+    }
+    for (uint32_t idx = 0; idx < 40; idx++) {
+        bson_append_finish_array(&a);
+        bson_fast_finish_array(&b);
+    }
+    assert(bson_finish(&a) == BSON_OK);
+    assert(bson_fast_finish(&b) == BSON_OK);
+    assert(bson_size(&a) == bson_size(&b));
+    assert(memcmp(bson_data(&a), bson_data(&b), bson_size(&a)) == 0);
+    bson_destroy(&a);
+    bson_destroy(&b);
+
+    LARGE_INTEGER start; uint32_t length = 0;
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        _record_regular(&a, idx);
+        length += bson_size(&a);
+        bson_destroy(&a);
+    }
+    uint32_t regular = _records_per_second(start, ITERATIONS);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        _record_fast(&b, idx);
+        length -= bson_size(&b);
+        bson_destroy(&b);
+    }
+    uint32_t fast = _records_per_second(start, ITERATIONS);
+
+    assert(length == 0);
+    pipe("INFO:records per second: regular %d, fast %d", regular, fast);
+    pipe("INFO:Test finished!");
+    return 0;
+}
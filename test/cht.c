@@ -0,0 +1,247 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the concurrent hash map with threads that insert, remove, and look
+// up entries at the same time, and benchmarks lookups against a ht_t behind
+// a critical section for various amounts of entries. Also runs natively on
+// the host through "make host-tests".
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hashtable.h"
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define THREADS    16
+#define INSERTS    20000
+#define LOOKUPS    1000000
+
+static cht_t g_cht;
+static ht_t g_ht;
+static CRITICAL_SECTION g_cs;
+static HANDLE g_start;
+
+static uint32_t g_entries;
+static volatile LONG g_errors, g_done;
+
+static uint32_t _elapsed_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+}
+
+// Keys are never zero and values are derived from their key.
+static uint64_t _key(uint32_t index)
+{
+    return (uint64_t) index * 0x9e3779b97f4a7c15 + 1;
+}
+
+static void *_value(uint64_t key)
+{
+    return (void *)(uintptr_t)(key | 1);
+}
+
+// Each writer owns its own keys, half of which it removes again, while the
+// map is being resized underneath it.
+static DWORD WINAPI _thread_writer(LPVOID param)
+{
+    uint32_t base = (uintptr_t) param * INSERTS;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < INSERTS; idx++) {
+        uint64_t key = _key(base + idx);
+        if(cht_insert(&g_cht, key, _value(key)) < 0) {
+            InterlockedIncrement(&g_errors);
+        }
+        if(idx % 2 != 0 &&
+                cht_remove(&g_cht, _key(base + idx - 1)) == NULL) {
+            InterlockedIncrement(&g_errors);
+        }
+    }
+
+    InterlockedIncrement(&g_done);
+    return 0;
+}
+
+// Readers may or may not find a key, but never find the wrong value.
+static DWORD WINAPI _thread_reader(LPVOID param)
+{
+    uint32_t seed = (uintptr_t) param + 1;
+
+    WaitForSingleObject(g_start, INFINITE);
+    while (g_done != THREADS / 2) {
+        seed = seed * 1103515245 + 12345;
+
+        uint64_t key = _key(seed % (THREADS / 2 * INSERTS));
+        void *value = cht_lookup(&g_cht, key);
+        if(value != NULL && value != _value(key)) {
+            InterlockedIncrement(&g_errors);
+        }
+    }
+    return 0;
+}
+
+static DWORD WINAPI _thread_cht(LPVOID param)
+{
+    uint32_t seed = (uintptr_t) param + 1;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < LOOKUPS; idx++) {
+        seed = seed * 1103515245 + 12345;
+
+        uint64_t key = _key(seed % g_entries);
+        if(cht_lookup(&g_cht, key) != _value(key)) {
+            InterlockedIncrement(&g_errors);
+        }
+    }
+    return 0;
+}
+
+static DWORD WINAPI _thread_ht(LPVOID param)
+{
+    uint32_t seed = (uintptr_t) param + 1;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < LOOKUPS; idx++) {
+        seed = seed * 1103515245 + 12345;
+
+        uint64_t key = _key(seed % g_entries);
+        EnterCriticalSection(&g_cs);
+        void **value = ht_lookup(&g_ht, key, NULL);
+        if(value == NULL || *value != _value(key)) {
+            InterlockedIncrement(&g_errors);
+        }
+        LeaveCriticalSection(&g_cs);
+    }
+    return 0;
+}
+
+static uint32_t _run(LPTHREAD_START_ROUTINE fn, LPTHREAD_START_ROUTINE fn2)
+{
+    HANDLE threads[THREADS]; LARGE_INTEGER start;
+
+    g_start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (uintptr_t idx = 0; idx < THREADS; idx++) {
+        threads[idx] = CreateThread(NULL, 0,
+            idx < THREADS / 2 || fn2 == NULL ? fn : fn2,
+            (void *) idx, 0, NULL);
+    }
+
+    QueryPerformanceCounter(&start);
+    SetEvent(g_start);
+
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    CloseHandle(g_start);
+    return _elapsed_ms(start);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    cht_t c; int a = 1, b = 2;
+    assert(cht_init(&c, 0) == 0);
+
+    assert(cht_insert(&c, 42, &a) == 0);
+    assert(cht_lookup(&c, 42) == &a);
+    assert(cht_lookup(&c, 43) == NULL);
+    assert(cht_insert(&c, 42, &b) == 0 && cht_lookup(&c, 42) == &b);
+
+    assert(cht_insert(&c, 0, &a) == -1 && cht_lookup(&c, 0) == NULL);
+    assert(cht_insert(&c, 43, NULL) == -1);
+
+    assert(cht_remove(&c, 42) == &b && cht_lookup(&c, 42) == NULL);
+    assert(cht_remove(&c, 42) == NULL);
+    assert(cht_insert(&c, 42, &a) == 0 && cht_lookup(&c, 42) == &a);
+
+    // Growing well beyond the initial capacity.
+    uint32_t missing = 0;
+    for (uint32_t idx = 0; idx < 100000; idx++) {
+        cht_insert(&c, _key(idx), _value(_key(idx)));
+    }
+    for (uint32_t idx = 0; idx < 100000; idx++) {
+        missing += cht_lookup(&c, _key(idx)) != _value(_key(idx));
+    }
+    assert(missing == 0 && cht_lookup(&c, 42) == &a);
+    cht_free(&c);
+
+    // Half the threads insert and remove entries, the other half looks
+    // them up, all at the same time.
+    assert(cht_init(&g_cht, 0) == 0);
+    uint32_t stress_ms = _run(&_thread_writer, &_thread_reader);
+    pipe("INFO:%d writers and %d readers in %dms",
+        THREADS / 2, THREADS / 2, stress_ms);
+    assert(g_errors == 0);
+
+    missing = 0;
+    for (uint32_t idx = 0; idx < THREADS / 2 * INSERTS; idx++) {
+        void *value = cht_lookup(&g_cht, _key(idx));
+        missing += value != (idx % 2 != 0 ? _value(_key(idx)) : NULL);
+    }
+    assert(missing == 0);
+    cht_free(&g_cht);
+
+    InitializeCriticalSection(&g_cs);
+    for (g_entries = 10000; g_entries <= 1000000; g_entries *= 10) {
+        cht_init(&g_cht, g_entries);
+        ht_init(&g_ht, sizeof(void *));
+
+        for (uint32_t idx = 0; idx < g_entries; idx++) {
+            void *value = _value(_key(idx));
+            cht_insert(&g_cht, _key(idx), value);
+            ht_insert(&g_ht, _key(idx), &value);
+        }
+
+        uint32_t cht_ms = _run(&_thread_cht, NULL);
+        uint32_t ht_ms = _run(&_thread_ht, NULL);
+        pipe("INFO:%d threads doing %d lookups in %d entries each: "
+            "ht_t %dms, cht_t %dms", THREADS, LOOKUPS, g_entries,
+            ht_ms, cht_ms);
+
+        cht_free(&g_cht);
+        ht_free(&g_ht);
+    }
+    assert(g_errors == 0);
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -17,7 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 // This program tests some functionality of our divide-and-conquer
-// implementation.
+// implementation and benchmarks lookups in a list of a million entries.
 
 /// FREE= yes
 /// PIPE= yes
@@ -38,6 +38,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
         pipe("INFO:Test passed: %z", #expr); \
     }
 
+#define BENCH_COUNT 1000000
+
+static uint64_t _xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
 int main()
 {
     pipe_init("\\\\.\\PIPE\\cuckoo", 0);
@@ -51,12 +61,14 @@ int main()
     uint32_t val1[] = {
         1, 6, 4, 8, 13337, 42, 89, 9001, 90,
     };
-    uint32_t val1_sorted[] = {
-        1, 4, 6, 8, 42, 89, 90, 9001, 13337,
+    // Sorted and laid out as a tree with 89 as root, 8 and 9001 as its
+    // children, etc.
+    uint32_t val1_layout[] = {
+        89, 8, 9001, 4, 42, 90, 13337, 1, 6,
     };
 
     dnq_init(&d1, val1, sizeof(uint32_t), sizeof(val1) / sizeof(uint32_t));
-    assert(memcmp(d1.list, val1_sorted, sizeof(val1_sorted)) == 0);
+    assert(memcmp(d1.list, val1_layout, sizeof(val1_layout)) == 0);
     assert(dnq_has32(&d1, 4) == 1);
     assert(dnq_has32(&d1, 0) == 0);
     assert(dnq_has32(&d1, 1) == 1);
@@ -76,12 +88,12 @@ int main()
     uint64_t val2[] = {
         1, 6, 4, 8, 13337, 42, 89, 9001, 90,
     };
-    uint64_t val2_sorted[] = {
-        1, 4, 6, 8, 42, 89, 90, 9001, 13337,
+    uint64_t val2_layout[] = {
+        89, 8, 9001, 4, 42, 90, 13337, 1, 6,
     };
 
     dnq_init(&d2, val2, sizeof(uint64_t), sizeof(val2) / sizeof(uint64_t));
-    assert(memcmp(d2.list, val2_sorted, sizeof(val2_sorted)) == 0);
+    assert(memcmp(d2.list, val2_layout, sizeof(val2_layout)) == 0);
     assert(dnq_has64(&d2, 4) == 1);
     assert(dnq_has64(&d2, 0) == 0);
     assert(dnq_has64(&d2, 1) == 1);
@@ -101,12 +113,12 @@ int main()
     uintptr_t val3[] = {
         1, 6, 4, 8, 13337, 42, 89, 9001, 90,
     };
-    uintptr_t val3_sorted[] = {
-        1, 4, 6, 8, 42, 89, 90, 9001, 13337,
+    uintptr_t val3_layout[] = {
+        89, 8, 9001, 4, 42, 90, 13337, 1, 6,
     };
 
     dnq_init(&d3, val3, sizeof(uintptr_t), sizeof(val3) / sizeof(uintptr_t));
-    assert(memcmp(d3.list, val3_sorted, sizeof(val3_sorted)) == 0);
+    assert(memcmp(d3.list, val3_layout, sizeof(val3_layout)) == 0);
     assert(dnq_hasptr(&d3, 4) == 1);
     assert(dnq_hasptr(&d3, 0) == 0);
     assert(dnq_hasptr(&d3, 1) == 1);
@@ -126,6 +138,53 @@ int main()
     assert(dnq_iter32(&d1)[4] == 42);
     assert(dnq_iter64(&d2)[4] == 42);
     assert(dnq_iterptr(&d3)[4] == 42);
+
+    // Values that differ by more than what fits in an int.
+    dnq_t d4;
+    uint64_t val4[] = {
+        0x100000000, 1, 0xffffffff00000000, 0x80000000,
+    };
+
+    assert(dnq_init(&d4, val4, sizeof(uint64_t), 4) == 0);
+    assert(dnq_has64(&d4, 1) == 1);
+    assert(dnq_has64(&d4, 0x80000000) == 1);
+    assert(dnq_has64(&d4, 0x100000000) == 1);
+    assert(dnq_has64(&d4, 0xffffffff00000000) == 1);
+    assert(dnq_has64(&d4, 0xffffffffffffffff) == 0);
+    assert(dnq_has64(&d4, 0) == 0);
+
+    dnq_t d5;
+    assert(dnq_init(&d5, NULL, sizeof(uint64_t), 0) == 0);
+    assert(dnq_isempty(&d5) != 0);
+    assert(dnq_has64(&d5, 0) == 0);
+
+    // A list as large as the diffing hash whitelist may become. Every other
+    // value is looked up, half of which are present.
+    dnq_t d6; LARGE_INTEGER start, end, freq;
+    uint64_t *list = (uint64_t *) mem_alloc(BENCH_COUNT * sizeof(uint64_t));
+    uint64_t seed = 0x1337, found = 0;
+
+    for (uint32_t idx = 0; idx < BENCH_COUNT; idx++) {
+        list[idx] = _xorshift(&seed) & ~1ull;
+    }
+
+    assert(dnq_init(&d6, list, sizeof(uint64_t), BENCH_COUNT) == 0);
+
+    seed = 0x1337;
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < BENCH_COUNT; idx++) {
+        uint64_t value = _xorshift(&seed) & ~1ull;
+        found += dnq_has64(&d6, value) + dnq_has64(&d6, value | 1);
+    }
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+
+    assert(found == BENCH_COUNT);
+    pipe("INFO:%d lookups in a list of %d entries took %dms",
+        2 * BENCH_COUNT, BENCH_COUNT,
+        (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart));
+
+    mem_free(list);
     pipe("INFO:Test finished!");
     return 0;
 }
@@ -0,0 +1,125 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that buffers which are grown beyond the pool through mem_realloc()
+// are resized in-place, both directly and as the heap of a BSON object.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "bson.h"
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+static uint32_t g_moves;
+
+static void *_bson_malloc(size_t length)
+{
+    return mem_alloc(length);
+}
+
+static void *_bson_realloc(void *ptr, size_t length)
+{
+    void *ret = mem_realloc(ptr, length);
+    g_moves += ret != ptr;
+    return ret;
+}
+
+static void _bson_free(void *ptr)
+{
+    mem_free(ptr);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    mem_stats_t before, after;
+    uint8_t *ptr, *grown;
+
+    // New buffers beyond the pool don't reserve additional address space.
+    ptr = mem_realloc(NULL, MEM_POOL_MAXSIZE);
+    memset(ptr, 0x41, MEM_POOL_MAXSIZE);
+    grown = mem_realloc(ptr, 2 * MEM_POOL_MAXSIZE);
+    assert(grown != ptr && grown[MEM_POOL_MAXSIZE - 1] == 0x41);
+    ptr = grown;
+
+    // Once grown beyond the pool a buffer no longer moves around.
+    uint32_t limit = 2 * MEM_POOL_MAXSIZE * MEM_GROW_FACTOR - 0x1000;
+
+    mem_stats(&before);
+    for (uint32_t length = 2 * MEM_POOL_MAXSIZE; length < limit;
+            length += length / 4) {
+        grown = mem_realloc(ptr, length);
+        assert(grown == ptr && grown[length / 2] == 0x41);
+        memset(grown, 0x41, length);
+    }
+    mem_stats(&after);
+    pipe("INFO:grown to %dkb in-place with %d syscalls",
+        limit / 1024, after.syscalls - before.syscalls);
+
+    // Memory beyond the length is zeroed, even after shrinking.
+    assert(mem_realloc(ptr, 2 * MEM_POOL_MAXSIZE) == ptr);
+    assert(mem_realloc(ptr, limit) == ptr);
+    assert(ptr[2 * MEM_POOL_MAXSIZE] == 0 && ptr[limit - 1] == 0);
+
+    // Growing beyond the reserved address space moves the buffer once.
+    grown = mem_realloc(ptr, MEM_GROW_RESERVE * 2 + limit * 4);
+    assert(grown != NULL && grown != ptr && grown[0] == 0x41);
+    assert(mem_realloc(grown, MEM_GROW_RESERVE * 2 + limit * 5) == grown);
+
+    // Shrinking back into the pool moves the buffer as well.
+    ptr = mem_realloc(grown, 64);
+    assert(ptr != NULL && ptr != grown && ptr[63] == 0x41);
+    mem_free(ptr);
+
+    // A BSON object that grows far beyond its initial size.
+    bson_set_heap_stuff(&_bson_malloc, &_bson_realloc, &_bson_free);
+
+    char key[16]; bson b;
+    bson_init_size(&b, mem_suggested_size(1024));
+    for (uint32_t idx = 0; idx < 100000; idx++) {
+        sprintf(key, "%d", idx);
+        bson_append_string(&b, key, "Hello World, this is a BSON string!");
+    }
+    bson_finish(&b);
+
+    pipe("INFO:bson of %dkb, moved %d times", bson_size(&b) / 1024, g_moves);
+    assert(g_moves < 10);
+    bson_destroy(&b);
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the hash functions, measures their throughput, and checks how well
+// they spread similar keys over the lower and upper bits.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hash.h"
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define KEY_COUNT (1 << 20)
+#define BUCKET_BITS 24
+
+static uint8_t g_buckets[(1 << BUCKET_BITS) / 8];
+
+static uint32_t _elapsed_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+}
+
+static uint64_t _legacy(const void *buf, uint32_t length, uint64_t seed)
+{
+    (void) seed;
+    return hash_buffer(buf, length);
+}
+
+static void _throughput(const char *name,
+    uint64_t (*fn)(const void *, uint32_t, uint64_t))
+{
+    static uint8_t buf[4096]; LARGE_INTEGER start; uint64_t ret = 0;
+    static const uint32_t lengths[] = {8, 32, 256, 4096};
+
+    for (uint32_t idx = 0; idx < sizeof(lengths) / sizeof(uint32_t); idx++) {
+        uint32_t length = lengths[idx], count = (64 << 20) / length;
+
+        QueryPerformanceCounter(&start);
+        for (uint32_t jdx = 0; jdx < count; jdx++) {
+            memcpy(buf, &jdx, sizeof(jdx));
+            ret += fn(buf, length, ret);
+        }
+
+        pipe("INFO:%z: 64mb in %d byte keys in %dms (%x)",
+            name, length, _elapsed_ms(start), (uint32_t) ret);
+    }
+}
+
+// Counts the keys that fall into an already taken bucket, for buckets
+// taken from either the lower or the upper bits of the hash.
+static uint32_t _collisions(uint64_t (*fn)(const void *, uint32_t, uint64_t),
+    int strings, int upper)
+{
+    char key[32]; uint32_t ret = 0, length = sizeof(uint32_t);
+
+    memset(g_buckets, 0, sizeof(g_buckets));
+    for (uint32_t idx = 0; idx < KEY_COUNT; idx++) {
+        memcpy(key, &idx, sizeof(idx));
+        if(strings != 0) {
+            length = sprintf(key, "C:\\file%d.txt", idx);
+        }
+
+        uint64_t hash = fn(key, length, 0);
+        uint32_t bucket = upper != 0 ? hash >> (64 - BUCKET_BITS) :
+            hash & ((1 << BUCKET_BITS) - 1);
+
+        ret += (g_buckets[bucket / 8] >> (bucket % 8)) & 1;
+        g_buckets[bucket / 8] |= 1 << (bucket % 8);
+    }
+    return ret;
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    uint8_t buf[128];
+    for (uint32_t idx = 0; idx < sizeof(buf); idx++) {
+        buf[idx] = (uint8_t) idx;
+    }
+
+    // Every length up to the three lane loop gives a different hash, as do
+    // different seeds.
+    uint32_t duplicates = 0;
+    for (uint32_t idx = 1; idx < sizeof(buf); idx++) {
+        duplicates += hash64(buf, idx, 0) == hash64(buf, idx - 1, 0);
+        duplicates += hash64(buf, idx, 0) == hash64(buf, idx, 1);
+    }
+    assert(duplicates == 0);
+
+    assert(hash64_string("hello", -1) == hash64("hello", 5, 0));
+    assert(hash64_stringW(L"hello", 3) == hash64(L"hel", 6, 0));
+    assert(hash64_string(NULL, -1) == 0);
+
+    // Paths are compared case-insensitively, also past the vectorized part
+    // and past the first chunk.
+    assert(hash64_pathW(L"C:\\Windows\\System32\\KERNEL32.DLL", -1) ==
+        hash64_pathW(L"c:\\windows\\system32\\kernel32.dll", -1));
+    assert(hash64_pathW(L"C:\\a.txt", -1) != hash64_pathW(L"C:\\b.txt", -1));
+    assert(hash64_pathW(L"C:\\a.txt", -1) == hash64_pathW(L"c:\\A.TXT", -1));
+    assert(hash64_pathW(L"@[`{", -1) == hash64_stringW(L"@[`{", -1));
+
+    wchar_t upper[600], lower[600];
+    for (uint32_t idx = 0; idx < 600; idx++) {
+        upper[idx] = 'A' + idx % 26;
+        lower[idx] = 'a' + idx % 26;
+    }
+    assert(hash64_pathW(upper, 600) == hash64_pathW(lower, 600));
+    assert(hash64_pathW(upper, 600) != hash64_pathW(lower, 599));
+
+    // The original hashes remain available for existing hash files.
+    assert(hash_string("a", -1) == ((((uint64_t) 'a' << 7) * 1000003) ^
+        'a' ^ 1));
+    assert(hash_stringW(L"a", -1) == hash_string("a", -1));
+    assert(hash_uint64(0x41) == hash_buffer("A\0\0\0\0\0\0\0", 8));
+
+    _throughput("hash64", &hash64);
+    _throughput("legacy", &_legacy);
+
+    // For random hashes about n^2 / 2m of the n keys collide in m buckets.
+    uint32_t expected = (uint32_t)(
+        (uint64_t) KEY_COUNT * KEY_COUNT / (2 << BUCKET_BITS));
+
+    for (int strings = 0; strings < 2; strings++) {
+        for (int upper = 0; upper < 2; upper++) {
+            uint32_t ours = _collisions(&hash64, strings, upper);
+            uint32_t legacy = _collisions(&_legacy, strings, upper);
+
+            pipe("INFO:%z keys, %z bits: %d collisions, legacy %d, "
+                "expected about %d", strings != 0 ? "string" : "integer",
+                upper != 0 ? "upper" : "lower", ours, legacy, expected);
+            assert(ours < expected + expected / 10);
+        }
+    }
+    pipe("INFO:Test finished!");
+    return 0;
+}
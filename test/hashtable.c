@@ -0,0 +1,165 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the hashtable and benchmarks inserting, looking up, and removing
+// entries in tables of 1K up to 10M entries. Also runs natively on the host
+// through "make host-tests".
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hashtable.h"
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+static uint32_t _elapsed_us(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000000 /
+        freq.QuadPart);
+}
+
+// A bijection, so that every value gets its own hash.
+static uint64_t _hash(uint64_t value)
+{
+    return value * 0x9e3779b97f4a7c15ULL;
+}
+
+static void _benchmark(uint32_t count)
+{
+    LARGE_INTEGER start, single; ht_t ht; uint64_t value, errors = 0;
+    uint32_t insert_us, lookup_us, remove_us, worst_us = 0;
+
+    ht_init(&ht, sizeof(uint64_t));
+
+    // As the table is resized incrementally, no single insertion should
+    // take much longer than any other.
+    QueryPerformanceCounter(&start);
+    for (uint64_t idx = 0; idx < count; idx++) {
+        value = idx * 3;
+
+        QueryPerformanceCounter(&single);
+        errors += ht_insert(&ht, _hash(value), &value);
+        if(_elapsed_us(single) > worst_us) {
+            worst_us = _elapsed_us(single);
+        }
+    }
+    insert_us = _elapsed_us(start);
+
+    // Every other lookup is for an entry that is not present.
+    QueryPerformanceCounter(&start);
+    for (uint64_t idx = 0; idx < count; idx++) {
+        value = idx * 3 + (idx & 1);
+        uint64_t *ptr = ht_lookup(&ht, _hash(value), NULL);
+        errors += (idx & 1) == 0 ? ptr == NULL || *ptr != value : ptr != NULL;
+    }
+    lookup_us = _elapsed_us(start);
+
+    QueryPerformanceCounter(&start);
+    for (uint64_t idx = 0; idx < count; idx++) {
+        value = idx * 3;
+        ht_remove(&ht, _hash(value));
+    }
+    remove_us = _elapsed_us(start);
+
+    pipe("INFO:%d entries: insert %dms (worst %dus), lookup %dms, "
+        "remove %dms", count, insert_us / 1000, worst_us,
+        lookup_us / 1000, remove_us / 1000);
+    assert(errors == 0 && ht.entries == 0);
+    ht_free(&ht);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    ht_t ht; uint32_t length, index = 0; uint64_t hash;
+
+    ht_init(&ht, 8);
+    assert(ht_insert2(&ht, 1, "hello", 6) == 0);
+    assert(ht_insert2(&ht, 2, "world!!", 8) == 0);
+    assert(ht_insert2(&ht, 3, "too long!", 10) == -1);
+    assert(ht_insert2(&ht, 3, "", 0) == -1);
+
+    assert(strcmp(ht_lookup(&ht, 1, &length), "hello") == 0 && length == 6);
+    assert(strcmp(ht_lookup(&ht, 2, NULL), "world!!") == 0);
+    assert(ht_lookup(&ht, 3, NULL) == NULL);
+    assert(ht_contains(&ht, 1) == 1 && ht_contains(&ht, 3) == 0);
+
+    // Inserting an existing hash replaces its data.
+    assert(ht_insert2(&ht, 1, "hoi", 4) == 0);
+    assert(strcmp(ht_lookup(&ht, 1, &length), "hoi") == 0 && length == 4);
+    assert(ht.entries == 2);
+
+    ht_remove(&ht, 1);
+    assert(ht_contains(&ht, 1) == 0 && ht_contains(&ht, 2) == 1);
+
+    assert(ht_next_key(&ht, &index, &hash) == 0 && hash == 2);
+    assert(ht_next_key(&ht, &index, &hash) == -1);
+
+    // Enough hashes that collide in their lower bits to resize the table a
+    // few times, while removing half of them along the way.
+    uint32_t errors = 0, found = 0;
+    for (uint64_t idx = 0; idx < 10000; idx++) {
+        errors += ht_insert(&ht, idx << 32, &idx) != 0;
+        if((idx & 1) != 0) {
+            ht_remove(&ht, (idx - 1) << 32);
+        }
+    }
+    assert(errors == 0);
+
+    for (uint64_t idx = 0; idx < 10000; idx++) {
+        uint64_t *ptr = ht_lookup(&ht, idx << 32, NULL);
+        found += ptr != NULL && *ptr == idx && (idx & 1) != 0;
+    }
+    assert(found == 5000 && ht.entries == 5001);
+
+    // Every entry is returned once, also while the table is being resized.
+    uint32_t keys = 0; index = 0;
+    while (ht_next_key(&ht, &index, &hash) == 0) {
+        keys++;
+    }
+    assert(keys == ht.entries);
+    ht_free(&ht);
+
+    for (uint32_t count = 1000; count <= 10000000; count *= 10) {
+        _benchmark(count);
+    }
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the per-thread registration of active hook handlers that decides
+// whether a hooked call is made from within the monitor, as well as the
+// entry gate that performs the same check before entering the hook handler.
+// Reports the time spent per hooked call for each approach.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <windows.h>
+#include "hooking.h"
+#include "log.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 1000000
+
+// Mimics a hook handler that calls another hooked function. Optionally it
+// is left without calling hook_leave(), as happens when an exception unwinds
+// the stack.
+static int _handler(int nested, int unwind)
+{
+    hook_frame_t hook_frame;
+    if(hook_enter(&hook_frame) != 0) {
+        return 1;
+    }
+
+    if(unwind != 0) {
+        return 0;
+    }
+
+    int ret = nested != 0 ? _handler(nested - 1, 0) : 0;
+    hook_leave(&hook_frame);
+    return ret;
+}
+
+// Mimics a hook handler with more local variables than _handler(), so that
+// its frame lies further down the stack than that of _handler().
+static int _sibling()
+{
+    hook_frame_t *hook_frame = alloca(sizeof(hook_frame_t) + 256);
+    if(hook_enter(hook_frame) != 0) {
+        return 1;
+    }
+
+    hook_leave(hook_frame);
+    return 0;
+}
+
+static int (WINAPI *Old_gated)(int value);
+static int (WINAPI *Old_ungated)(int value);
+static int (WINAPI *Old_active)(int value);
+
+static uint32_t g_entered, g_logged;
+
+static int WINAPI _gated(int value)
+{
+    return value + 1;
+}
+
+static int WINAPI _ungated(int value)
+{
+    return value + 1;
+}
+
+static int WINAPI _active(int value)
+{
+    return value + 1;
+}
+
+static int WINAPI New_gated(int value)
+{
+    g_entered++;
+
+    hook_frame_t hook_frame;
+    if(hook_enter(&hook_frame) != 0) {
+        return Old_gated(value);
+    }
+
+    g_logged++;
+    int ret = Old_gated(value);
+    hook_leave(&hook_frame);
+    return ret;
+}
+
+static int WINAPI New_ungated(int value)
+{
+    g_entered++;
+
+    hook_frame_t hook_frame;
+    if(hook_enter(&hook_frame) != 0) {
+        return Old_ungated(value);
+    }
+
+    g_logged++;
+    int ret = Old_ungated(value);
+    hook_leave(&hook_frame);
+    return ret;
+}
+
+static int WINAPI New_active(int value)
+{
+    g_entered++;
+
+    hook_frame_t hook_frame;
+    if(hook_enter(&hook_frame) != 0) {
+        return Old_active(value);
+    }
+
+    // Behaves like a hook with Pre or Post code, which has to run even when
+    // the hook is disabled, and only logs if it is not.
+    if(hook_is_disabled(2) == 0) {
+        g_logged++;
+    }
+
+    int ret = Old_active(value);
+    hook_leave(&hook_frame);
+    return ret;
+}
+
+static hook_t g_hooks[] = {
+    {
+        "hookdepth", "gated",
+        (FARPROC) &New_gated, (FARPROC *) &Old_gated,
+        .addr = (uint8_t *) &_gated,
+        .index = 0,
+        .log_only = 1,
+    },
+    {
+        "hookdepth", "ungated",
+        (FARPROC) &New_ungated, (FARPROC *) &Old_ungated,
+        .addr = (uint8_t *) &_ungated,
+        .index = 1,
+
+        // Special hooks have no entry gate.
+        .special = 1,
+    },
+    {
+        "hookdepth", "active",
+        (FARPROC) &New_active, (FARPROC *) &Old_active,
+        .addr = (uint8_t *) &_active,
+        .index = 2,
+    },
+};
+
+static uint32_t _elapsed_ns(LARGE_INTEGER start, uint32_t count)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000000000 /
+        freq.QuadPart / count);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+    hook_init2();
+
+    assert(_handler(0, 0) == 0);
+    assert(_handler(1, 0) == 1);
+    assert(_handler(4, 0) == 1);
+    assert(_handler(0, 0) == 0);
+
+    assert(_handler(0, 1) == 0);
+    assert(_handler(0, 0) == 0);
+    assert(_handler(1, 0) == 1);
+
+    // A frame left behind by a sibling call at the same depth, which lies
+    // above the frame of the next hook handler but below its return address.
+    assert(_handler(0, 1) == 0);
+    assert(_sibling() == 0);
+    assert(_sibling() == 0);
+
+    // Calls made by a monitor thread are never logged.
+    hook_frame_t frame;
+    assert(hook_enter(&frame) == 0);
+    assert(_handler(0, 0) == 1);
+    hook_leave(&frame);
+    assert(_handler(0, 0) == 0);
+
+    assert(hook(&g_hooks[0], GetModuleHandle(NULL)) == 0);
+    assert(hook(&g_hooks[1], GetModuleHandle(NULL)) == 0);
+    assert(hook(&g_hooks[2], GetModuleHandle(NULL)) == 0);
+
+    assert(_gated(1) == 2 && g_entered == 1 && g_logged == 1);
+    assert(_ungated(1) == 2 && g_entered == 2 && g_logged == 2);
+
+    // Nested calls do not even enter the hook handler of a gated hook.
+    assert(hook_enter(&frame) == 0);
+    assert(_gated(1) == 2 && g_entered == 2 && g_logged == 2);
+    assert(_ungated(1) == 2 && g_entered == 3 && g_logged == 2);
+    hook_leave(&frame);
+
+    hook_disable(g_hooks[0].index, 1);
+    assert(_gated(1) == 2 && g_entered == 3 && g_logged == 2);
+    hook_disable(g_hooks[0].index, 0);
+    assert(_gated(1) == 2 && g_entered == 4 && g_logged == 3);
+
+    // Hooks that do more than logging still run their hook handler.
+    hook_disable(g_hooks[2].index, 1);
+    assert(_active(1) == 2 && g_entered == 5 && g_logged == 3);
+    hook_disable(g_hooks[2].index, 0);
+    assert(_active(1) == 2 && g_entered == 6 && g_logged == 4);
+
+    uint32_t index = sig_index_firsthookidx();
+    while (strcmp(sig_apiname(index), "NtDelayExecution") != 0) {
+        index++;
+    }
+
+    hook_disable_apis("GetTickCount, NtDelayExecution");
+    assert(hook_is_disabled(index) != 0);
+    hook_disable_apis("-GetTickCount,+NtDelayExecution,Unknown");
+    assert(hook_is_disabled(index) == 0);
+
+    LARGE_INTEGER start; volatile int sink = 0;
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += hook_in_monitor();
+    }
+    uint32_t stacktrace_ns = _elapsed_ns(start, ITERATIONS);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += _handler(0, 0);
+    }
+    uint32_t frame_ns = _elapsed_ns(start, ITERATIONS);
+
+    assert(hook_enter(&frame) == 0);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += _ungated(idx);
+    }
+    uint32_t ungated_ns = _elapsed_ns(start, ITERATIONS);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += _gated(idx);
+    }
+    uint32_t gated_ns = _elapsed_ns(start, ITERATIONS);
+
+    hook_leave(&frame);
+
+    pipe("INFO:per hooked call: stacktrace %dns, frame %dns",
+        stacktrace_ns, frame_ns);
+    pipe("INFO:per nested hooked call: hook handler %dns, entry gate %dns",
+        ungated_ns, gated_ns);
+    pipe("INFO:Test finished!");
+    return 0;
+}
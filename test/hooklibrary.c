@@ -0,0 +1,137 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that the per-library index generated at build time finds exactly
+// the hooks of each library and reports the time spent per library lookup
+// compared to scanning all hooks.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 100000
+
+static const char *g_libraries[] = {
+    "ntdll", "KERNEL32", "KernelBase", "user32", "gdi32", "ole32",
+    "oleaut32", "shell32", "comctl32", "msvcrt", "wininet", "vbe6",
+};
+
+#define LIBRARY_COUNT (sizeof(g_libraries) / sizeof(g_libraries[0]))
+
+static uint32_t _scan(const char *library)
+{
+    uint32_t ret = 0;
+    for (hook_t *h = sig_hooks(); h->funcname != NULL; h++) {
+        if(stricmp(h->library, library) == 0) {
+            ret++;
+        }
+    }
+    return ret;
+}
+
+static uint32_t _lookup(const char *library)
+{
+    hook_t *h; uint32_t count;
+
+    int32_t index = sig_library_index(library);
+    if(index < 0) {
+        return 0;
+    }
+
+    sig_library(index, &h, &count);
+    return count;
+}
+
+static uint32_t _elapsed_ns(LARGE_INTEGER start, uint32_t count)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000000000 /
+        freq.QuadPart / count);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    // The ranges of all libraries cover every hook exactly once.
+    uint32_t total = 0, failures = 0;
+    for (uint32_t idx = 0; idx < sig_library_count(); idx++) {
+        hook_t *h; uint32_t count;
+        const char *library = sig_library(idx, &h, &count);
+
+        if(h != sig_hooks() + total || count == 0 ||
+                sig_library_index(library) != (int32_t) idx ||
+                _scan(library) != count) {
+            failures++;
+        }
+
+        for (; count != 0; h++, count--, total++) {
+            if(stricmp(h->library, library) != 0) {
+                failures++;
+            }
+        }
+    }
+    assert(failures == 0);
+    assert(sig_hooks()[total].funcname == NULL);
+
+    for (uint32_t idx = 0; idx < LIBRARY_COUNT; idx++) {
+        if(_lookup(g_libraries[idx]) != _scan(g_libraries[idx])) {
+            failures++;
+        }
+    }
+    assert(failures == 0);
+
+    assert(sig_library_index("kernel32") == sig_library_index("KERNEL32"));
+    assert(sig_library_index("kernel32") >= 0);
+    assert(sig_library_index("kernel") < 0);
+    assert(sig_library_index("") < 0);
+
+    LARGE_INTEGER start; volatile uint32_t sink = 0;
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += _scan(g_libraries[idx % LIBRARY_COUNT]);
+    }
+    uint32_t scan_ns = _elapsed_ns(start, ITERATIONS);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        sink += _lookup(g_libraries[idx % LIBRARY_COUNT]);
+    }
+    uint32_t lookup_ns = _elapsed_ns(start, ITERATIONS);
+
+    pipe("INFO:per library: scan %dns, index %dns", scan_ns, lookup_ns);
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,32 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host stand-in for inc/hooking.h. There is nothing to hook on the host.
+
+#ifndef MONITOR_HOOKING_H
+#define MONITOR_HOOKING_H
+
+#include <windows.h>
+
+static inline int hook_init(HMODULE module_handle)
+{
+    (void) module_handle;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host implementations of the Win32 and native API stand-ins in this
+// directory, see also the "host-tests" target in the Makefile.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "windows.h"
+#include "native.h"
+#include "pipe.h"
+
+#define RESERVATIONS 4096
+
+typedef struct _reservation_t {
+    uint8_t *base;
+    uintptr_t size;
+} reservation_t;
+
+typedef struct _handle_t {
+    pthread_t thread;
+    LPTHREAD_START_ROUTINE fn;
+    LPVOID param;
+    int is_event;
+    volatile LONG signaled;
+} handle_t;
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static reservation_t g_reservations[RESERVATIONS];
+static volatile LONG g_tls_index;
+static volatile LONG g_failures;
+
+// Stand-in for the TEB, which only has to be large enough for the TLS
+// slots that teb_slot() addresses through it.
+static __thread void *g_teb[0x2000 / sizeof(void *)];
+
+static void _exit_status()
+{
+    fflush(stdout);
+    if(g_failures != 0) {
+        _exit(1);
+    }
+}
+
+void pipe_init(const char *pipe_name, int pipe_pid)
+{
+    (void) pipe_name; (void) pipe_pid;
+    atexit(&_exit_status);
+}
+
+static void _pipe_unicode(const wchar_t *s, int length)
+{
+    for (int idx = 0; idx < length; idx++) {
+        putchar(s[idx] < 0x80 ? s[idx] : '?');
+    }
+}
+
+int pipe(const char *fmt, ...)
+{
+    va_list args; const char *s; const wchar_t *w; int length;
+
+    if(strncmp(fmt, "CRITICAL:", 9) == 0) {
+        InterlockedIncrement(&g_failures);
+    }
+
+    pthread_mutex_lock(&g_mutex);
+    va_start(args, fmt);
+    for (; *fmt != 0; fmt++) {
+        if(*fmt != '%') {
+            putchar(*fmt);
+            continue;
+        }
+
+        switch (*++fmt) {
+        case 'z':
+            fputs(va_arg(args, const char *), stdout);
+            break;
+
+        case 'Z':
+            w = va_arg(args, const wchar_t *);
+            _pipe_unicode(w, lstrlenW(w));
+            break;
+
+        case 's':
+            length = va_arg(args, int);
+            s = va_arg(args, const char *);
+            printf("%.*s", length < 0 ? (int) strlen(s) : length, s);
+            break;
+
+        case 'S':
+            length = va_arg(args, int);
+            w = va_arg(args, const wchar_t *);
+            _pipe_unicode(w, length < 0 ? lstrlenW(w) : length);
+            break;
+
+        case 'd':
+            printf("%u", va_arg(args, uint32_t));
+            break;
+
+        case 'x':
+            printf("%x", va_arg(args, uint32_t));
+            break;
+
+        case 'X':
+            printf("%llx", (unsigned long long) va_arg(args, uint64_t));
+            break;
+
+        case 'p':
+            printf("%p", va_arg(args, void *));
+            break;
+        }
+    }
+    va_end(args);
+
+    putchar('\n');
+    pthread_mutex_unlock(&g_mutex);
+    return 0;
+}
+
+int native_init()
+{
+    return 0;
+}
+
+uintptr_t readtls(uint32_t index)
+{
+    (void) index;
+    return (uintptr_t) g_teb;
+}
+
+uint32_t get_tick_count()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+uint32_t get_current_thread_id()
+{
+    return (uint32_t) syscall(SYS_gettid);
+}
+
+DWORD GetCurrentThreadId()
+{
+    return get_current_thread_id();
+}
+
+DWORD TlsAlloc()
+{
+    LONG index = InterlockedIncrement(&g_tls_index) - 1;
+    return index < TLS_MINIMUM_AVAILABLE ? (DWORD) index : TLS_OUT_OF_INDEXES;
+}
+
+BOOL TlsFree(DWORD index)
+{
+    (void) index;
+    return TRUE;
+}
+
+// Reserved address space is inaccessible until it is committed. As on
+// Windows, committed pages read as zero until they are first written,
+// also after having been decommitted.
+void *virtual_alloc(void *addr, uintptr_t size,
+    uint32_t allocation_type, uint32_t protection)
+{
+    (void) protection;
+
+    if((allocation_type & MEM_RESERVE) != 0 && addr == NULL) {
+        addr = mmap(NULL, size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(addr == MAP_FAILED) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&g_mutex);
+        for (uint32_t idx = 0; idx < RESERVATIONS; idx++) {
+            if(g_reservations[idx].base == NULL) {
+                g_reservations[idx].base = addr;
+                g_reservations[idx].size = size;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&g_mutex);
+    }
+
+    if((allocation_type & MEM_COMMIT) != 0 &&
+            mprotect(addr, size, PROT_READ | PROT_WRITE) < 0) {
+        return NULL;
+    }
+    return addr;
+}
+
+void *virtual_alloc_rw(void *addr, uintptr_t size)
+{
+    return virtual_alloc(addr, size, MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+}
+
+int virtual_free(const void *addr, uintptr_t size, uint32_t free_type)
+{
+    if(free_type == MEM_DECOMMIT) {
+        madvise((void *) addr, size, MADV_DONTNEED);
+        return mprotect((void *) addr, size, PROT_NONE) == 0;
+    }
+
+    pthread_mutex_lock(&g_mutex);
+    for (uint32_t idx = 0; idx < RESERVATIONS; idx++) {
+        if(g_reservations[idx].base == addr) {
+            size = g_reservations[idx].size;
+            g_reservations[idx].base = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_mutex);
+
+    return size != 0 && munmap((void *) addr, size) == 0;
+}
+
+NTSTATUS virtual_protect(const void *addr, uintptr_t size,
+    uint32_t protection)
+{
+    int prot = protection == PAGE_NOACCESS ? PROT_NONE :
+        protection == PAGE_READONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    return mprotect((void *) addr, size, prot) == 0 ? 0 : -1;
+}
+
+static void *_thread(void *param)
+{
+    handle_t *h = (handle_t *) param;
+    h->fn(h->param);
+    return NULL;
+}
+
+HANDLE CreateThread(void *attributes, SIZE_T stack_size,
+    LPTHREAD_START_ROUTINE fn, LPVOID param, DWORD flags, DWORD *tid)
+{
+    (void) attributes; (void) stack_size; (void) flags; (void) tid;
+
+    handle_t *h = (handle_t *) calloc(1, sizeof(handle_t));
+    h->fn = fn;
+    h->param = param;
+    if(pthread_create(&h->thread, NULL, &_thread, h) != 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+HANDLE CreateEvent(void *attributes, BOOL manual_reset, BOOL initial_state,
+    const char *name)
+{
+    (void) attributes; (void) manual_reset; (void) name;
+
+    handle_t *h = (handle_t *) calloc(1, sizeof(handle_t));
+    h->is_event = 1;
+    h->signaled = initial_state;
+    return h;
+}
+
+BOOL SetEvent(HANDLE event_handle)
+{
+    InterlockedExchange(&((handle_t *) event_handle)->signaled, 1);
+    return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+    handle_t *h = (handle_t *) handle; (void) milliseconds;
+
+    if(h->is_event == 0) {
+        pthread_join(h->thread, NULL);
+        return 0;
+    }
+
+    while (h->signaled == 0) {
+        sched_yield();
+    }
+    return 0;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+    free(handle);
+    return TRUE;
+}
@@ -0,0 +1,34 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host stand-in for inc/misc.h. Threads are never known to have exited, so
+// their per-thread state is only handed over when they release it.
+
+#ifndef MONITOR_MISC_H
+#define MONITOR_MISC_H
+
+#include <stdint.h>
+
+static inline int teb_slot_owner_alive(uint32_t thread_identifier,
+    uint32_t index, uintptr_t value)
+{
+    (void) thread_identifier; (void) index; (void) value;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host stand-in for inc/native.h, see also windows.h in this directory.
+
+#ifndef MONITOR_NATIVE_H
+#define MONITOR_NATIVE_H
+
+#include <stdint.h>
+#include <windows.h>
+
+typedef struct _last_error_t {
+    uint32_t nt_status;
+    uint32_t lasterror;
+} last_error_t;
+
+// Each thread has a zero-initialized stand-in for its TEB.
+#define TLS_TEB 0
+uintptr_t readtls(uint32_t index);
+
+int native_init();
+
+void *virtual_alloc(void *addr, uintptr_t size,
+    uint32_t allocation_type, uint32_t protection);
+void *virtual_alloc_rw(void *addr, uintptr_t size);
+int virtual_free(const void *addr, uintptr_t size, uint32_t free_type);
+NTSTATUS virtual_protect(const void *addr, uintptr_t size,
+    uint32_t protection);
+
+uint32_t get_tick_count();
+uint32_t get_current_thread_id();
+
+#endif
@@ -0,0 +1,36 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host stand-in for inc/pipe.h. Messages go to stdout, and unittests exit
+// with a non-zero status once a "CRITICAL:" message has been sent. The
+// renames keep clear of pipe(2).
+
+#ifndef MONITOR_PIPE_H
+#define MONITOR_PIPE_H
+
+#include <stdint.h>
+
+#define pipe_init host_pipe_init
+#define pipe host_pipe
+
+void pipe_init(const char *pipe_name, int pipe_pid);
+int pipe(const char *fmt, ...);
+
+#define dpipe(fmt, ...) (void)0
+
+#endif
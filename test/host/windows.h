@@ -0,0 +1,225 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The subset of the Win32 API that the allocator, the hash tables, and
+// their unittests use, implemented on top of POSIX threads and the gcc
+// atomic builtins. Together with the other headers in this directory it
+// lets these unittests build and run natively on the host, see the
+// "host-tests" target in the Makefile.
+
+#ifndef MONITOR_HOST_WINDOWS_H
+#define MONITOR_HOST_WINDOWS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define WINAPI
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xffffffff
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef int32_t NTSTATUS;
+typedef wchar_t WCHAR;
+typedef size_t SIZE_T;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef void *HANDLE;
+typedef void *HMODULE;
+
+typedef union _LARGE_INTEGER {
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _SYSTEM_INFO {
+    DWORD dwPageSize;
+    DWORD dwAllocationGranularity;
+} SYSTEM_INFO;
+
+typedef struct _CRITICAL_SECTION {
+    pthread_mutex_t mutex;
+} CRITICAL_SECTION;
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID param);
+
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_DECOMMIT 0x4000
+#define MEM_RELEASE 0x8000
+
+#define PAGE_NOACCESS 0x01
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define PAGE_EXECUTE_READWRITE 0x40
+
+#define TLS_MINIMUM_AVAILABLE 64
+#define TLS_OUT_OF_INDEXES ((DWORD) 0xffffffff)
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+static inline LONG InterlockedCompareExchange(volatile LONG *ptr,
+    LONG value, LONG comparand)
+{
+    return __sync_val_compare_and_swap(ptr, comparand, value);
+}
+
+static inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG *ptr,
+    LONGLONG value, LONGLONG comparand)
+{
+    return __sync_val_compare_and_swap(ptr, comparand, value);
+}
+
+static inline void *InterlockedCompareExchangePointer(
+    void * volatile *ptr, void *value, void *comparand)
+{
+    return __sync_val_compare_and_swap(ptr, comparand, value);
+}
+
+static inline LONG InterlockedExchange(volatile LONG *ptr, LONG value)
+{
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline void *InterlockedExchangePointer(void * volatile *ptr,
+    void *value)
+{
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedExchangeAdd(volatile LONG *ptr, LONG value)
+{
+    return __sync_fetch_and_add(ptr, value);
+}
+
+static inline LONG InterlockedIncrement(volatile LONG *ptr)
+{
+    return __sync_add_and_fetch(ptr, 1);
+}
+
+static inline LONG InterlockedDecrement(volatile LONG *ptr)
+{
+    return __sync_sub_and_fetch(ptr, 1);
+}
+
+static inline LONG InterlockedOr(volatile LONG *ptr, LONG value)
+{
+    return __sync_fetch_and_or(ptr, value);
+}
+
+static inline LONG InterlockedAnd(volatile LONG *ptr, LONG value)
+{
+    return __sync_fetch_and_and(ptr, value);
+}
+
+static inline void YieldProcessor()
+{
+    __builtin_ia32_pause();
+}
+
+static inline void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_init(&cs->mutex, NULL);
+}
+
+static inline void DeleteCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_destroy(&cs->mutex);
+}
+
+static inline void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_lock(&cs->mutex);
+}
+
+static inline void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_unlock(&cs->mutex);
+}
+
+static inline void GetSystemInfo(SYSTEM_INFO *info)
+{
+    info->dwPageSize = 0x1000;
+    info->dwAllocationGranularity = 0x10000;
+}
+
+static inline HMODULE GetModuleHandle(const char *name)
+{
+    (void) name;
+    return NULL;
+}
+
+static inline void QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter->QuadPart = (LONGLONG) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+    frequency->QuadPart = 1000000000;
+}
+
+static inline void Sleep(DWORD milliseconds)
+{
+    struct timespec ts = {
+        milliseconds / 1000, (milliseconds % 1000) * 1000000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+// Not wcslen(), as wchar_t may be built with -fshort-wchar.
+static inline int lstrlenW(const wchar_t *s)
+{
+    int ret = 0;
+    while (s[ret] != 0) {
+        ret++;
+    }
+    return ret;
+}
+
+DWORD TlsAlloc();
+BOOL TlsFree(DWORD index);
+DWORD GetCurrentThreadId();
+
+// Threads and manual-reset events, which are all the unittests need.
+HANDLE CreateThread(void *attributes, SIZE_T stack_size,
+    LPTHREAD_START_ROUTINE fn, LPVOID param, DWORD flags, DWORD *tid);
+HANDLE CreateEvent(void *attributes, BOOL manual_reset, BOOL initial_state,
+    const char *name);
+BOOL SetEvent(HANDLE event_handle);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+BOOL CloseHandle(HANDLE handle);
+
+#endif
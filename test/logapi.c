@@ -0,0 +1,232 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that the unrolled serializers, as generated by utils/process.py for
+// each hook, log the same arguments as the log_api() format string
+// interpreter, and compares the time spent per event by both.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "bson.h"
+#include "hooking.h"
+#include "hooks.h"
+#include "log.h"
+#include "memory.h"
+#include "misc.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 100000
+#define STREAMSIZE (64 * 1024 * 1024)
+
+static const wchar_t *g_pipe_name = L"\\\\.\\PIPE\\logapi-test";
+
+static HANDLE g_pipe;
+static uint8_t *g_stream;
+static volatile uint32_t g_stream_length;
+
+static DWORD WINAPI _thread_reader(LPVOID param)
+{
+    DWORD length; (void) param;
+
+    ConnectNamedPipe(g_pipe, NULL);
+    while (g_stream_length < STREAMSIZE &&
+            ReadFile(g_pipe, g_stream + g_stream_length,
+                STREAMSIZE - g_stream_length, &length, NULL) != FALSE) {
+        g_stream_length += length;
+    }
+    return 0;
+}
+
+// What utils/process.py generates for the __anomaly__ signature ("isss").
+static void _log_anomaly_unrolled(uint32_t tid, const char *subcategory,
+    const char *funcname, const char *msg)
+{
+    bson b;
+
+    if(log_api_start(&b, sig_index_anomaly(), 1, 0, 0, NULL) < 0) {
+        return;
+    }
+
+    log_int32(&b, "2", tid);
+    log_arg_string(&b, "3", subcategory);
+    log_arg_string(&b, "4", funcname);
+    log_arg_string(&b, "5", msg);
+
+    log_api_finish(&b);
+}
+
+// Returns the arguments of the records of the given signature in the log
+// stream, optionally only those that have the given message.
+static uint32_t _find_args(uint32_t index, const char *msg,
+    const char **args, uint32_t count)
+{
+    uint32_t ret = 0, offset = 4;
+    bson_iterator it, it2; bson b;
+
+    // Skip the process identifier and the "BSON <pid>" header.
+    while (offset < g_stream_length && g_stream[offset++] != '\n');
+
+    while (offset + 4 <= g_stream_length && ret < count) {
+        uint32_t length = *(uint32_t *)(g_stream + offset);
+        bson_init_finished_data(&b, (char *) g_stream + offset, 0);
+        offset += length;
+
+        if(bson_find(&it, &b, "type") != BSON_EOO ||
+                bson_find(&it, &b, "I") == BSON_EOO ||
+                (uint32_t) bson_iterator_int(&it) != index ||
+                bson_find(&it, &b, "args") == BSON_EOO) {
+            continue;
+        }
+
+        if(msg == NULL) {
+            args[ret++] = bson_iterator_value(&it);
+            continue;
+        }
+
+        bson_iterator_subiterator(&it, &it2);
+        while (bson_iterator_next(&it2) != BSON_EOO) {
+            if(strcmp(bson_iterator_key(&it2), "5") == 0 &&
+                    strcmp(bson_iterator_string(&it2), msg) == 0) {
+                args[ret++] = bson_iterator_value(&it);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+// Both serializers should produce exactly the same arguments.
+static int _compare_args(uint32_t index, const char *msg)
+{
+    const char *args[2];
+
+    log_flush();
+
+    for (uint32_t tries = 0; tries < 500; tries++) {
+        if(_find_args(index, msg, args, 2) == 2) {
+            break;
+        }
+        Sleep(10);
+    }
+
+    return _find_args(index, msg, args, 2) == 2 &&
+        *(uint32_t *) args[0] == *(uint32_t *) args[1] &&
+        memcmp(args[0], args[1], *(uint32_t *) args[0]) == 0;
+}
+
+static uint32_t _elapsed_ns(LARGE_INTEGER start, uint32_t count)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000000000 /
+        freq.QuadPart / count);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+    misc_init("hoi");
+    copy_init();
+
+    g_stream = VirtualAlloc(NULL, STREAMSIZE, MEM_COMMIT|MEM_RESERVE,
+        PAGE_READWRITE);
+    g_pipe = CreateNamedPipeW(g_pipe_name, PIPE_ACCESS_INBOUND,
+        PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0, 0x10000, 0, NULL);
+    assert(g_stream != NULL && g_pipe != INVALID_HANDLE_VALUE);
+
+    CreateThread(NULL, 0, &_thread_reader, NULL, 0, NULL);
+
+    char pipe_name[64];
+    sprintf(pipe_name, "%S", g_pipe_name);
+    log_init(pipe_name, 0, 0, 0);
+
+    log_api(sig_index_anomaly(), 1, 0, 0, NULL, 1234, "logapi", NULL,
+        "equal");
+    _log_anomaly_unrolled(1234, "logapi", NULL, "equal");
+    assert(_compare_args(sig_index_anomaly(), "equal") != 0);
+
+    // Hooks are only logged once logging has been triggered.
+    g_monitor_logging = 1;
+
+    // A flags argument and a buffer with the limitation override ("!b"),
+    // which is beyond the limit and thus dumped separately.
+    static uint8_t buffer[2*4096];
+    memset(buffer, 0x41, sizeof(buffer));
+
+    log_api(SIG_advapi32_CryptDecrypt, 1, 1, 0, NULL, (uintptr_t) 0x1234,
+        (uintptr_t) 0, TRUE, CRYPT_OAEP, (uintptr_t) sizeof(buffer), buffer);
+    log_advapi32_CryptDecrypt(1, 1, 0, NULL, 0x1234, 0, TRUE, CRYPT_OAEP,
+        sizeof(buffer), buffer);
+    assert(_compare_args(SIG_advapi32_CryptDecrypt, NULL) != 0);
+
+    // Pointer arguments, the flags of the Flags section, and a failure.
+    last_error_t lasterror = {STATUS_ACCESS_DENIED, ERROR_ACCESS_DENIED};
+    uintptr_t base = 0x10000, size = 0x2000;
+
+    log_api(SIG_ntdll_NtAllocateVirtualMemory, 0, STATUS_ACCESS_DENIED, 0,
+        &lasterror, (uintptr_t) GetCurrentProcess(), &base, &size,
+        MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE, 0, 0, 0, 1234);
+    log_ntdll_NtAllocateVirtualMemory(0, STATUS_ACCESS_DENIED, 0,
+        &lasterror, (uintptr_t) GetCurrentProcess(), &base, &size,
+        MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READWRITE, 0, 0, 0, 1234);
+    assert(_compare_args(SIG_ntdll_NtAllocateVirtualMemory, NULL) != 0);
+
+    LARGE_INTEGER start;
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        log_api(sig_index_anomaly(), 1, 0, 0, NULL, idx, "logapi",
+            "interpreted", "benchmark");
+    }
+    uint32_t interpreted_ns = _elapsed_ns(start, ITERATIONS);
+    log_flush();
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        _log_anomaly_unrolled(idx, "logapi", "unrolled", "benchmark");
+    }
+    uint32_t unrolled_ns = _elapsed_ns(start, ITERATIONS);
+    log_flush();
+
+    pipe("INFO:per event: log_api() %dns, unrolled %dns",
+        interpreted_ns, unrolled_ns);
+
+    log_exit();
+    pipe("INFO:Test finished!");
+    return 0;
+}
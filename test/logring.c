@@ -0,0 +1,219 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that records logged by many threads at once arrive in the log pipe
+// in order, both through the per-thread rings and once logging has become
+// synchronous, and compares the time the logging threads spend on it.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "bson.h"
+#include "hooking.h"
+#include "log.h"
+#include "memory.h"
+#include "misc.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define THREADS    8
+#define RECORDS    5000
+#define STREAMSIZE (64 * 1024 * 1024)
+
+static const wchar_t *g_pipe_name = L"\\\\.\\PIPE\\logring-test";
+
+static HANDLE g_pipe, g_start;
+static uint8_t *g_stream;
+static volatile uint32_t g_stream_length;
+static uint32_t g_round;
+
+static uint32_t _elapsed_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+}
+
+static DWORD WINAPI _thread_reader(LPVOID param)
+{
+    DWORD length; (void) param;
+
+    ConnectNamedPipe(g_pipe, NULL);
+    while (g_stream_length < STREAMSIZE &&
+            ReadFile(g_pipe, g_stream + g_stream_length,
+                STREAMSIZE - g_stream_length, &length, NULL) != FALSE) {
+        g_stream_length += length;
+    }
+    return 0;
+}
+
+static DWORD WINAPI _thread_logger(LPVOID param)
+{
+    char thread[16], counter[16];
+
+    sprintf(thread, "%d", (uint32_t)(uintptr_t) param);
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < RECORDS; idx++) {
+        sprintf(counter, "%d", g_round * RECORDS + idx);
+        log_anomaly("logring", thread, counter);
+    }
+    return 0;
+}
+
+static uint32_t _run()
+{
+    HANDLE threads[THREADS]; LARGE_INTEGER start;
+
+    g_start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (uintptr_t idx = 0; idx < THREADS; idx++) {
+        threads[idx] = CreateThread(NULL, 0, &_thread_logger,
+            (void *) idx, 0, NULL);
+    }
+
+    QueryPerformanceCounter(&start);
+    SetEvent(g_start);
+
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    CloseHandle(g_start);
+    g_round++;
+    return _elapsed_ms(start);
+}
+
+// Waits until the given marker shows up in the log stream.
+static int _wait_for(const char *marker)
+{
+    uint32_t length = strlen(marker);
+
+    for (uint32_t tries = 0; tries < 500; tries++) {
+        for (uint32_t idx = 0; idx + length <= g_stream_length; idx++) {
+            if(memcmp(g_stream + idx, marker, length) == 0) {
+                return 0;
+            }
+        }
+        Sleep(10);
+    }
+    return -1;
+}
+
+// Checks that the records of each thread are found in the order in which
+// they were logged, returning the amount of records found.
+static uint32_t _check_order(uint32_t *unordered)
+{
+    int32_t last[THREADS]; uint32_t ret = 0, offset = 4;
+    bson_iterator it, args; bson b;
+
+    memset(last, 0xff, sizeof(last));
+    *unordered = 0;
+
+    // Skip the process identifier and the "BSON <pid>" header.
+    while (offset < g_stream_length && g_stream[offset++] != '\n');
+
+    while (offset + 4 <= g_stream_length) {
+        uint32_t length = *(uint32_t *)(g_stream + offset);
+        bson_init_finished_data(&b, (char *) g_stream + offset, 0);
+        offset += length;
+
+        if(bson_find(&it, &b, "type") != BSON_EOO ||
+                bson_find(&it, &b, "I") == BSON_EOO ||
+                (uint32_t) bson_iterator_int(&it) != sig_index_anomaly() ||
+                bson_find(&it, &b, "args") == BSON_EOO) {
+            continue;
+        }
+
+        const char *thread = NULL, *counter = NULL;
+
+        bson_iterator_subiterator(&it, &args);
+        while (bson_iterator_next(&args) != BSON_EOO) {
+            if(strcmp(bson_iterator_key(&args), "4") == 0) {
+                thread = bson_iterator_string(&args);
+            }
+            if(strcmp(bson_iterator_key(&args), "5") == 0) {
+                counter = bson_iterator_string(&args);
+            }
+        }
+
+        if(thread != NULL && counter != NULL) {
+            uint32_t index = atoi(thread) % THREADS;
+            *unordered += atoi(counter) != last[index] + 1;
+            last[index] = atoi(counter);
+            ret++;
+        }
+    }
+    return ret;
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+    misc_init("hoi");
+    copy_init();
+
+    g_stream = VirtualAlloc(NULL, STREAMSIZE, MEM_COMMIT|MEM_RESERVE,
+        PAGE_READWRITE);
+    g_pipe = CreateNamedPipeW(g_pipe_name, PIPE_ACCESS_INBOUND,
+        PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0, 0x10000, 0, NULL);
+    assert(g_stream != NULL && g_pipe != INVALID_HANDLE_VALUE);
+
+    CreateThread(NULL, 0, &_thread_reader, NULL, 0, NULL);
+
+    char pipe_name[64];
+    sprintf(pipe_name, "%S", g_pipe_name);
+    log_init(pipe_name, 0, 0, 0);
+
+    uint32_t unordered, async_ms = _run();
+    log_action("logring-async-done");
+    assert(_wait_for("logring-async-done") == 0);
+    assert(_check_order(&unordered) == THREADS * RECORDS);
+    assert(unordered == 0);
+
+    // From here on every record is written by the thread logging it.
+    log_exit();
+
+    uint32_t sync_ms = _run();
+    log_action("logring-sync-done");
+    assert(_wait_for("logring-sync-done") == 0);
+    assert(_check_order(&unordered) == 2 * THREADS * RECORDS);
+    assert(unordered == 0);
+
+    pipe("INFO:%d threads logging %d records each: rings %dms, "
+        "synchronous %dms", THREADS, RECORDS, async_ms, sync_ms);
+    pipe("INFO:Test finished!");
+    return 0;
+}
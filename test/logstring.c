@@ -0,0 +1,151 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that log_string() and log_wstring(), which encode straight into the
+// bson object, log the same strings as encoding them into a temporary
+// buffer first, and benchmarks both on a path-heavy trace.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "bson.h"
+#include "hooking.h"
+#include "log.h"
+#include "memory.h"
+#include "misc.h"
+#include "native.h"
+#include "pipe.h"
+#include "utf8.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 100000
+
+static const wchar_t *g_trace[] = {
+    L"\\??\\C:\\Windows\\System32\\kernel32.dll",
+    L"C:\\Users\\Administrator\\AppData\\Local\\Temp\\~DF1234.tmp",
+    L"\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion",
+    L"C:\\Program Files\\Common Files\\microsoft shared\\OFFICE14\\MSO.DLL",
+    L"C:\\Users\\J\u00fcrgen\\Documents\\r\u00e9sum\u00e9.docx",
+    L"C:\\Users\\\u7528\u6237\\\u684c\u9762\\\u6587\u4ef6.txt",
+    L"\xd83d\xde00 high \xd83d",
+};
+
+#define TRACE_COUNT (sizeof(g_trace) / sizeof(g_trace[0]))
+
+// Encodes the string into a temporary buffer first, as log_wstring() used
+// to do.
+static void _log_wstring_copy(bson *b, const char *idx,
+    const wchar_t *str, int length)
+{
+    char *utf8s = copy_utf8_wstring(str, length);
+    bson_append_string_n(b, idx, utf8s + 4, *(int *) utf8s);
+    scratch_free(utf8s);
+}
+
+static void _record(bson *b, uint32_t idx, int copy)
+{
+    const wchar_t *a = g_trace[idx % TRACE_COUNT];
+    const wchar_t *c = g_trace[(idx + 1) % TRACE_COUNT];
+
+    bson_init(b);
+    bson_append_start_array(b, "args");
+    if(copy != 0) {
+        _log_wstring_copy(b, "0", a, lstrlenW(a));
+        _log_wstring_copy(b, "1", c, lstrlenW(c));
+    }
+    else {
+        log_wstring(b, "0", a, lstrlenW(a));
+        log_wstring(b, "1", c, lstrlenW(c));
+    }
+    bson_append_finish_array(b);
+    bson_finish(b);
+}
+
+static uint32_t _elapsed_ns(LARGE_INTEGER start, uint32_t count)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000000000 /
+        freq.QuadPart / count);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+    copy_init();
+
+    bson a, b;
+
+    for (uint32_t idx = 0; idx < TRACE_COUNT; idx++) {
+        _record(&a, idx, 1);
+        _record(&b, idx, 0);
+        assert(bson_size(&a) == bson_size(&b) &&
+            memcmp(bson_data(&a), bson_data(&b), bson_size(&a)) == 0);
+        bson_destroy(&a);
+        bson_destroy(&b);
+    }
+
+    // Characters that encode to two bytes each.
+    bson_init(&a);
+    bson_init(&b);
+    bson_append_string_n(&a, "0", "\xc3\xbf\xc2\x80", 4);
+    log_string(&b, "0", "\xff\x80", 2);
+    bson_finish(&a);
+    bson_finish(&b);
+    assert(bson_size(&a) == bson_size(&b) &&
+        memcmp(bson_data(&a), bson_data(&b), bson_size(&a)) == 0);
+    bson_destroy(&a);
+    bson_destroy(&b);
+
+    LARGE_INTEGER start;
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        _record(&a, idx, 1);
+        bson_destroy(&a);
+    }
+    uint32_t copy_ns = _elapsed_ns(start, 2 * ITERATIONS);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        _record(&b, idx, 0);
+        bson_destroy(&b);
+    }
+    uint32_t direct_ns = _elapsed_ns(start, 2 * ITERATIONS);
+
+    pipe("INFO:per path: temporary buffer %dns, direct %dns",
+        copy_ns, direct_ns);
+    pipe("INFO:Test finished!");
+    return 0;
+}
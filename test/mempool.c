@@ -0,0 +1,261 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmarks the size-class pool behind mem_alloc() against the previous
+// approach of one virtual_alloc() per allocation. The allocation pattern
+// resembles that of a logged hooked call, i.e., a BSON buffer, a couple of
+// UTF-8 strings and a memdup() prelog buffer.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 100000
+#define LIVECALLS  256
+#define THREADS    64
+
+// The first entry is set to mem_suggested_size(1024) as used by log_api().
+static uint32_t g_sizes[] = {
+    0, 48, 130, 256,
+};
+
+#define ALLOCS_PER_CALL (sizeof(g_sizes) / sizeof(uint32_t))
+
+static void *g_ptrs[LIVECALLS][ALLOCS_PER_CALL];
+
+// Bytes of address space that are reserved or committed, or only those
+// bytes that are committed.
+static uintptr_t _address_space(int committed)
+{
+    MEMORY_BASIC_INFORMATION mbi; uintptr_t ret = 0;
+    const uint8_t *addr = NULL;
+
+    while (VirtualQuery(addr, &mbi, sizeof(mbi)) == sizeof(mbi)) {
+        if(mbi.State == MEM_COMMIT ||
+                (committed == 0 && mbi.State == MEM_RESERVE)) {
+            ret += mbi.RegionSize;
+        }
+        addr = (const uint8_t *) mbi.BaseAddress + mbi.RegionSize;
+    }
+    return ret;
+}
+
+// Size class index of an allocation of length bytes.
+static uint32_t _class_index(uint32_t length)
+{
+    uint32_t index = 0;
+    while ((MEM_POOL_MINSIZE << index) < length + 2 * sizeof(void *)) {
+        index++;
+    }
+    return index;
+}
+
+static uint32_t _elapsed_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+}
+
+static void *_direct_alloc(uint32_t length)
+{
+    return virtual_alloc(NULL, length + sizeof(uintptr_t),
+        MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void _direct_free(void *ptr)
+{
+    virtual_free(ptr, 0, MEM_RELEASE);
+}
+
+static DWORD WINAPI _thread_calls(LPVOID param)
+{
+    void *ptrs[ALLOCS_PER_CALL];
+    for (uint32_t idx = 0; idx < ITERATIONS / THREADS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            ptrs[jdx] = mem_alloc(g_sizes[jdx]);
+        }
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            mem_free(ptrs[jdx]);
+        }
+    }
+
+    // Leave one allocation behind for the main thread to free.
+    *(void **) param = mem_alloc(g_sizes[1]);
+    mem_cache_release();
+    return 0;
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    g_sizes[0] = mem_suggested_size(1024);
+
+    LARGE_INTEGER start; mem_stats_t before, after;
+    HANDLE threads[THREADS]; void *remote[THREADS];
+    uintptr_t space_base[2], space_direct[2], space_pool[2];
+
+    // One syscall for each allocation and each deallocation.
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            g_ptrs[0][jdx] = _direct_alloc(g_sizes[jdx]);
+        }
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            _direct_free(g_ptrs[0][jdx]);
+        }
+    }
+    pipe("INFO:direct: %d calls in %dms, %d syscalls per call",
+        ITERATIONS, _elapsed_ms(start), 2 * ALLOCS_PER_CALL);
+
+    mem_stats(&before);
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            g_ptrs[0][jdx] = mem_alloc(g_sizes[jdx]);
+        }
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            mem_free(g_ptrs[0][jdx]);
+        }
+    }
+
+    mem_stats(&after);
+    pipe("INFO:pool: %d calls in %dms, %d syscalls in total",
+        ITERATIONS, _elapsed_ms(start), after.syscalls - before.syscalls);
+
+    assert(after.syscalls - before.syscalls < ITERATIONS / 100);
+    assert(after.direct == before.direct);
+
+    // Address space used while a number of hooked calls are in-flight.
+    for (int committed = 0; committed < 2; committed++) {
+        space_base[committed] = _address_space(committed);
+    }
+    for (uint32_t idx = 0; idx < LIVECALLS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            g_ptrs[idx][jdx] = _direct_alloc(g_sizes[jdx]);
+        }
+    }
+    for (int committed = 0; committed < 2; committed++) {
+        space_direct[committed] =
+            _address_space(committed) - space_base[committed];
+    }
+    for (uint32_t idx = 0; idx < LIVECALLS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            _direct_free(g_ptrs[idx][jdx]);
+        }
+    }
+
+    // The pool region that was reserved earlier on is counted as well.
+    mem_stats(&before);
+    for (int committed = 0; committed < 2; committed++) {
+        space_base[committed] = _address_space(committed);
+    }
+    for (uint32_t idx = 0; idx < LIVECALLS; idx++) {
+        for (uint32_t jdx = 0; jdx < ALLOCS_PER_CALL; jdx++) {
+            g_ptrs[idx][jdx] = mem_alloc(g_sizes[jdx]);
+        }
+    }
+    space_pool[0] = _address_space(0) - space_base[0] + before.reserved;
+    space_pool[1] = _address_space(1) - space_base[1];
+
+    pipe("INFO:address space for %d live calls: direct %dkb reserved, "
+        "%dkb committed; pool %dkb reserved, %dkb committed", LIVECALLS,
+        space_direct[0] / 1024, space_direct[1] / 1024,
+        space_pool[0] / 1024, space_pool[1] / 1024);
+    assert(space_pool[0] < space_direct[0]);
+    assert(space_pool[1] < space_direct[1]);
+
+    // Memory is recycled and zeroed.
+    void *ptr = g_ptrs[0][1];
+    memset(ptr, 0xcc, g_sizes[1]);
+    mem_free(ptr);
+    assert(mem_alloc(g_sizes[1]) == ptr && *(uint8_t *) ptr == 0);
+
+    // Growing within the same size class happens in-place.
+    assert(mem_realloc(ptr, g_sizes[1] + 8) == ptr);
+
+    // The same calls spread out over many threads, each thread hitting its
+    // own cache. Blocks that are freed by another thread end up back in
+    // the pool once the owning thread has released its cache.
+    mem_stats(&before);
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        threads[idx] = CreateThread(NULL, 0, &_thread_calls,
+            &remote[idx], 0, NULL);
+    }
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    mem_stats(&after);
+    pipe("INFO:pool: %d calls over %d threads in %dms, %d syscalls in total",
+        ITERATIONS, THREADS, _elapsed_ms(start),
+        after.syscalls - before.syscalls);
+
+    mem_cache_release();
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        assert(remote[idx] != NULL);
+        mem_free(remote[idx]);
+    }
+
+    int recycled = 0;
+    ptr = mem_alloc(g_sizes[1]);
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        recycled |= ptr == remote[idx];
+    }
+    assert(recycled != 0);
+
+    // Statistics of a thread are added up once its cache is released.
+    mem_cache_release();
+    mem_stats(&before);
+
+    ptr = mem_alloc(1000);
+    mem_cache_release();
+    mem_stats(&after);
+
+    assert(after.live - before.live == 1000);
+    assert(after.peak >= after.live);
+    assert(after.allocs[_class_index(1000)] -
+        before.allocs[_class_index(1000)] == 1);
+    pipe("INFO:Test finished!");
+    return 0;
+}
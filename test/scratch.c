@@ -0,0 +1,116 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the per-thread scratch arena as used by hook handlers.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "misc.h"
+#include "native.h"
+#include "pipe.h"
+#include "utf8.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+    misc_init("hoi");
+
+    scratch_t outer, inner; mem_stats_t before, after;
+    uint8_t *a, *b, *c, *d;
+
+    // Without an open scope everything goes through the regular heap.
+    assert(scratch_get(32) == NULL);
+    assert((a = scratch_alloc(32)) != NULL && scratch_contains(a) == 0);
+    scratch_free(a);
+
+    scratch_open(&outer);
+    assert((a = scratch_get(32)) != NULL && scratch_contains(a) != 0);
+    assert(((uintptr_t) a & (MEM_ALIGNMENT-1)) == 0);
+    memset(a, 0x41, 32);
+
+    // A nested scope leaves the allocations of the outer scope alone.
+    scratch_open(&inner);
+    assert((b = scratch_get(64)) != NULL && b > a);
+    scratch_close(&inner);
+    assert((c = scratch_get(64)) == b && a[31] == 0x41);
+
+    // The most recent allocation is resized in-place and may be handed
+    // back directly.
+    assert(scratch_realloc(c, 4096) == c);
+    scratch_free(c);
+    assert(scratch_get(16) == c);
+
+    // Unicode buffers and UTF-8 strings come from the arena as well.
+    wchar_t *w = get_unicode_buffer();
+    assert(scratch_contains(w) != 0 && *w == 0);
+    free_unicode_buffer(w);
+    assert(get_unicode_buffer() == w);
+
+    char *s = utf8_string("hello", 5);
+    assert(scratch_contains(s) != 0 && memcmp(s, "\x05\x00\x00\x00hello", 10) == 0);
+    scratch_free(s);
+
+    scratch_close(&outer);
+    assert(scratch_get(32) == NULL);
+
+    // A scope that is never closed, e.g., due to copy_return(), is healed
+    // by the enclosing scope.
+    scratch_open(&outer);
+    a = scratch_get(32);
+    scratch_open(&inner);
+    scratch_get(32);
+    scratch_close(&outer);
+    assert(scratch_get(32) == NULL);
+
+    // In the steady state a scope does not touch the heap at all.
+    mem_stats(&before);
+    for (uint32_t idx = 0; idx < 100000; idx++) {
+        scratch_open(&outer);
+        d = scratch_alloc(mem_suggested_size(1024));
+        w = get_unicode_buffer();
+        s = utf8_string("hello world", 11);
+        scratch_free(s);
+        free_unicode_buffer(w);
+        scratch_free(d);
+        scratch_close(&outer);
+    }
+    mem_stats(&after);
+    assert(after.syscalls == before.syscalls && scratch_contains(d) != 0);
+
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests that freed slab objects are recycled, both through the free list
+// of the slab and through the per-thread caches.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 10000
+#define OBJECTS    64
+#define THREADS    16
+
+static slab_t g_slab, g_cached;
+
+static DWORD WINAPI _thread_churn(LPVOID param)
+{
+    void *ptrs[OBJECTS];
+
+    // Objects are freed by the same thread and, for half of them, by the
+    // thread that started us.
+    for (uint32_t idx = 0; idx < ITERATIONS / THREADS; idx++) {
+        for (uint32_t jdx = 0; jdx < OBJECTS; jdx++) {
+            ptrs[jdx] = slab_getmem(&g_cached);
+        }
+        for (uint32_t jdx = 0; jdx < OBJECTS; jdx++) {
+            slab_free(&g_cached, ptrs[jdx]);
+        }
+    }
+
+    for (uint32_t jdx = 0; jdx < OBJECTS / 2; jdx++) {
+        ((void **) param)[jdx] = slab_getmem(&g_cached);
+    }
+
+    slab_cache_release();
+    return 0;
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    slab_init(&g_slab, 64, 16, PAGE_READWRITE);
+
+    uint8_t *a, *b, *c;
+
+    assert((a = slab_getmem(&g_slab)) != NULL);
+    assert((b = slab_getmem(&g_slab)) != NULL && b == a + 64);
+    assert((c = slab_getmem(&g_slab)) != NULL && c == b + 64);
+
+    // The most recently freed object is handed out first.
+    slab_free(&g_slab, a); slab_free(&g_slab, c);
+    assert(slab_getmem(&g_slab) == c && slab_getmem(&g_slab) == a);
+    assert(g_slab.used == 3);
+
+    slab_free(&g_slab, NULL);
+    assert(g_slab.used == 3);
+
+    // Mimic hooks being applied and released over and over again, as
+    // happens when a DLL is loaded and unloaded repeatedly. The slab does
+    // not grow beyond its peak usage.
+    void *ptrs[OBJECTS];
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        for (uint32_t jdx = 0; jdx < OBJECTS; jdx++) {
+            ptrs[jdx] = slab_getmem(&g_slab);
+        }
+        for (uint32_t jdx = 0; jdx < OBJECTS; jdx++) {
+            slab_free(&g_slab, ptrs[jdx]);
+        }
+    }
+    assert(g_slab.used == 3);
+    assert(g_slab.length == OBJECTS + 16);
+
+    // The same with a per-thread cache over multiple threads.
+    HANDLE threads[THREADS]; static void *remote[THREADS][OBJECTS / 2];
+
+    slab_init(&g_cached, 64, 16, PAGE_READWRITE);
+    assert(slab_enable_cache(&g_cached) == 0);
+
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        threads[idx] = CreateThread(NULL, 0, &_thread_churn,
+            remote[idx], 0, NULL);
+    }
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    assert(g_cached.used == THREADS * OBJECTS / 2);
+    assert(g_cached.length <= THREADS * (OBJECTS + SLAB_CACHE_DEPTH));
+
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        for (uint32_t jdx = 0; jdx < OBJECTS / 2; jdx++) {
+            slab_free(&g_cached, remote[idx][jdx]);
+        }
+    }
+    slab_cache_release();
+    assert(g_cached.used == 0);
+
+    // Everything is back on the free list, so no new chunks are needed.
+    uint32_t length = g_cached.length;
+    for (uint32_t idx = 0; idx < OBJECTS; idx++) {
+        ptrs[idx] = slab_getmem(&g_cached);
+    }
+    assert(g_cached.length == length);
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2017 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the thread-indexed table and benchmarks it against array_t with
+// many threads looking up their own state at the same time.
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define ITERATIONS 100000
+#define THREADS    64
+#define INSERTS    1024
+
+static array_t g_array;
+static table_t g_table, g_inserts;
+static HANDLE g_start;
+
+static volatile LONG g_errors;
+
+static uint32_t _elapsed_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)((end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart);
+}
+
+static DWORD WINAPI _thread_array(LPVOID param)
+{
+    uintptr_t tid = GetCurrentThreadId();
+    (void) param;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        array_set(&g_array, tid, (void *) tid);
+        if(array_get(&g_array, tid) != (void *) tid) {
+            InterlockedIncrement(&g_errors);
+        }
+    }
+    return 0;
+}
+
+static DWORD WINAPI _thread_table(LPVOID param)
+{
+    uintptr_t tid = GetCurrentThreadId();
+    (void) param;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        table_set(&g_table, tid, (void *) tid);
+        if(table_get(&g_table, tid) != (void *) tid) {
+            InterlockedIncrement(&g_errors);
+        }
+    }
+    return 0;
+}
+
+// All threads insert into the same, initially empty, table so that they
+// race on the creation of its nodes.
+static DWORD WINAPI _thread_inserts(LPVOID param)
+{
+    uintptr_t base = (uintptr_t) param;
+
+    WaitForSingleObject(g_start, INFINITE);
+    for (uintptr_t idx = 0; idx < INSERTS; idx++) {
+        table_set(&g_inserts, idx * THREADS + base, (void *)(idx + 1));
+    }
+    return 0;
+}
+
+static uint32_t _run(LPTHREAD_START_ROUTINE fn)
+{
+    HANDLE threads[THREADS]; LARGE_INTEGER start;
+
+    g_start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (uintptr_t idx = 0; idx < THREADS; idx++) {
+        threads[idx] = CreateThread(NULL, 0, fn, (void *) idx, 0, NULL);
+    }
+
+    QueryPerformanceCounter(&start);
+    SetEvent(g_start);
+
+    for (uint32_t idx = 0; idx < THREADS; idx++) {
+        WaitForSingleObject(threads[idx], INFINITE);
+        CloseHandle(threads[idx]);
+    }
+
+    CloseHandle(g_start);
+    return _elapsed_ms(start);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    table_t t;
+    table_init(&t);
+
+    assert(table_set(&t, 0, "hoi0") == 0);
+    assert(table_set(&t, 1, "hoi1") == 0);
+    assert(table_set(&t, 0x1234, "hoi2") == 0);
+    assert(table_set(&t, 0xfffffffc, "hoi3") == 0);
+
+    assert(strcmp(table_get(&t, 0x1234), "hoi2") == 0);
+    assert(strcmp(table_get(&t, 0xfffffffc), "hoi3") == 0);
+    assert(table_get(&t, 0x4000) == NULL);
+    assert(table_get(&t, 0x12345678) == NULL);
+
+    assert(table_unset(&t, 0x1234) == 0);
+    assert(table_unset(&t, 0x12345678) == -1);
+    assert(table_get(&t, 0x1234) == NULL);
+    assert(strcmp(table_get(&t, 1), "hoi1") == 0);
+
+    assert(strcmp(table_exchange(&t, 1, NULL), "hoi1") == 0);
+    assert(table_get(&t, 1) == NULL);
+    assert(table_exchange(&t, 0x12345678, NULL) == NULL);
+
+#if __x86_64__
+    assert(table_set(&t, 0x100000000, "hoi4") == -1);
+    assert(table_get(&t, 0x100000000) == NULL);
+#endif
+
+    array_init(&g_array);
+    table_init(&g_table);
+    table_init(&g_inserts);
+
+    uint32_t array_ms = _run(&_thread_array);
+    uint32_t table_ms = _run(&_thread_table);
+    pipe("INFO:%d threads doing %d lookups each: array %dms, table %dms",
+        THREADS, ITERATIONS, array_ms, table_ms);
+    assert(g_errors == 0);
+
+    _run(&_thread_inserts);
+
+    uint32_t missing = 0;
+    for (uintptr_t idx = 0; idx < INSERTS * THREADS; idx++) {
+        if(table_get(&g_inserts, idx) != (void *)(idx / THREADS + 1)) {
+            missing++;
+        }
+    }
+    assert(missing == 0);
+    pipe("INFO:Test finished!");
+    return 0;
+}
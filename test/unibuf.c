@@ -43,6 +43,7 @@ int main()
     pipe_init("\\\\.\\PIPE\\cuckoo", 0);
 
     hook_init(GetModuleHandle(NULL));
+    mem_init();
     assert(native_init() == 0);
     misc_init("hoi");
 
@@ -60,20 +61,31 @@ int main()
 
     assert((d = get_unicode_buffer()) != NULL);
 
-    // The first available pointer is always used when possible.
+    // The most recently freed pointer is used first.
     free_unicode_buffer(a); free_unicode_buffer(c);
-    assert(get_unicode_buffer() == a && get_unicode_buffer() == c);
+    assert(get_unicode_buffer() == c && get_unicode_buffer() == a);
 
     uint32_t bufcount = 0x1000/sizeof(void *) + 4;
 
-    // Allocate X pointers and then free them. The last N pointers will
-    // not be managed by the custom memory manager. TODO Could improve these
-    // checks to show that memory is actually being allocated & deallocated.
+    // Allocate X pointers and then free them. All of them are recycled,
+    // so allocating them again doesn't require any new memory.
     static wchar_t *ptrs[0x1000];
     for (uint32_t idx = 0; idx < bufcount; idx++) {
         ptrs[idx] = get_unicode_buffer();
     }
 
+    for (uint32_t idx = 0; idx < bufcount; idx++) {
+        free_unicode_buffer(ptrs[idx]);
+    }
+
+    mem_stats_t before, after;
+    mem_stats(&before);
+    for (uint32_t idx = 0; idx < bufcount; idx++) {
+        ptrs[idx] = get_unicode_buffer();
+    }
+    mem_stats(&after);
+    assert(after.syscalls == before.syscalls);
+
     for (uint32_t idx = 0; idx < bufcount; idx++) {
         free_unicode_buffer(ptrs[idx]);
     }
@@ -81,6 +81,21 @@ int main()
     assert(memcmp(utf8_string("\x81", 1), "\x02\x00\x00\x00\xc2\x81", 6) == 0);
     assert(memcmp(utf8_wstring(L"\u8081", 1), "\x03\x00\x00\x00\xe8\x82\x81", 7) == 0);
 
+    // Encoding straight into a buffer yields the same bytes as the
+    // allocating variants, also for (invalid) surrogates.
+    static const wchar_t *wstrs[] = {
+        L"C:\\Windows\\\u00e9\u6587", L"\xd83d\xde00!", L"high \xd83d",
+        L"\xdc00 low", L"\x7f\x80\x7ff\x800\xffff",
+    };
+    for (uint32_t idx = 0; idx < sizeof(wstrs) / sizeof(wstrs[0]); idx++) {
+        int len = lstrlenW(wstrs[idx]);
+        char *utf8 = utf8_wstring(wstrs[idx], len); uint8_t out[64];
+        assert(utf8_encode_wstring(wstrs[idx], len, out) == *(int *) utf8 &&
+            memcmp(out, utf8 + 4, *(int *) utf8) == 0);
+    }
+    assert(utf8_encode_string("\x81 \xff", 3, buf) == 5 &&
+        memcmp(buf, "\xc2\x81 \xc3\xbf", 5) == 0);
+
     wchar_t uni[8];
     assert(utf8_decode_strn("\x24\xc2\xa2\xe2\x82\xac", uni, 8) == 3 &&
            wcscmp(uni, L"\u0024\u00a2\u20ac") == 0);
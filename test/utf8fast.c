@@ -0,0 +1,207 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis.
+Copyright (C) 2010-2018 Cuckoo Foundation.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Tests the ASCII fast paths of the UTF-8 encoders against a plain
+// character by character encoder for every code unit at every position of
+// a block, as well as for every pair of surrogates, and reports the
+// throughput of both. Also runs natively on the host through
+// "make host-tests".
+
+/// FINISH= yes
+/// FREE= yes
+/// PIPE= yes
+
+#include <stdio.h>
+#include <stdint.h>
+#include <windows.h>
+#include "hooking.h"
+#include "memory.h"
+#include "native.h"
+#include "pipe.h"
+#include "utf8.h"
+
+#define assert(expr) \
+    if((expr) == 0) { \
+        pipe("CRITICAL:Test didn't pass: %z", #expr); \
+    } \
+    else { \
+        pipe("INFO:Test passed: %z", #expr); \
+    }
+
+#define BLOCKSIZE 40
+#define ITERATIONS 200000
+
+static int _ref_encode_wstring(const wchar_t *s, int len, uint8_t *out)
+{
+    const uint8_t *base = out;
+    while (len-- != 0) {
+        if((uint16_t) *s >= 0xd800 && (uint16_t) *s < 0xdc00) {
+            if(len == 0) {
+                break;
+            }
+
+            uint32_t ch = ((uint32_t)(uint16_t) *s - 0xd800) << 10;
+            if((uint16_t) s[1] >= 0xdc00 && (uint16_t) s[1] < 0xe000) {
+                ch += (uint16_t) s[1] - 0xdc00;
+            }
+
+            out += utf8_encode(ch, out);
+            s += 2, len--;
+        }
+        else {
+            out += utf8_encode((uint16_t) *s++, out);
+        }
+    }
+    return out - base;
+}
+
+static int _ref_encode_string(const char *s, int len, uint8_t *out)
+{
+    const uint8_t *base = out;
+    while (len-- != 0) {
+        out += utf8_encode((uint8_t) *s++, out);
+    }
+    return out - base;
+}
+
+static uint32_t g_failures;
+
+static void _compare_wstring(const wchar_t *s, int len)
+{
+    uint8_t a[3 * BLOCKSIZE], b[3 * BLOCKSIZE];
+    int length = _ref_encode_wstring(s, len, a);
+
+    if(utf8_bytecnt_unicode(s, len) != length ||
+            utf8_encode_wstring(s, len, b) != length ||
+            memcmp(a, b, length) != 0) {
+        g_failures++;
+    }
+}
+
+static void _compare_string(const char *s, int len)
+{
+    uint8_t a[2 * BLOCKSIZE], b[2 * BLOCKSIZE];
+    int length = _ref_encode_string(s, len, a);
+
+    if(utf8_bytecnt_ascii(s, len) != length ||
+            utf8_encode_string(s, len, b) != length ||
+            memcmp(a, b, length) != 0) {
+        g_failures++;
+    }
+}
+
+static uint32_t _megabytes_per_second(LARGE_INTEGER start, uint64_t bytes)
+{
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (uint32_t)(bytes * freq.QuadPart /
+        (end.QuadPart - start.QuadPart + 1) / 1000000);
+}
+
+int main()
+{
+    pipe_init("\\\\.\\PIPE\\cuckoo", 0);
+
+    hook_init(GetModuleHandle(NULL));
+    mem_init();
+    assert(native_init() == 0);
+
+    wchar_t w[BLOCKSIZE]; char c[BLOCKSIZE];
+
+    for (uint32_t ch = 0; ch < 0x10000; ch++) {
+        for (int len = 1; len <= BLOCKSIZE; len += 3) {
+            for (int pos = 0; pos < len; pos++) {
+                for (int idx = 0; idx < len; idx++) {
+                    w[idx] = 'a' + idx % 26;
+                }
+                w[pos] = ch;
+                _compare_wstring(w, len);
+            }
+        }
+    }
+    assert(g_failures == 0);
+
+    for (uint32_t hi = 0xd800; hi < 0xe000; hi++) {
+        for (uint32_t lo = 0xd800; lo < 0xe000; lo++) {
+            for (int idx = 0; idx < 20; idx++) {
+                w[idx] = 'a';
+            }
+            w[hi % 18] = hi, w[hi % 18 + 1] = lo;
+            _compare_wstring(w, 20);
+            _compare_wstring(w, hi % 18 + 1);
+        }
+    }
+    assert(g_failures == 0);
+
+    for (uint32_t ch = 0; ch < 0x100; ch++) {
+        for (int len = 1; len <= BLOCKSIZE; len++) {
+            for (int pos = 0; pos < len; pos++) {
+                memset(c, 'a', len);
+                c[pos] = ch;
+                _compare_string(c, len);
+
+                uint8_t out[BLOCKSIZE];
+                int count = utf8_ascii_prefix(c, len, out);
+                if(count != (ch < 0x80 ? len : pos) ||
+                        memcmp(out, c, count) != 0) {
+                    g_failures++;
+                }
+            }
+        }
+    }
+    assert(g_failures == 0);
+
+    static const wchar_t *trace[] = {
+        L"\\??\\C:\\Windows\\System32\\kernel32.dll",
+        L"C:\\Users\\Administrator\\AppData\\Local\\Temp\\~DF1234.tmp",
+        L"\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion",
+        L"C:\\Users\\J\u00fcrgen\\Documents\\r\u00e9sum\u00e9.docx",
+    };
+
+    uint8_t out[256]; uint64_t bytes = 0; volatile int sink = 0;
+    LARGE_INTEGER start; int lengths[4];
+
+    for (uint32_t jdx = 0; jdx < 4; jdx++) {
+        lengths[jdx] = lstrlenW(trace[jdx]);
+    }
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        for (uint32_t jdx = 0; jdx < 4; jdx++) {
+            sink += _ref_encode_wstring(trace[jdx], lengths[jdx], out);
+            bytes += lengths[jdx] * sizeof(wchar_t);
+        }
+    }
+    uint32_t scalar = _megabytes_per_second(start, bytes);
+
+    bytes = 0;
+    QueryPerformanceCounter(&start);
+    for (uint32_t idx = 0; idx < ITERATIONS; idx++) {
+        for (uint32_t jdx = 0; jdx < 4; jdx++) {
+            sink += utf8_encode_wstring(trace[jdx], lengths[jdx], out);
+            bytes += lengths[jdx] * sizeof(wchar_t);
+        }
+    }
+    uint32_t fast = _megabytes_per_second(start, bytes);
+
+    pipe("INFO:UTF-16 input per second: scalar %dMB, fast %dMB",
+        scalar, fast);
+    pipe("INFO:Test finished!");
+    return 0;
+}
@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+"""
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2018 Cuckoo Foundation
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Reports the fixed memory footprint of the monitor, i.e., the size of each
+# section of the DLL once mapped into a process. Writable sections (.data,
+# .bss) become private to each process as soon as they're written to.
+
+import struct
+import sys
+
+IMAGE_SCN_MEM_WRITE = 0x80000000
+PAGE_SIZE = 0x1000
+
+def pages(size):
+    return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE
+
+def sections(filepath):
+    data = open(filepath, "rb").read()
+
+    pe_offset = struct.unpack("<I", data[0x3c:0x40])[0]
+    if data[pe_offset:pe_offset+4] != b"PE\x00\x00":
+        raise Exception("Not a PE file: %s" % filepath)
+
+    count, optsize = struct.unpack(
+        "<2xH12xH2x", data[pe_offset+4:pe_offset+24]
+    )
+
+    offset = pe_offset + 24 + optsize
+    for idx in range(count):
+        name, virtual_size, raw_size, characteristics = struct.unpack(
+            "<8sI4xI12xI", data[offset:offset+40]
+        )
+        yield (
+            name.rstrip(b"\x00").decode("latin1"),
+            virtual_size, raw_size, characteristics
+        )
+        offset += 40
+
+def report(filepath):
+    print "%s:" % filepath
+    print "  %-10s %10s %10s %s" % ("section", "mapped", "raw", "")
+
+    total, writable = 0, 0
+    for name, virtual_size, raw_size, flags in sections(filepath):
+        is_writable = flags & IMAGE_SCN_MEM_WRITE != 0
+        print "  %-10s %10d %10d %s" % (
+            name, pages(virtual_size), raw_size,
+            "writable" if is_writable else ""
+        )
+
+        total += pages(virtual_size)
+        if is_writable:
+            writable += pages(virtual_size)
+
+    print "  total %dkb mapped, at most %dkb private per process" % (
+        total / 1024, writable / 1024
+    )
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print "Usage: %s <monitor.dll..>" % sys.argv[0]
+        sys.exit(1)
+
+    for filepath in sys.argv[1:]:
+        report(filepath)
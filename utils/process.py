@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
 import argparse
+import collections
 import copy
 import docutils.nodes
 import docutils.utils
@@ -25,6 +26,7 @@ import docutils.parsers.rst
 import jinja2
 import json
 import os
+import struct
 import sys
 import yaml
 
@@ -53,6 +55,76 @@ class DefinitionProcessor(object):
             f.write(self.template(template).render(**kwargs))
 
 
+class BsonConstant(str):
+    """A 32-bit integer that is only known as a C constant expression."""
+
+
+class BsonSerializer(object):
+    """Serializes a BSON document at build time. Documents are either
+    OrderedDicts or lists, the latter being encoded as BSON arrays.
+
+    As some values (e.g., flag values) are only known to the C compiler, the
+    serialized document is a list of parts, each being either a string of
+    raw bytes or a BsonConstant that takes up four bytes."""
+
+    def length(self, parts):
+        return sum(4 if isinstance(part, BsonConstant) else len(part)
+                   for part in parts)
+
+    def cstring(self, value):
+        if isinstance(value, unicode):
+            value = value.encode('utf8')
+        return value + '\x00'
+
+    def element(self, key, value):
+        key = self.cstring(key)
+        if isinstance(value, BsonConstant):
+            return ['\x10' + key, value]
+        if isinstance(value, (int, long)):
+            return ['\x10' + key + struct.pack('<i', value)]
+        if isinstance(value, basestring):
+            value = self.cstring(value)
+            return ['\x02' + key + struct.pack('<i', len(value)) + value]
+        if isinstance(value, list):
+            return ['\x04' + key] + self.document(value)
+        if isinstance(value, dict):
+            return ['\x03' + key] + self.document(value)
+        raise Exception('Unsupported BSON value: %r.' % value)
+
+    def document(self, doc):
+        if isinstance(doc, list):
+            doc = collections.OrderedDict(
+                (str(idx), value) for idx, value in enumerate(doc)
+            )
+
+        parts = []
+        for key, value in doc.items():
+            parts.extend(self.element(key, value))
+
+        length = self.length(parts) + 5
+        return [struct.pack('<i', length)] + parts + ['\x00']
+
+    def initializer(self, doc, width=72):
+        """Returns the lines of a C array initializer for the document.
+        BsonConstant values are emitted through the EXPLAIN_INT32 macro."""
+        tokens = []
+        for part in self.document(doc):
+            if isinstance(part, BsonConstant):
+                tokens.append('EXPLAIN_INT32(%s)' % part)
+            else:
+                tokens.extend('0x%02x' % ord(ch) for ch in part)
+
+        lines, line = [], ''
+        for token in tokens:
+            if line and len(line) + len(token) + 2 > width:
+                lines.append(line)
+                line = ''
+            line += token + ', '
+        if line:
+            lines.append(line)
+        return [line.rstrip() for line in lines]
+
+
 class SignatureProcessor(object):
     CALLING_CONVENTIONS = {
         'WINAPI': 'WINAPI',
@@ -60,6 +132,45 @@ class SignatureProcessor(object):
         '__thiscall': '__thiscall',
     }
 
+    # Maximum amount of entries of the perfect hash table over the library
+    # names, see library_index().
+    LIBRARY_TABLE_MAXSIZE = 0x10000
+
+    # For each format specifier of log_api() the types of the values that it
+    # takes and the call that serializes them, see also src/log.c.
+    SERIALIZERS = {
+        's': (['const char *'], 'log_arg_string(&b, "{key}", {0})'),
+        'S': (['int', 'const char *'], 'log_string(&b, "{key}", {1}, {0})'),
+        'u': (['const wchar_t *'], 'log_arg_wstring(&b, "{key}", {0})'),
+        'U': (['int', 'const wchar_t *'],
+              'log_wstring(&b, "{key}", {1}, {0})'),
+        'b': (['uintptr_t', 'const uint8_t *'],
+              'log_arg_buffer(&b, "{key}", {0}, {1}, {override})'),
+        'B': (['uintptr_t *', 'const uint8_t *'],
+              'log_arg_bufferp(&b, "{key}", {0}, {1}, {override})'),
+        'i': (['int'], 'log_int32(&b, "{key}", {0})'),
+        'x': (['int'], 'log_int32(&b, "{key}", {0})'),
+        'I': (['uint32_t *'], 'log_arg_int32p(&b, "{key}", {0})'),
+        'l': (['uintptr_t'], 'log_intptr(&b, "{key}", {0})'),
+        'p': (['uintptr_t'], 'log_intptr(&b, "{key}", {0})'),
+        'L': (['uintptr_t *'], 'log_arg_intptrp(&b, "{key}", {0})'),
+        'P': (['uintptr_t *'], 'log_arg_intptrp(&b, "{key}", {0})'),
+        'o': (['ANSI_STRING *'], 'log_arg_ansi(&b, "{key}", {0})'),
+        'a': (['int', 'const char **'], 'log_argv(&b, "{key}", {0}, {1})'),
+        'A': (['int', 'const wchar_t **'],
+              'log_wargv(&b, "{key}", {0}, {1})'),
+        'r': (['uint32_t *', 'uint32_t *', 'uint8_t *'],
+              'log_arg_registry(&b, "{key}", {0}, {1}, {2}, 0)'),
+        'R': (['uint32_t *', 'uint32_t *', 'uint8_t *'],
+              'log_arg_registry(&b, "{key}", {0}, {1}, {2}, 1)'),
+        'q': (['int64_t'], 'log_int64(&b, "{key}", {0})'),
+        'Q': (['LARGE_INTEGER *'], 'log_arg_int64p(&b, "{key}", {0})'),
+        'z': (['bson *'], 'log_arg_bson(&b, "{key}", {0})'),
+        'c': (['REFCLSID'], 'log_arg_clsid(&b, "{key}", {0})'),
+        't': (['BSTR'], 'log_arg_bstr(&b, "{key}", {0})'),
+        'v': (['const VARIANT *'], 'log_arg_variant(&b, "{key}", {0})'),
+    }
+
     def __init__(self, data_dir, out_dir, sig_dirpath, flags, insns):
         self.data_dir = data_dir
         self.flags = flags
@@ -422,6 +533,12 @@ class SignatureProcessor(object):
             row['signature']['interesting'] = \
                 'interesting' in row['signature']
 
+            # Hooks that change the behavior of the monitor or the API call
+            # have to run their hook handler even when they're disabled.
+            row['log_only'] = not any(
+                row.get(key) for key in ('pre', 'middle', 'post', 'replace')
+            )
+
             yield row
 
     def process(self):
@@ -470,6 +587,7 @@ class SignatureProcessor(object):
                 "ignore": last == insn["funcname"],
                 "is_insn": True,
                 "is_hook": True,
+                "log_only": False,
                 "signature": {
                     "category": insn["category"],
                     "library": insn["module"],
@@ -487,6 +605,172 @@ class SignatureProcessor(object):
 
         self.sigs = sigs
 
+    def library_hash(self, library):
+        """Case-insensitive FNV-1a hash of a library name. Must match
+        _sig_library_hash() in data/hook-source.jinja2."""
+        ret = 0x811c9dc5
+        for ch in library.lower():
+            ret = ((ret ^ ord(ch)) * 0x01000193) & 0xffffffff
+        return ret
+
+    def library_index(self, sigs):
+        """Groups the hooks per library so that monitor_hook() handles all
+        hooks of a library through a single lookup. Returns the hooks in
+        their new order, the range of hooks of each library, and a perfect
+        hash table over the library names."""
+        order, grouped = [], {}
+        for sig in sigs:
+            if not sig['is_hook']:
+                continue
+
+            library = sig['signature']['library']
+            if library.lower() not in grouped:
+                order.append(library)
+                grouped[library.lower()] = []
+
+            grouped[library.lower()].append(sig)
+
+        hooks, libraries = [], []
+        for library in order:
+            libraries.append({
+                'name': library,
+                'first': len(hooks),
+                'count': len(grouped[library.lower()]),
+            })
+            hooks.extend(grouped[library.lower()])
+
+        # Double the table size until no two libraries share a bucket. The
+        # table holds 16-bit indices, and libraries with the same hash would
+        # share a bucket at any size.
+        size = 16
+        while size <= self.LIBRARY_TABLE_MAXSIZE:
+            table = [0] * size
+            for idx, library in enumerate(libraries):
+                bucket = self.library_hash(library['name']) & (size - 1)
+                if table[bucket]:
+                    break
+                table[bucket] = idx + 1
+            else:
+                return hooks, libraries, table
+            size *= 2
+
+        raise Exception('Libraries %r and %r share a bucket in a library '
+                        'table of %d entries, rename either or change '
+                        'library_hash().' % (
+                            libraries[table[bucket] - 1]['name'],
+                            library['name'], size // 2))
+
+    def _split_arguments(self, text):
+        """Splits a comma-separated list of C expressions."""
+        ret, depth, start = [], 0, 0
+        for idx, ch in enumerate(text):
+            if ch in '([{':
+                depth += 1
+            elif ch in ')]}':
+                depth -= 1
+            elif ch == ',' and depth == 0:
+                ret.append(text[start:idx].strip())
+                start = idx + 1
+        ret.append(text[start:].strip())
+        return ret
+
+    def serializer(self, sig):
+        """Returns the parameters, the serialization calls, and the casted
+        arguments at the call site, of the dedicated serializer of a hook.
+        This unrolls the format string interpretation of log_api()."""
+        values = []
+        if sig.get('prelog'):
+            values.append((sig['prelog']['argtype'], ['prelen', 'prebuf']))
+
+        for param in sig.get('parameters', []):
+            if param['log']:
+                values.append((self.types[param['argtype']],
+                               [param['argname']]))
+
+        for param in sig.get('logging', []):
+            values.append((param['argtype'],
+                           self._split_arguments(param['argvalue'])))
+
+        params, calls, args = [], [], []
+        for fmt, exprs in values:
+            if fmt.lstrip('!') not in self.SERIALIZERS:
+                raise Exception('Unknown format %r in %r.' %
+                                (fmt, sig['apiname']))
+
+            override = int(fmt.startswith('!'))
+            types, call = self.SERIALIZERS[fmt.lstrip('!')]
+            if len(exprs) != len(types):
+                raise Exception('Format %r of %r takes %d values, got %r.' %
+                                (fmt, sig['apiname'], len(types), exprs))
+
+            names = []
+            for argtype, expr in zip(types, exprs):
+                names.append('a%d' % len(params))
+                params.append((argtype, names[-1]))
+
+                # Values are passed along as-is, just like through varargs.
+                if argtype == 'int':
+                    args.append('(int)(uintptr_t)(%s)' % expr)
+                else:
+                    args.append('(%s)(%s)' % (argtype, expr))
+
+            key = '%d' % (len(calls) + 2)
+            calls.append(call.format(key=key, override=override, *names))
+
+        return dict(params=params, calls=calls, args=args)
+
+    def explain(self, sig, index):
+        """Returns the explain record of a signature, i.e., the BSON
+        document that is sent to Cuckoo ahead of its first API call."""
+        fmt, names = '', []
+        if sig.get('prelog'):
+            fmt += sig['prelog']['argtype']
+            names.append(sig['prelog']['argname'])
+
+        for param in sig.get('parameters', []):
+            if param['log']:
+                fmt += self.types[param['argtype']]
+                names.append(param['alias'])
+
+        for param in sig.get('logging', []):
+            fmt += param['argtype']
+            names.append(param['argname'])
+
+        # Overrides do not take up an argument. On certain formats, we need
+        # to tell Cuckoo about them for nicer display / matching.
+        args = ['is_success', 'retval']
+        for ch in fmt.replace('!', ''):
+            argname = names[len(args)-2]
+            if ch in 'pP':
+                args.append([argname, 'p'])
+            elif ch == 'x':
+                args.append([argname, 'x'])
+            else:
+                args.append(argname)
+
+        flags_value = collections.OrderedDict()
+        flags_bitmask = collections.OrderedDict()
+        for flag in sig.get('flags', []):
+            flag_info = self.flags[flag['flagname']]
+            flags_value[flag['name']] = [
+                [BsonConstant(row), row] for row in flag_info['value']
+            ]
+            flags_bitmask[flag['name']] = [
+                [BsonConstant(row), row] for row in flag_info['enum']
+            ]
+
+        # Instruction hooks may not have a category, in which case it is
+        # reported as "None".
+        return collections.OrderedDict([
+            ('I', index),
+            ('name', sig['apiname']),
+            ('type', 'info'),
+            ('category', '%s' % sig['signature']['category']),
+            ('args', args),
+            ('flags_value', flags_value),
+            ('flags_bitmask', flags_bitmask),
+        ])
+
     def render(self, apis, debug=False):
         # If set, only hook the specified functions.
         for sig in self.sigs:
@@ -494,9 +778,21 @@ class SignatureProcessor(object):
                     not sig['apiname'].startswith('__'):
                 sig['ignore'] = True
 
+        # Pre-serialize the explain records. Signature indices at runtime
+        # only count the signatures that are not ignored.
+        bs = BsonSerializer()
+        sigs = [sig for sig in self.sigs if not sig.get('ignore')]
+        for index, sig in enumerate(sigs):
+            sig['explain'] = bs.initializer(self.explain(sig, index))
+            if sig['is_hook'] and not sig.get('is_insn'):
+                sig['serializer'] = self.serializer(sig)
+
+        hooks, libraries, table = self.library_index(sigs)
+
         self.dp.render('hook-header', self.hooks_h, sigs=self.sigs)
         self.dp.render('hook-source', self.hooks_c,
-                       sigs=self.sigs, types=self.types, debug=debug)
+                       sigs=self.sigs, types=self.types, debug=debug,
+                       hooks=hooks, libraries=libraries, library_table=table)
         self.dp.render('hook-info-header', self.hook_info_h,
                        sigs=self.sigs, first_hook=len(self.base_sigs))
 
@@ -762,7 +1058,7 @@ if __name__ == '__main__':
     fp.process(args.flags_directory)
 
     dp = SignatureProcessor(args.data_directory, args.output_directory,
-                            args.signatures_directory, fp.flags.keys(), ip)
+                            args.signatures_directory, fp.flags, ip)
     dp.process()
 
     apis = []